@@ -1,8 +1,44 @@
 #include "cnn.h"
+#include <thread>
+#include <algorithm>
 
 extern const char* CLASS_NAME[];
+extern device_t devices[];
+extern int num_devices;
 
-double pooling_sec, conv_sec, conv1_sec, conv2_sec, conv3_sec, conv4_sec, conv5_sec, fc_sec, softmax_sec, find_max_sec, RELU_sec;
+extern double before_kernel_sec, profile_sec;
+extern long long write_nsec, kernel_nsec, read_nsec;
+
+double pooling_sec, conv_sec, conv_block_sec[MAX_BLOCKS], fc_sec, softmax_sec, find_max_sec, RELU_sec;
+
+// automatic batch size (batch_size 0)
+#define AUTO_BATCH_MEM_FRACTION 0.9 // of the device memory left after the weights
+#define AUTO_BATCH_MAX 4096         // larger batches only cost memory
+#define AUTO_BATCH_PROBES 4         // candidate sizes, halving from the largest that fits
+#define AUTO_BATCH_TOLERANCE 0.05   // a smaller batch within this of the best throughput wins
+
+#ifdef LAYOUT_NCHWC
+#define CHANNEL_BLOCK LAYOUT_NCHWC
+#define ACT_INDEX(c, i, j, N) ((((c) / LAYOUT_NCHWC) * PLANE_SIZE(N) + PIXEL_INDEX(i, j, N)) * LAYOUT_NCHWC + (c) % LAYOUT_NCHWC)
+#else
+#define CHANNEL_BLOCK 1
+#define ACT_INDEX(c, i, j, N) ((c) * PLANE_SIZE(N) + PIXEL_INDEX(i, j, N))
+#endif
+
+/*
+ * Zero the halo ring of an N x N plane of pixels of C floats (ZERO_HALO).
+ */
+static void zero_halo(float *plane, int N, int C) {
+#ifdef ZERO_HALO
+	const int W = N + 2;
+	memset(plane, 0, sizeof(float) * W * C);
+	memset(plane + (size_t)(W - 1) * W * C, 0, sizeof(float) * W * C);
+	for (int i = 1; i < W - 1; i++) {
+		memset(plane + (size_t)i * W * C, 0, sizeof(float) * C);
+		memset(plane + ((size_t)i * W + W - 1) * C, 0, sizeof(float) * C);
+	}
+#endif
+}
 
 static void pooling2x2(float *input, float *output, int N) {
     int i, j, k, l;
@@ -11,19 +47,68 @@ static void pooling2x2(float *input, float *output, int N) {
             float max = 0;
             for (k = 0; k < 2; k++) {
                 for (l = 0; l < 2; l++) {
-                    float pixel = input[(i * 2 + k) * 2 * N + j * 2 + l];
+                    float pixel = input[PIXEL_INDEX(i * 2 + k, j * 2 + l, 2 * N)];
                     max = (max > pixel) ? max : pixel;
                 }
             }
-            output[i * N + j] = max;
+            output[PIXEL_INDEX(i, j, N)] = max;
         }
     }
+    zero_halo(output, N, 1);
+}
+
+#ifdef LAYOUT_NCHWC
+/*
+ * Same as pooling2x2 on a (N * 2, N * 2, C) block of C channels.
+ * The innermost loop runs over contiguous channels.
+ */
+static void pooling2x2_nchwc(float *input, float *output, int N) {
+	const int C = LAYOUT_NCHWC;
+	for (int i = 0; i < N; i++) {
+		for (int j = 0; j < N; j++) {
+			float *out = output + PIXEL_INDEX(i, j, N) * C;
+			for (int c = 0; c < C; c++)
+				out[c] = 0;
+			for (int k = 0; k < 2; k++) {
+				for (int l = 0; l < 2; l++) {
+					float *pixel = input + PIXEL_INDEX(i * 2 + k, j * 2 + l, 2 * N) * C;
+					for (int c = 0; c < C; c++)
+						out[c] = (out[c] > pixel[c]) ? out[c] : pixel[c];
+				}
+			}
+		}
+	}
+	zero_halo(output, N, C);
+}
+#endif
+
+/*
+ * (D, N, N) <-> the activation layout of conv and pool layers.
+ * D is zero-padded up to a multiple of C with LAYOUT_NCHWC, planes get their
+ * zero halo with ZERO_HALO.
+ */
+static void pack_activation(const float *input, float *output, int D, int N) {
+	for (int c = 0; c < CHANNEL_PAD(D); c++)
+		for (int i = 0; i < N; i++)
+			for (int j = 0; j < N; j++)
+				output[ACT_INDEX(c, i, j, N)] = (c < D) ? input[(c * N + i) * N + j] : 0;
+	for (int c = 0; c < CHANNEL_PAD(D); c += CHANNEL_BLOCK)
+		zero_halo(output + (size_t)c * PLANE_SIZE(N), N, CHANNEL_BLOCK);
+}
+
+static void unpack_activation(const float *input, float *output, int D, int N) {
+	for (int c = 0; c < D; c++)
+		for (int i = 0; i < N; i++)
+			for (int j = 0; j < N; j++)
+				output[(c * N + i) * N + j] = input[ACT_INDEX(c, i, j, N)];
 }
 
 /*
  * D = channel size
  * N = width and height of an output image
  * Thus, input is (D, N * 2, N * 2) and output is (D, N, N).
+ * With LAYOUT_NCHWC, input is (D/C, N * 2, N * 2, C) and output is (D/C, N, N, C).
+ * With ZERO_HALO, every N x N plane is stored as (N + 2) x (N + 2).
  */
 void pooling_layer(float *inputs, float *outputs, int D, int N) {
 #ifdef PROFILE_ENABLE
@@ -31,15 +116,23 @@ void pooling_layer(float *inputs, float *outputs, int D, int N) {
 	duration<double> time_span;
 	t1 = high_resolution_clock::now();
 #endif
+#ifdef LAYOUT_NCHWC
+	for (int i = 0; i < CHANNEL_PAD(D) / LAYOUT_NCHWC; i++) {
+		float * input = inputs + i * PLANE_SIZE(N * 2) * LAYOUT_NCHWC;
+		float * output = outputs + i * PLANE_SIZE(N) * LAYOUT_NCHWC;
+		pooling2x2_nchwc(input, output, N);
+	}
+#else
 	for (int i = 0; i < D; i++) {
-        float * input = inputs + i * N * N * 4;
-        float * output = outputs + i * N * N;
+        float * input = inputs + i * PLANE_SIZE(N * 2);
+        float * output = outputs + i * PLANE_SIZE(N);
         pooling2x2(input, output, N);
     }
+#endif
 #ifdef PROFILE_ENABLE
 	t2 = high_resolution_clock::now();
 	time_span = duration_cast<duration<double>>(t2 - t1);
-	pooling_sec += time_span.count();
+	profile_add(&pooling_sec, time_span.count());
 #endif
 }
 
@@ -50,17 +143,110 @@ void pooling_layer(float *inputs, float *outputs, int D, int N) {
  * input image is zero-padded by 1.
  * Thus, input is (D1, N, N) and output is (D2, N, N)
  */
-void convolution_layer(float *inputs, float *outputs, cl_mem filters, cl_mem biases, int D2, int D1, int N, int batch_size, int imageCnt) {
+void convolution_layer(arena_t *inputs, arena_t *outputs, cl_mem filters, cl_mem biases, cl_mem blocks, int D2, int D1, int N, int imageCnt) {
+#ifdef PROFILE_ENABLE
+	high_resolution_clock::time_point t1, t2;
+	duration<double> time_span;
+	t1 = high_resolution_clock::now();
+#endif
+	clConv(inputs, outputs, filters, biases, blocks, D2, D1, N, imageCnt);
+#ifdef PROFILE_ENABLE
+	t2 = high_resolution_clock::now();
+	time_span = duration_cast<duration<double>>(t2 - t1);
+	profile_add(&conv_sec, time_span.count());
+#endif
+}
+
+void convolution_shard_layer(float *inputs, float *outputs, layer_t *layer, int imageCnt) {
+#ifdef PROFILE_ENABLE
+	high_resolution_clock::time_point t1, t2;
+	duration<double> time_span;
+	t1 = high_resolution_clock::now();
+#endif
+	clConvShards(inputs, outputs, layer, imageCnt);
+#ifdef PROFILE_ENABLE
+	t2 = high_resolution_clock::now();
+	time_span = duration_cast<duration<double>>(t2 - t1);
+	profile_add(&conv_sec, time_span.count());
+#endif
+}
+
+/*
+ * First output channel of shard s of a sharded conv layer, a multiple of
+ * LAYOUT_NCHWC so every shard holds whole channel blocks.
+ */
+int shard_begin(const layer_t *layer, int s) {
+#ifdef LAYOUT_NCHWC
+	const int step = LAYOUT_NCHWC;
+#else
+	const int step = 1;
+#endif
+	return CHANNEL_PAD(layer->D2) / step * s / layer->num_shards * step;
+}
+
+// softmax confidence at which an image leaves at an exit head (EARLY_EXIT)
+float exit_threshold = 0;
+
+// number of native threads for layers scheduled on TARGET_HOST
+int host_threads = 1;
+
+/*
+ * Convolution of the (image, output channel) pairs [first, last) on the host,
+ * in the same activation layout as the device kernels.
+ */
+static void convolution_host_range(float *inputs, float *outputs, float *filters, float *biases, int D2, int D1, int N, int first, int last) {
+	const size_t in_size = (size_t)CHANNEL_PAD(D1) * PLANE_SIZE(N);
+	const size_t out_size = (size_t)CHANNEL_PAD(D2) * PLANE_SIZE(N);
+	for (int w = first; w < last; w++) {
+		const int o = w % CHANNEL_PAD(D2);
+		float *input = inputs + in_size * (w / CHANNEL_PAD(D2));
+		float *output = outputs + out_size * (w / CHANNEL_PAD(D2));
+		for (int i = 0; i < N; i++) {
+			for (int j = 0; j < N; j++) {
+				if (o >= D2) {
+					output[ACT_INDEX(o, i, j, N)] = 0;
+					continue;
+				}
+				float sum = biases[o];
+				for (int c = 0; c < D1; c++) {
+					float *filter = filters + 3 * 3 * (o * D1 + c);
+					for (int k = 0; k < 3; k++) {
+						for (int l = 0; l < 3; l++) {
+							int x = i + k - 1;
+							int y = j + l - 1;
+							if (x >= 0 && x < N && y >= 0 && y < N)
+								sum += input[ACT_INDEX(c, x, y, N)] * filter[k * 3 + l];
+						}
+					}
+				}
+				output[ACT_INDEX(o, i, j, N)] = (sum > 0) ? sum : 0;
+			}
+		}
+	}
+}
+
+void convolution_host_layer(float *inputs, float *outputs, float *filters, float *biases, int D2, int D1, int N, int imageCnt) {
 #ifdef PROFILE_ENABLE
 	high_resolution_clock::time_point t1, t2;
 	duration<double> time_span;
 	t1 = high_resolution_clock::now();
 #endif
-	clConv(inputs, outputs, filters, biases, D2, D1, N, batch_size, imageCnt);
+	const int work = imageCnt * CHANNEL_PAD(D2);
+	const int num_threads = (host_threads < work) ? host_threads : work;
+	std::thread *threads = new std::thread[num_threads];
+	for (int t = 0; t < num_threads; t++)
+		threads[t] = std::thread(convolution_host_range, inputs, outputs, filters, biases, D2, D1, N,
+			work * t / num_threads, work * (t + 1) / num_threads);
+	for (int t = 0; t < num_threads; t++)
+		threads[t].join();
+	delete[] threads;
+	for (int batch = 0; batch < imageCnt; batch++)
+		for (int c = 0; c < CHANNEL_PAD(D2); c += CHANNEL_BLOCK)
+			zero_halo(outputs + (size_t)CHANNEL_PAD(D2) * PLANE_SIZE(N) * batch + (size_t)c * PLANE_SIZE(N), N, CHANNEL_BLOCK);
 #ifdef PROFILE_ENABLE
 	t2 = high_resolution_clock::now();
 	time_span = duration_cast<duration<double>>(t2 - t1);
-	conv_sec += time_span.count();
+	profile_add(&conv_sec, time_span.count());
 #endif
 }
 
@@ -87,7 +273,7 @@ static void fc_layer(float *input_neuron, float *output_neuron, float *weights,
 #ifdef PROFILE_ENABLE
 	t2 = high_resolution_clock::now();
 	time_span = duration_cast<duration<double>>(t2 - t1);
-	fc_sec += time_span.count();
+	profile_add(&fc_sec, time_span.count());
 #endif
 }
 
@@ -112,7 +298,7 @@ static void softmax(float *output, int N) {
 #ifdef PROFILE_ENABLE
 	t2 = high_resolution_clock::now();
 	time_span = duration_cast<duration<double>>(t2 - t1);
-	softmax_sec += time_span.count();
+	profile_add(&softmax_sec, time_span.count());
 #endif
 }
 
@@ -135,7 +321,7 @@ static int find_max(float *fc, int N) {
 #ifdef PROFILE_ENABLE
 	t2 = high_resolution_clock::now();
 	time_span = duration_cast<duration<double>>(t2 - t1);
-	find_max_sec += time_span.count();
+	profile_add(&find_max_sec, time_span.count());
 #endif
     return maxid;
 }
@@ -144,173 +330,1167 @@ float* alloc_layer(size_t n) {
     return (float*)malloc(n * sizeof(float));
 }
 
-void cnn_init() {
-	int platform_idx = 0;
-	int gpu_idx = 0;
-	
+// number of batches in flight on their own command queues
+static int num_lanes = 1;
+
+// answers to the cnn_init prompts
+static int platform_idx = 0, gpu_idx = 0;
+static int cpu_platform_idx = -1, cpu_idx = 0;
+static int num_shard_devices = 1;
+
+/*
+ * Ask what cnn_init asks, without touching OpenCL.
+ */
+void cnn_settings() {
 	printf("platform_idx : ");
 	scanf("%d", &platform_idx);
 	printf("gpu_idx : ");
 	scanf("%d", &gpu_idx);
+#ifdef ASYNC_DISPATCH
+	printf("num_queues : ");
+	scanf("%d", &num_lanes);
+	if (num_lanes < 1)
+		num_lanes = 1;
+#endif
+#ifdef HETERO_SCHEDULE
+	printf("cpu_platform_idx (-1 = none) : ");
+	scanf("%d", &cpu_platform_idx);
+	if (cpu_platform_idx >= 0) {
+		printf("cpu_idx : ");
+		scanf("%d", &cpu_idx);
+	}
+	printf("host_threads (0 = none) : ");
+	scanf("%d", &host_threads);
+#endif
+#ifdef EARLY_EXIT
+	printf("exit_threshold (0 = off) : ");
+	scanf("%f", &exit_threshold);
+#endif
+#ifdef MODEL_PARALLEL
+	printf("shard_devices : ");
+	scanf("%d", &num_shard_devices);
+#endif
+}
 
-	initOpenCL(platform_idx, gpu_idx);
+/*
+ * Write the answers of cnn_settings to f in the order it reads them, with
+ * gpu_idx moved up by device_offset (MULTI_PROCESS workers).
+ */
+void write_cnn_settings(FILE *f, int device_offset) {
+	fprintf(f, "%d\n%d\n", platform_idx, gpu_idx + device_offset);
+#ifdef ASYNC_DISPATCH
+	fprintf(f, "%d\n", num_lanes);
+#endif
+#ifdef HETERO_SCHEDULE
+	fprintf(f, "%d\n", cpu_platform_idx);
+	if (cpu_platform_idx >= 0)
+		fprintf(f, "%d\n", cpu_idx);
+	fprintf(f, "%d\n", host_threads);
+#endif
+#ifdef EARLY_EXIT
+	fprintf(f, "%.9g\n", exit_threshold);
+#endif
+#ifdef MODEL_PARALLEL
+	fprintf(f, "%d\n", num_shard_devices);
+#endif
 }
 
-cl_mem alloc_weight(float* filters, int D2, int D1);
-cl_mem alloc_bias(float* bias, int D2);
-
-void cnn(float *images, float **network, int *labels, float *confidences, int num_images, int batch_size) {
-    // slice the network into weights and biases
-    cl_mem w1_1, b1_1, w1_2, b1_2;
-	cl_mem w2_1, b2_1, w2_2, b2_2;
-	cl_mem w3_1, b3_1, w3_2, b3_2, w3_3, b3_3;
-	cl_mem w4_1, b4_1, w4_2, b4_2, w4_3, b4_3;
-	cl_mem w5_1, b5_1, w5_2, b5_2, w5_3, b5_3;
-	float *w1, *b1, *w2, *b2, *w3, *b3;
-    w1_1 = alloc_weight(network[0], 64, 3);     b1_1 = alloc_bias(network[1], 64);
-    w1_2 = alloc_weight(network[2], 64, 64);    b1_2 = alloc_bias(network[3], 64);
-    w2_1 = alloc_weight(network[4], 128, 64);   b2_1 = alloc_bias(network[5], 128);
-    w2_2 = alloc_weight(network[6], 128, 128);  b2_2 = alloc_bias(network[7], 128);
-    w3_1 = alloc_weight(network[8], 256, 128);  b3_1 = alloc_bias(network[9], 256);
-    w3_2 = alloc_weight(network[10], 256, 256); b3_2 = alloc_bias(network[11], 256);
-    w3_3 = alloc_weight(network[12], 256, 256); b3_3 = alloc_bias(network[13], 256);
-    w4_1 = alloc_weight(network[14], 512, 256); b4_1 = alloc_bias(network[15], 512);
-    w4_2 = alloc_weight(network[16], 512, 512); b4_2 = alloc_bias(network[17], 512);
-    w4_3 = alloc_weight(network[18], 512, 512); b4_3 = alloc_bias(network[19], 512);
-    w5_1 = alloc_weight(network[20], 512, 512); b5_1 = alloc_bias(network[21], 512);
-    w5_2 = alloc_weight(network[22], 512, 512); b5_2 = alloc_bias(network[23], 512);
-    w5_3 = alloc_weight(network[24], 512, 512); b5_3 = alloc_bias(network[25], 512);
-    w1 = network[26]; b1 = network[27];
-    w2 = network[28]; b2 = network[29];
-    w3 = network[30]; b3 = network[31];
-
-    // allocate memory for output of each layer
-    float *c1_1, *c1_2, *p1;
-    float *c2_1, *c2_2, *p2;
-    float *c3_1, *c3_2, *c3_3, *p3;
-    float *c4_1, *c4_2, *c4_3, *p4;
-    float *c5_1, *c5_2, *c5_3, *p5;
-    float *fc1, *fc2, *fc3;
-    c1_1 = alloc_layer(64 * 32 * 32 * batch_size);
-    c1_2 = alloc_layer(64 * 32 * 32 * batch_size);
-    p1   = alloc_layer(64 * 16 * 16 * batch_size);
-    c2_1 = alloc_layer(128 * 16 * 16 * batch_size);
-    c2_2 = alloc_layer(128 * 16 * 16 * batch_size);
-    p2   = alloc_layer(128 * 8 * 8 * batch_size);
-    c3_1 = alloc_layer(256 * 8 * 8 * batch_size);
-    c3_2 = alloc_layer(256 * 8 * 8 * batch_size);
-    c3_3 = alloc_layer(256 * 8 * 8 * batch_size);
-    p3   = alloc_layer(256 * 4 * 4 * batch_size);
-    c4_1 = alloc_layer(512 * 4 * 4 * batch_size);
-    c4_2 = alloc_layer(512 * 4 * 4 * batch_size);
-    c4_3 = alloc_layer(512 * 4 * 4 * batch_size);
-    p4   = alloc_layer(512 * 2 * 2 * batch_size);
-    c5_1 = alloc_layer(512 * 2 * 2 * batch_size);
-    c5_2 = alloc_layer(512 * 2 * 2 * batch_size);
-    c5_3 = alloc_layer(512 * 2 * 2 * batch_size);
-    p5   = alloc_layer(512 * 1 * 1 * batch_size);
-    fc1  = alloc_layer(512 * batch_size);
-    fc2  = alloc_layer(512 * batch_size);
-    fc3  = alloc_layer(10 * batch_size);
+void cnn_init() {
+	cnn_settings();
+	initOpenCL(platform_idx, gpu_idx);
 
-	high_resolution_clock::time_point t1, t2;
-	duration<double> time_span;
+#ifdef HETERO_SCHEDULE
+	if (cpu_platform_idx >= 0)
+		addDevice(cpu_platform_idx, cpu_idx, CL_DEVICE_TYPE_CPU);
+#endif
+#ifdef MODEL_PARALLEL
+	for (int k = 1; k < num_shard_devices && k < MAX_DEVICES; k++)
+		addDevice(platform_idx, gpu_idx + k, CL_DEVICE_TYPE_GPU);
+#endif
+}
 
-    // run network
-    for(int i = 0; i < num_images; i+=batch_size)
-    {
-        float *image = images + i * 3 * 32 * 32;
-		int imageCnt = batch_size;
-		if (num_images - i < batch_size)
-			imageCnt = num_images - i;
+cl_mem alloc_weight(device_t *dev, float* filters, int D2, int D1);
+cl_mem alloc_bias(device_t *dev, float* bias, int D2);
 
+/*
+ * Run one layer for a batch.
+ * in and out hold the images of the batch laid out back to back,
+ * only the first imageCnt of them are valid and computed.
+ * prev is the layer that produced in, NULL for the first layer.
+ */
+void run_layer(layer_t *layer, layer_t *prev, arena_t *in, arena_t *out, int imageCnt) {
+	const long long start_nsec = metrics_now();
+	const size_t in_size = layer_in_storage(layer);
+	const size_t out_size = layer_out_storage(layer);
+	float *inputs = in->host;
+	float *outputs = out->host;
+
+	switch (layer->type) {
+	case LAYER_CONV: {
 #ifdef PROFILE_ENABLE
+		high_resolution_clock::time_point t1, t2;
+		duration<double> time_span;
 		t1 = high_resolution_clock::now();
 #endif
-		convolution_layer(image, c1_1, w1_1, b1_1, 64, 3, 32, batch_size, imageCnt);
-		convolution_layer(c1_1, c1_2, w1_2, b1_2, 64, 64, 32, batch_size, imageCnt);
+		if (layer->num_shards > 1)
+			convolution_shard_layer(inputs, outputs, layer, imageCnt);
+		else if (layer->target == TARGET_HOST)
+			convolution_host_layer(inputs, outputs, layer->weights, layer->biases, layer->D2, layer->D1, layer->N, imageCnt);
+		else
+			convolution_layer(in, out, layer->w[layer->target], layer->b[layer->target], layer->blocks[layer->target], layer->D2, layer->D1, layer->N, imageCnt);
 #ifdef PROFILE_ENABLE
 		t2 = high_resolution_clock::now();
 		time_span = duration_cast<duration<double>>(t2 - t1);
-		conv1_sec += time_span.count();
+		profile_add(&conv_block_sec[layer->block], time_span.count());
 #endif
+		break;
+	}
+	case LAYER_POOL:
 		for (int batch = 0; batch < imageCnt; batch++)
-			pooling_layer(c1_2 + 64 * 32 * 32 * batch, p1 + 64 * 16 * 16 * batch, 64, 16);
+			pooling_layer(inputs + in_size * batch, outputs + out_size * batch, layer->D1, layer->N);
+		break;
+	case LAYER_FC: {
+		// fc weights expect (D, N, N), flatten a blocked or haloed input first
+		float *flat = NULL;
+		size_t in_storage = in_size;
+		if (prev && layer_out_storage(prev) != layer_out_size(prev)) {
+			flat = alloc_layer(in_size);
+			in_storage = layer_out_storage(prev);
+		}
+		for (int batch = 0; batch < imageCnt; batch++) {
+			float *input = inputs + in_storage * batch;
+			if (flat) {
+				unpack_activation(input, flat, prev->D2, prev->N);
+				input = flat;
+			}
+			fc_layer(input, outputs + out_size * batch, layer->weights, layer->biases, layer->D2, layer->D1);
+		}
+		free(flat);
+		break;
+	}
+	case LAYER_SOFTMAX:
+		memcpy(outputs, inputs, sizeof(float) * out_size * imageCnt);
+		for (int batch = 0; batch < imageCnt; batch++)
+			softmax(outputs + out_size * batch, layer->D2);
+		break;
+	}
+	metrics_layer(layer->index, metrics_now() - start_nsec);
+}
 
-#ifdef PROFILE_ENABLE
-		t1 = high_resolution_clock::now();
+/*
+ * Copy images [first_image, first_image + imageCnt) into the input tensor.
+ */
+void load_batch(run_t *run, float *input, int first_image, int imageCnt) {
+	const long long start_nsec = metrics_now();
+	layer_t *first = &run->net->layers[0];
+	const size_t image_size = layer_in_size(first);
+	float *image = run->images + first_image * image_size;
+	if (layer_in_storage(first) == image_size)
+		memcpy(input, image, sizeof(float) * image_size * imageCnt);
+	else
+		for (int batch = 0; batch < imageCnt; batch++)
+			pack_activation(image + image_size * batch, input + layer_in_storage(first) * batch, first->D1, first->N);
+	metrics_stage(STAGE_LOAD, metrics_now() - start_nsec);
+}
+
+#ifdef LOG_IMAGES
+// number of image i of the run in the images given to cnn()
+static int image_id(const run_t *run, int i) {
+	return run->image_id ? run->image_id[i] : i;
+}
 #endif
-		convolution_layer(p1, c2_1, w2_1, b2_1, 128, 64, 16, batch_size, imageCnt);
-		convolution_layer(c2_1, c2_2, w2_2, b2_2, 128, 128, 16, batch_size, imageCnt);
-#ifdef PROFILE_ENABLE
-		t2 = high_resolution_clock::now();
-		time_span = duration_cast<duration<double>>(t2 - t1);
-		conv2_sec += time_span.count();
+
+/*
+ * Take the label and confidence of each image from the network output.
+ */
+void classify_batch(run_t *run, float *output, int first_image, int imageCnt, const int *image_of) {
+	const long long start_nsec = metrics_now();
+	network_t *net = run->net;
+	const int num_classes = (int)layer_out_size(&net->layers[net->num_layers - 1]);
+
+	for (int batch = 0; batch < imageCnt; batch++)
+	{
+		const int i = image_of ? image_of[batch] : first_image + batch;
+		float *fc = output + num_classes * batch;
+		run->labels[i] = find_max(fc, num_classes);
+		run->confidences[i] = fc[run->labels[i]];
+
+#ifdef LOG_IMAGES
+		fprintf(stdout, "Image %04d/%04d: %s %f\n", image_id(run, i), run->total_images - 1, CLASS_NAME[run->labels[i]], run->confidences[i]);
 #endif
-		for (int batch = 0; batch < imageCnt; batch++)
-			pooling_layer(c2_2 + 128 * 16 * 16 * batch, p2 + 128 * 8 * 8 * batch, 128, 8);
+	}
+	metrics_stage(STAGE_CLASSIFY, metrics_now() - start_nsec);
+}
 
-#ifdef PROFILE_ENABLE
-		t1 = high_resolution_clock::now();
+/*
+ * Same as classify_batch, from the confidence and label pairs of the
+ * classifier head.
+ */
+void classify_results(run_t *run, const float *results, int first_image, int imageCnt, const int *image_of) {
+	const long long start_nsec = metrics_now();
+	for (int batch = 0; batch < imageCnt; batch++)
+	{
+		const int i = image_of ? image_of[batch] : first_image + batch;
+		run->labels[i] = (int)results[2 * batch + 1];
+		run->confidences[i] = results[2 * batch];
+
+#ifdef LOG_IMAGES
+		fprintf(stdout, "Image %04d/%04d: %s %f\n", image_id(run, i), run->total_images - 1, CLASS_NAME[run->labels[i]], run->confidences[i]);
 #endif
-		convolution_layer(p2, c3_1, w3_1, b3_1, 256, 128, 8, batch_size, imageCnt);
-		convolution_layer(c3_1, c3_2, w3_2, b3_2, 256, 256, 8, batch_size, imageCnt);
-		convolution_layer(c3_2, c3_3, w3_3, b3_3, 256, 256, 8, batch_size, imageCnt);
-#ifdef PROFILE_ENABLE
-		t2 = high_resolution_clock::now();
-		time_span = duration_cast<duration<double>>(t2 - t1);
-		conv3_sec += time_span.count();
+	}
+	metrics_stage(STAGE_CLASSIFY, metrics_now() - start_nsec);
+}
+
+/*
+ * Exit head after layer l, NULL if there is none or early exit is off.
+ */
+static exit_t* exit_after(run_t *run, int l) {
+	if (!run->early_exit || l < 0 || run->net->layers[l].exit < 0)
+		return NULL;
+	return &run->net->exits[run->net->layers[l].exit];
+}
+
+/*
+ * Evaluate an exit head on the output of its layer and classify the images
+ * that reach exit_threshold. The others are moved to the front of the batch,
+ * along with their entries in image_of.
+ * Returns the number of images that go on.
+ */
+static int apply_exit(run_t *run, exit_t *head, float *outputs, int *image_of, int imageCnt) {
+	const size_t size = layer_out_storage(&run->net->layers[head->after]);
+	const int N = head->N;
+	float *pooled = alloc_layer(head->D);
+	float *prob = alloc_layer(head->M);
+
+	int left = 0;
+	for (int batch = 0; batch < imageCnt; batch++) {
+		float *output = outputs + size * batch;
+		for (int c = 0; c < head->D; c++) {
+			float sum = 0;
+			for (int i = 0; i < N; i++)
+				for (int j = 0; j < N; j++)
+					sum += output[ACT_INDEX(c, i, j, N)];
+			pooled[c] = sum / (N * N);
+		}
+		for (int m = 0; m < head->M; m++) {
+			float sum = head->biases[m];
+			for (int c = 0; c < head->D; c++)
+				sum += head->weights[m * head->D + c] * pooled[c];
+			prob[m] = sum;
+		}
+		softmax(prob, head->M);
+
+		const int i = image_of[batch];
+		const int label = find_max(prob, head->M);
+		if (prob[label] >= exit_threshold) {
+			run->labels[i] = label;
+			run->confidences[i] = prob[label];
+			run->net->exit_of[i] = (int)(head - run->net->exits);
+			metrics_exit(run->net->exit_of[i]);
+#ifdef LOG_IMAGES
+			fprintf(stdout, "Image %04d/%04d: %s %f (exit %d)\n", image_id(run, i), run->total_images - 1, CLASS_NAME[label], prob[label], run->net->exit_of[i]);
 #endif
-		for (int batch = 0; batch < imageCnt; batch++)
-			pooling_layer(c3_3 + 256 * 8 * 8 * batch, p3 + 256 * 4 * 4 * batch, 256, 4);
+			continue;
+		}
+		if (left != batch) {
+			memmove(outputs + size * left, output, sizeof(float) * size);
+			image_of[left] = i;
+		}
+		left++;
+	}
 
-#ifdef PROFILE_ENABLE
-		t1 = high_resolution_clock::now();
+	free(pooled);
+	free(prob);
+	return left;
+}
+
+// width and channels of the input of layer t of the device layers, or of the output of the last
+static void device_tensor(run_t *run, int t, int *N, int *D) {
+	layer_t *layer = &run->net->layers[t < run->num_device_layers ? t : t - 1];
+	if (t == run->num_device_layers) {
+		*N = layer->N;
+		*D = layer->D2;
+	}
+	else {
+		*N = layer->type == LAYER_POOL ? 2 * layer->N : layer->N;
+		*D = layer->D1;
+	}
+}
+
+static int image_width_index(const image_plan_t *plan, int N) {
+	for (int s = 0; s < plan->num_widths; s++)
+		if (plan->width[s] == N)
+			return s;
+	return -1;
+}
+
+/*
+ * Lay out the image arrays of the device layers (IMAGE_ACTIVATIONS) if the
+ * device supports images and every layer is dense.
+ */
+static void plan_images(run_t *run) {
+	image_plan_t *plan = &run->image_plan;
+	memset(plan, 0, sizeof(image_plan_t));
+#if defined(IMAGE_ACTIVATIONS) && defined(ASYNC_DISPATCH) && !defined(HETERO_SCHEDULE)
+	device_t *dev = &devices[0];
+	if (run->num_device_layers == 0)
+		return;
+	if (!dev->image_support) {
+		printf("image activations : off, the device has no image support\n");
+		return;
+	}
+	for (int l = 0; l < run->num_device_layers; l++) {
+		if (run->net->layers[l].sparse_blocks) {
+			printf("image activations : off, layer %d is block-sparse\n", l);
+			return;
+		}
+	}
+	int max_slices = 0;
+	for (int t = 0; t <= run->num_device_layers; t++) {
+		int N, D;
+		device_tensor(run, t, &N, &D);
+		int s = image_width_index(plan, N);
+		if (s < 0) {
+			if (plan->num_widths == MAX_IMAGE_WIDTHS) {
+				printf("image activations : off, more than %d plane widths\n", MAX_IMAGE_WIDTHS);
+				return;
+			}
+			s = plan->num_widths++;
+			plan->width[s] = N;
+		}
+		plan->slices[s] = std::max(plan->slices[s], (CHANNEL_PAD(D) + 3) / 4);
+		max_slices = std::max(max_slices, plan->slices[s]);
+	}
+	plan->chunk = (int)(dev->image_max_array_size / max_slices);
+	if (plan->chunk < 1) {
+		printf("image activations : off, %d slices per image exceed CL_DEVICE_IMAGE_MAX_ARRAY_SIZE\n", max_slices);
+		return;
+	}
+	plan->enabled = 1;
+	printf("image activations : %d plane widths, up to %d images per pass\n", plan->num_widths, plan->chunk);
 #endif
-		convolution_layer(p3, c4_1, w4_1, b4_1, 512, 256, 4, batch_size, imageCnt);
-		convolution_layer(c4_1, c4_2, w4_2, b4_2, 512, 512, 4, batch_size, imageCnt);
-		convolution_layer(c4_2, c4_3, w4_3, b4_3, 512, 512, 4, batch_size, imageCnt);
-#ifdef PROFILE_ENABLE
-		t2 = high_resolution_clock::now();
-		time_span = duration_cast<duration<double>>(t2 - t1);
-		conv4_sec += time_span.count();
+}
+
+/*
+ * Mark the conv blocks that run as one conv_block kernel on the lane
+ * (FUSED_BLOCKS): small planes, dense filters, one channel count after the
+ * first conv, no exit head inside, and activations of at least one image
+ * that fit the local memory. Not with image activations.
+ */
+static void plan_fusion(run_t *run) {
+	network_t *net = run->net;
+	for (int l = 0; l < net->num_layers; l++)
+		net->layers[l].fused_last = -1;
+#if defined(FUSED_BLOCKS) && defined(ASYNC_DISPATCH) && !defined(HETERO_SCHEDULE)
+	device_t *dev = &devices[0];
+	if (run->image_plan.enabled)
+		return;
+	if (FUSED_GROUP_SIZE > dev->max_work_group_size)
+		return;
+	for (int l = 0; l < run->num_device_layers; l++) {
+		layer_t *first = &net->layers[l];
+		if (first->type != LAYER_CONV)
+			continue;
+		int last = l;
+		while (last + 1 < run->num_device_layers && net->layers[last + 1].type == LAYER_CONV && net->layers[last + 1].block == first->block)
+			last++;
+		if (last + 1 < run->num_device_layers && net->layers[last + 1].type == LAYER_POOL)
+			last++;
+
+		const int D1 = first->D1, D = first->D2, N = first->N;
+		int fuse = last > l && N * N <= FUSED_MAX_PIXELS &&
+			CHANNEL_PAD(D1) == D1 && CHANNEL_PAD(D) == D;
+		for (int k = l; k <= last && fuse; k++) {
+			layer_t *layer = &net->layers[k];
+			if (layer->type == LAYER_CONV)
+				fuse = k - l < FUSED_MAX_CONVS && !layer->sparse_blocks && layer->D2 == D && (k == l || layer->D1 == D);
+			if (k < last && exit_after(run, k))
+				fuse = 0;
+		}
+
+		int images = std::min(FUSED_IMAGES, FUSED_MAX_PIXELS / (N * N));
+		while (images > 0 && sizeof(float) * 2 * images * std::max(D1, D) * N * N > dev->local_mem_size)
+			images--;
+		if (fuse && images > 0) {
+			first->fused_last = last;
+			first->fused_images = images;
+			printf("fused block : layers %d - %d, %d images per work-group\n", l, last, images);
+		}
+		l = last;
+	}
 #endif
-		for (int batch = 0; batch < imageCnt; batch++)
-			pooling_layer(c4_3 + 512 * 4 * 4 * batch, p4 + 512 * 2 * 2 * batch, 512, 2);
+}
 
-#ifdef PROFILE_ENABLE
-		t1 = high_resolution_clock::now();
+/*
+ * Fuse the fc layers in front of a final softmax into run->head (FUSED_HEAD).
+ * It runs on the lane when it directly follows the device layers and its
+ * activations fit the local memory of a work-group.
+ */
+static void plan_head(run_t *run) {
+	network_t *net = run->net;
+	head_t *head = &run->head;
+	memset(head, 0, sizeof(head_t));
+	head->first = net->num_layers;
+#if defined(FUSED_HEAD) && !defined(HETERO_SCHEDULE)
+	const int last = net->num_layers - 1;
+	if (last < 1 || net->layers[last].type != LAYER_SOFTMAX)
+		return;
+	int first = last;
+	while (first > 1 && net->layers[first - 1].type == LAYER_FC && !exit_after(run, first - 1))
+		first--;
+	if (first == last)
+		return;
+	head->first = first;
+	head->num_fc = last - first;
+	for (int l = first; l < last; l++) {
+		layer_t *layer = &net->layers[l];
+		head->width = std::max(head->width, std::max(layer->D1, layer->D2));
+	}
+
+	device_t *dev = &devices[0];
+#ifdef ASYNC_DISPATCH
+	head->on_device = first == run->num_device_layers && !exit_after(run, first - 1) &&
+		sizeof(float) * 2 * HEAD_IMAGES * head->width <= dev->local_mem_size &&
+		HEAD_GROUP_SIZE <= dev->max_work_group_size;
+#endif
+	printf("classifier head : layers %d - %d on the %s\n", first, last, head->on_device ? "device" : "host");
+	if (!head->on_device)
+		return;
+
+	size_t num_params = 0;
+	for (int l = first; l < last; l++)
+		num_params += (size_t)net->layers[l].D1 * net->layers[l].D2 + net->layers[l].D2;
+	head->params = alloc_layer(num_params);
+	head->table = (int*)malloc(sizeof(int) * 4 * head->num_fc);
+	size_t offset = 0;
+	for (int f = 0; f < head->num_fc; f++) {
+		layer_t *layer = &net->layers[first + f];
+		const int D1 = layer->D1, D2 = layer->D2;
+		// (D2, D1) to (D1, D2), neighbouring work-items read neighbouring weights
+		float *weights = head->params + offset;
+		for (int j = 0; j < D2; j++)
+			for (int i = 0; i < D1; i++)
+				weights[(size_t)i * D2 + j] = layer->weights[(size_t)j * D1 + i];
+		memcpy(weights + (size_t)D1 * D2, layer->biases, sizeof(float) * D2);
+		head->table[4 * f] = D1;
+		head->table[4 * f + 1] = D2;
+		head->table[4 * f + 2] = (int)offset;
+		head->table[4 * f + 3] = (int)(offset + (size_t)D1 * D2);
+		offset += (size_t)D1 * D2 + D2;
+	}
+	head->dev_params = alloc_buffer(dev, head->params, sizeof(float) * num_params);
+	head->dev_table = alloc_buffer(dev, head->table, sizeof(int) * 4 * head->num_fc);
 #endif
-		convolution_layer(p4, c5_1, w5_1, b5_1, 512, 512, 2, batch_size, imageCnt);
-		convolution_layer(c5_1, c5_2, w5_2, b5_2, 512, 512, 2, batch_size, imageCnt);
-		convolution_layer(c5_2, c5_3, w5_3, b5_3, 512, 512, 2, batch_size, imageCnt);
+}
+
+static void free_head(head_t *head) {
+	if (head->dev_params)
+		release_buffer(head->dev_params);
+	if (head->dev_table)
+		release_buffer(head->dev_table);
+	free(head->params);
+	free(head->table);
+}
+
+/*
+ * Dot product with independent partial sums, so the compiler can keep them
+ * in vector registers.
+ */
+static float dot(const float *a, const float *b, int n) {
+	float partial[8] = { 0 };
+	int i = 0;
+	for (; i + 8 <= n; i += 8)
+		for (int k = 0; k < 8; k++)
+			partial[k] += a[i + k] * b[i + k];
+	float sum = 0;
+	for (; i < n; i++)
+		sum += a[i] * b[i];
+	for (int k = 0; k < 8; k++)
+		sum += partial[k];
+	return sum;
+}
+
+/*
+ * Host version of the classifier head on a whole batch. Each weight row is
+ * used for all images of the batch while it is in cache, and softmax and
+ * argmax take one exp per class.
+ * results gets the confidence and label of each image.
+ */
+static void classifier_head_host(run_t *run, const float *inputs, int imageCnt, float *results) {
 #ifdef PROFILE_ENABLE
-		t2 = high_resolution_clock::now();
-		time_span = duration_cast<duration<double>>(t2 - t1);
-		conv5_sec += time_span.count();
+	high_resolution_clock::time_point t1, t2;
+	duration<double> time_span;
+	t1 = high_resolution_clock::now();
 #endif
-		for (int batch = 0; batch < imageCnt; batch++)
-		{
-			pooling_layer(c5_3 + 512 * 2 * 2 * batch, p5 + 512 * 1 * 1 * batch, 512, 1);
+	const long long start_nsec = metrics_now();
+	network_t *net = run->net;
+	head_t *head = &run->head;
+	layer_t *prev = &net->layers[head->first - 1];
+	const int width = head->width;
+	float *cur = alloc_layer((size_t)width * imageCnt);
+	float *next = alloc_layer((size_t)width * imageCnt);
 
-			fc_layer(p5 + 512 * 1 * 1 * batch, fc1 + 512 * batch, w1, b1, 512, 512);
-			fc_layer(fc1 + 512 * batch, fc2 + 512 * batch, w2, b2, 512, 512);
-			fc_layer(fc2 + 512 * batch, fc3 + 10 * batch, w3, b3, 10, 512);
+	// fc weights expect (D, N, N)
+	const size_t in_storage = layer_out_storage(prev);
+	for (int batch = 0; batch < imageCnt; batch++) {
+		if (in_storage != layer_out_size(prev))
+			unpack_activation(inputs + in_storage * batch, cur + (size_t)width * batch, prev->D2, prev->N);
+		else
+			memcpy(cur + (size_t)width * batch, inputs + in_storage * batch, sizeof(float) * in_storage);
+	}
 
-			softmax(fc3 + 10 * batch, 10);
-			labels[i+batch] = find_max(fc3 + 10 * batch, 10);
-			confidences[i+batch] = (fc3+10*batch)[labels[i+batch]];
+	for (int f = 0; f < head->num_fc; f++) {
+		layer_t *layer = &net->layers[head->first + f];
+		for (int j = 0; j < layer->D2; j++) {
+			const float *weights = layer->weights + (size_t)j * layer->D1;
+			for (int batch = 0; batch < imageCnt; batch++)
+				next[(size_t)width * batch + j] = ReLU(dot(weights, cur + (size_t)width * batch, layer->D1) + layer->biases[j]);
+		}
+		std::swap(cur, next);
+	}
 
+	const int M = net->layers[net->num_layers - 2].D2;
+	for (int batch = 0; batch < imageCnt; batch++) {
+		const float *x = cur + (size_t)width * batch;
+		float max = x[0];
+		for (int i = 1; i < M; i++)
+			max = (x[i] > max) ? x[i] : max;
+		float sum = 0, best = 0;
+		int label = 0;
+		for (int i = 0; i < M; i++) {
+			const float e = expf(x[i] - max);
+			sum += e;
+			if (best < e) {
+				best = e;
+				label = i;
+			}
+		}
+		results[2 * batch] = best / sum;
+		results[2 * batch + 1] = (float)label;
+	}
+
+	free(cur);
+	free(next);
+	// the time of the whole head is kept on its first layer
+	metrics_layer(head->first, metrics_now() - start_nsec);
 #ifdef PROFILE_ENABLE
-			fprintf(stdout, "Image %04d/%04d: %s %f\n", i + batch, num_images - 1, CLASS_NAME[labels[i + batch]], confidences[i + batch]);
+	t2 = high_resolution_clock::now();
+	time_span = duration_cast<duration<double>>(t2 - t1);
+	profile_add(&fc_sec, time_span.count());
 #endif
+}
+
+#ifdef ASYNC_DISPATCH
+/*
+ * Device layers from l up to the next exit head, which needs the batch on the host.
+ */
+static int segment_end(run_t *run, int l) {
+	for (; l < run->num_device_layers; l++)
+		if (exit_after(run, l))
+			return l + 1;
+	return run->num_device_layers;
+}
+
+/*
+ * Enqueue layers [first, last) on the image arrays of the lane
+ * (IMAGE_ACTIVATIONS), run->image_plan.chunk images at a time: a chunk goes
+ * from arena_of[first] into an image array, through the layers, and back
+ * into arena_of[last], which is returned.
+ */
+static arena_t* enqueue_image_layers(run_t *run, lane_t *lane, int first, int last, int imageCnt) {
+	network_t *net = run->net;
+	memory_plan_t *plan = run->plan;
+	image_plan_t *images = &run->image_plan;
+	arena_t *in = &lane->arenas[plan->arena_of[first]];
+	arena_t *out = &lane->arenas[plan->arena_of[last]];
+	layer_t *first_layer = &net->layers[first];
+	layer_t *last_layer = &net->layers[last - 1];
+	const size_t in_storage = layer_in_storage(first_layer);
+	const size_t out_storage = layer_out_storage(last_layer);
+	const int device = lane->device->index;
+	const int chunk = std::min(images->chunk, imageCnt);
+	const int num_chunks = (imageCnt + chunk - 1) / chunk;
+	// in and out may share an arena: then the output of a chunk must not land on inputs not read yet
+	const int backwards = in == out && out_storage > in_storage;
+
+	for (int n = 0; n < num_chunks; n++) {
+		const int first_image = (backwards ? num_chunks - 1 - n : n) * chunk;
+		const int cnt = std::min(chunk, imageCnt - first_image);
+		int ping[MAX_IMAGE_WIDTHS] = { 0 };
+		const int N = first_layer->type == LAYER_POOL ? 2 * first_layer->N : first_layer->N;
+		int s = image_width_index(images, N);
+		cl_mem cur = lane->act_images[s][0];
+		ping[s] = 1;
+		clEnqueueToImage(lane, in, cur, CHANNEL_PAD(first_layer->D1), N, in_storage, first_image, cnt);
+		for (int l = first; l < last; l++) {
+			layer_t *layer = &net->layers[l];
+			s = image_width_index(images, layer->N);
+			cl_mem next = lane->act_images[s][ping[s]];
+			ping[s] ^= 1;
+			if (layer->type == LAYER_CONV)
+				clEnqueueConvImage(lane, cur, next, layer->w[device], layer->b[device], CHANNEL_PAD(layer->D2), CHANNEL_PAD(layer->D1), layer->N, l, layer->block, cnt);
+			else
+				clEnqueuePoolImage(lane, cur, next, CHANNEL_PAD(layer->D1), layer->N, l, cnt);
+			cur = next;
 		}
-    }
+		clEnqueueFromImage(lane, cur, out, CHANNEL_PAD(last_layer->D2), last_layer->N, out_storage, first_image, cnt);
+	}
+	return out;
+}
+
+/*
+ * Enqueue layers [first, last) on the lane for the batch in arena_of[first].
+ */
+static void enqueue_segment(run_t *run, lane_t *lane, int first, int last, int imageCnt) {
+	network_t *net = run->net;
+	memory_plan_t *plan = run->plan;
+	arena_t *in = &lane->arenas[plan->arena_of[first]];
+
+	clBeginBatch(lane, in, sizeof(float) * layer_in_storage(&net->layers[first]) * imageCnt, plan->num_arenas);
+	int l0 = first;
+	if (run->image_plan.enabled) {
+		in = enqueue_image_layers(run, lane, first, last, imageCnt);
+		l0 = last;
+	}
+	for (int l = l0; l < last; l++) {
+		layer_t *layer = &net->layers[l];
+		if (layer->fused_last >= 0) {
+			arena_t *out = &lane->arenas[plan->arena_of[layer->fused_last + 1]];
+			clEnqueueBlock(lane, in, out, layer, layer->fused_last - l + 1, imageCnt);
+			l = layer->fused_last;
+			in = out;
+			continue;
+		}
+		arena_t *out = &lane->arenas[plan->arena_of[l + 1]];
+		if (layer->type == LAYER_CONV)
+			clEnqueueConv(lane, in, out, layer->w[lane->device->index], layer->b[lane->device->index], layer->blocks[lane->device->index], layer->D2, layer->D1, layer->N, l, layer->block, imageCnt);
+		else
+			clEnqueuePool(lane, in, out, layer->D1, layer->N, l, imageCnt);
+		in = out;
+	}
+	layer_t *prev = &net->layers[last - 1];
+	if (run->head.on_device && last == run->head.first)
+		clEnqueueHead(lane, in, &run->head, prev->D2, prev->N, layer_out_storage(prev), last, imageCnt, plan->num_arenas);
+	else
+		clEnqueueReadback(lane, in, sizeof(float) * layer_out_storage(prev) * imageCnt, plan->num_arenas);
+	lane->next_layer = last;
+}
+#endif
+
+/*
+ * Load a batch into the lane and start its device layers.
+ * With ASYNC_DISPATCH this only enqueues them, otherwise they run to completion.
+ */
+static void submit_batch(run_t *run, lane_t *lane, int first_image, int imageCnt) {
+	memory_plan_t *plan = run->plan;
+
+	lane->first_image = first_image;
+	lane->imageCnt = imageCnt;
+	for (int batch = 0; batch < imageCnt; batch++)
+		lane->image_of[batch] = first_image + batch;
+
+	arena_t *in = &lane->arenas[plan->arena_of[0]];
+	load_batch(run, in->host, first_image, imageCnt);
+	lane->submit_nsec = metrics_now();
+	metrics_in_flight(1);
+
+#ifdef ASYNC_DISPATCH
+	enqueue_segment(run, lane, 0, segment_end(run, 0), imageCnt);
+#else
+	network_t *net = run->net;
+	for (int l = 0; l < run->num_device_layers && lane->imageCnt; l++) {
+		arena_t *out = &lane->arenas[plan->arena_of[l + 1]];
+		run_layer(&net->layers[l], l ? &net->layers[l - 1] : NULL, in, out, lane->imageCnt);
+		exit_t *head = exit_after(run, l);
+		if (head)
+			lane->imageCnt = apply_exit(run, head, out->host, lane->image_of, lane->imageCnt);
+		in = out;
+	}
+	lane->next_layer = run->num_device_layers;
+	metrics_stage(STAGE_DEVICE, metrics_now() - lane->submit_nsec);
+#endif
+}
 
-    free(c1_1); free(c1_2); free(p1);
-    free(c2_1); free(c2_2); free(p2);
-    free(c3_1); free(c3_2); free(c3_3); free(p3);
-    free(c4_1); free(c4_2); free(c4_3); free(p4);
-    free(c5_1); free(c5_2); free(c5_3); free(p5);
-    free(fc1); free(fc2); free(fc3);
+/*
+ * Wait for the batch in the lane and run the remaining layers.
+ * With ASYNC_DISPATCH, the device layers after an exit head are enqueued
+ * here for the images that are left.
+ * Returns the arena with the network output, unless the classifier head
+ * left its results in lane->results.
+ */
+static arena_t* finish_layers(run_t *run, lane_t *lane) {
+	network_t *net = run->net;
+	memory_plan_t *plan = run->plan;
+
+#ifdef ASYNC_DISPATCH
+	clWaitBatch(lane);
+	for (;;) {
+		const int l = lane->next_layer;
+		exit_t *head = exit_after(run, l - 1);
+		if (head)
+			lane->imageCnt = apply_exit(run, head, lane->arenas[plan->arena_of[l]].host, lane->image_of, lane->imageCnt);
+		if (l == run->num_device_layers || lane->imageCnt == 0)
+			break;
+		enqueue_segment(run, lane, l, segment_end(run, l), lane->imageCnt);
+		clWaitBatch(lane);
+	}
+	metrics_stage(STAGE_DEVICE, metrics_now() - lane->submit_nsec);
+#endif
+	const long long host_nsec = metrics_now();
+	head_t *head = &run->head;
+	arena_t *in = &lane->arenas[plan->arena_of[run->num_device_layers]];
+	for (int l = run->num_device_layers; l < head->first && lane->imageCnt; l++) {
+		arena_t *out = &lane->arenas[plan->arena_of[l + 1]];
+		run_layer(&net->layers[l], &net->layers[l - 1], in, out, lane->imageCnt);
+		exit_t *head = exit_after(run, l);
+		if (head)
+			lane->imageCnt = apply_exit(run, head, out->host, lane->image_of, lane->imageCnt);
+		in = out;
+	}
+	if (head->first < net->num_layers && !head->on_device && lane->imageCnt)
+		classifier_head_host(run, in->host, lane->imageCnt, lane->results);
+	metrics_stage(STAGE_HOST, metrics_now() - host_nsec);
+	return in;
+}
+
+/*
+ * Finish the batch in the lane and classify it.
+ */
+static void finish_batch(run_t *run, lane_t *lane) {
+	arena_t *in = finish_layers(run, lane);
+	if (run->head.first < run->net->num_layers)
+		classify_results(run, lane->results, lane->first_image, lane->imageCnt, lane->image_of);
+	else
+		classify_batch(run, in->host, lane->first_image, lane->imageCnt, lane->image_of);
+	metrics_batch(lane->imageCnt, metrics_now() - lane->submit_nsec);
+	metrics_in_flight(-1);
+	lane->imageCnt = 0;
+}
+
+/*
+ * Lanes on devices[0] with a set of arenas for run->batch_size images each.
+ */
+static lane_t* alloc_lanes(run_t *run, int n) {
+	memory_plan_t *plan = run->plan;
+	const int batch_size = run->batch_size;
+	lane_t *lanes = create_lanes(&devices[0], n);
+	for (int k = 0; k < n; k++) {
+		lanes[k].arenas = (arena_t*)calloc(plan->num_arenas, sizeof(arena_t));
+		lanes[k].image_of = (int*)malloc(sizeof(int) * batch_size);
+		for (int a = 0; a < plan->num_arenas; a++)
+			alloc_arena(&devices[0], &lanes[k].arenas[a], plan->arena_size[a] * batch_size);
+		if (run->head.first < run->net->num_layers)
+			lanes[k].results = alloc_layer(2 * batch_size);
+		if (run->head.on_device)
+			lanes[k].dev_results = create_buffer(&devices[0], CL_MEM_WRITE_ONLY, sizeof(float) * 2 * batch_size);
+		const image_plan_t *images = &run->image_plan;
+		for (int s = 0; images->enabled && s < images->num_widths; s++)
+			for (int p = 0; p < 2; p++)
+				lanes[k].act_images[s][p] = create_image_array(&devices[0], images->width[s],
+					images->slices[s] * std::min(images->chunk, batch_size));
+	}
+	return lanes;
+}
+
+static void release_lanes(run_t *run, lane_t *lanes, int n) {
+	for (int k = 0; k < n; k++) {
+		for (int a = 0; a < run->plan->num_arenas; a++)
+			free_arena(&lanes[k].arenas[a]);
+		free(lanes[k].arenas);
+		free(lanes[k].image_of);
+		free(lanes[k].results);
+		if (lanes[k].dev_results)
+			release_buffer(lanes[k].dev_results);
+		for (int s = 0; s < run->image_plan.num_widths; s++)
+			for (int p = 0; p < 2; p++)
+				if (lanes[k].act_images[s][p])
+					release_buffer(lanes[k].act_images[s][p]);
+	}
+	free_lanes(lanes, n);
+}
+
+/*
+ * Largest batch whose activation buffers fit next to the weights already on
+ * the devices: devices[0] holds one set of arenas per lane (every device one
+ * per pipeline stage with HETERO_SCHEDULE), and every device the shard
+ * buffers of MODEL_PARALLEL. No buffer may exceed CL_DEVICE_MAX_MEM_ALLOC_SIZE.
+ * With image activations every lane also has two image arrays per plane
+ * width, which stop growing at image_plan.chunk images.
+ * shard_in and shard_out are in floats per image.
+ */
+static int max_batch_size(run_t *run, size_t shard_in, size_t shard_out) {
+	memory_plan_t *plan = run->plan;
+	size_t arenas = 0, largest = std::max(shard_in, shard_out);
+	for (int a = 0; a < plan->num_arenas; a++) {
+		arenas += plan->arena_size[a];
+		largest = std::max(largest, plan->arena_size[a]);
+	}
+	if (run->head.on_device)
+		arenas += 2;
+	const image_plan_t *images = &run->image_plan;
+	size_t image_bytes = 0;     // per image and lane, up to images->chunk images
+	for (int s = 0; images->enabled && s < images->num_widths; s++)
+		image_bytes += 2 * sizeof(float) * 4 * images->width[s] * images->width[s] * images->slices[s];
+
+	long long batch_size = std::min(run->num_images, AUTO_BATCH_MAX);
+	for (int d = 0; d < num_devices; d++) {
+		device_t *dev = &devices[d];
+#ifdef HETERO_SCHEDULE
+		const int copies = 1;
+#else
+		const int copies = (d == 0) ? num_lanes : 0;
+#endif
+		const size_t per_image = sizeof(float) * (arenas * copies + shard_in + shard_out);
+		const size_t per_image_arrays = image_bytes * copies;
+		const double free_bytes = (double)(dev->global_mem_size - dev->mem_used) * AUTO_BATCH_MEM_FRACTION;
+		if (per_image + per_image_arrays > 0) {
+			long long fit = (long long)(free_bytes / (per_image + per_image_arrays));
+			// past a chunk only the buffers grow
+			if (per_image_arrays > 0 && fit > images->chunk)
+				fit = per_image > 0 ? (long long)((free_bytes - (double)per_image_arrays * images->chunk) / per_image) : batch_size;
+			batch_size = std::min(batch_size, fit);
+		}
+		batch_size = std::min(batch_size, (long long)(dev->max_mem_alloc_size / (sizeof(float) * largest)));
+	}
+	if (batch_size < 1) {
+		fprintf(stderr, "not enough device memory for a batch of one image\n");
+		exit(EXIT_FAILURE);
+	}
+	return (int)batch_size;
+}
+
+#ifndef HETERO_SCHEDULE
+/*
+ * Images per second through one lane at batch_size, from the second of two
+ * batches. The batches are real work: they classify the images from
+ * *next_image on, which moves past them. Returns 0 without running if fewer
+ * than two batches of images are left.
+ */
+static double probe_batch_size(run_t *run, int batch_size, int *next_image, size_t shard_in, size_t shard_out) {
+	if (run->num_images - *next_image < 2 * batch_size)
+		return 0;
+	run->batch_size = batch_size;
+	if (shard_in)
+		alloc_shard_buffers(shard_in * batch_size, shard_out * batch_size);
+	lane_t *lane = alloc_lanes(run, 1);
+	double sec = 0;
+	for (int rep = 0; rep < 2; rep++) {
+		high_resolution_clock::time_point t1 = high_resolution_clock::now();
+		submit_batch(run, lane, *next_image, batch_size);
+		finish_batch(run, lane);
+		*next_image += batch_size;
+		sec = duration_cast<duration<double>>(high_resolution_clock::now() - t1).count();
+	}
+	release_lanes(run, lane, 1);
+	if (shard_in)
+		free_shard_buffers();
+	return sec > 0 ? batch_size / sec : 0;
+}
+#endif
+
+/*
+ * batch_size 0: the largest batch that fits the devices, or a smaller one
+ * of AUTO_BATCH_PROBES candidates if it is about as fast. A smaller batch
+ * takes less memory and less time to fill and drain the lanes.
+ * Every probe classifies two batches of its own images, from the first on;
+ * the largest candidates are left out until all probes fit the images, and
+ * if the largest probed one is still the fastest the largest that fits is
+ * taken. *first_image returns the first image the probes did not classify.
+ */
+static int auto_batch_size(run_t *run, size_t shard_in, size_t shard_out, int *first_image) {
+	const int max_size = max_batch_size(run, shard_in, shard_out);
+	printf("auto batch_size : at most %d images fit the device memory\n", max_size);
+	*first_image = 0;
+#ifdef HETERO_SCHEDULE
+	// the pipeline schedule is measured for one batch size only
+	return max_size;
+#else
+	int candidates[AUTO_BATCH_PROBES];
+	int num_candidates = 0;
+	candidates[num_candidates++] = max_size;
+	int size = 1;
+	while (size * 2 < max_size)
+		size *= 2;
+	for (; size >= 1 && size < max_size && num_candidates < AUTO_BATCH_PROBES; size /= 2)
+		candidates[num_candidates++] = size;
+
+	// plan the image budget before probing, so no probe starves a later one
+	long long needed = 0;
+	for (int c = 0; c < num_candidates; c++)
+		needed += 2LL * candidates[c];
+	int first = 0;
+	while (first < num_candidates && needed > run->num_images)
+		needed -= 2LL * candidates[first++];
+	for (int c = 0; c < first; c++)
+		printf("  batch_size %5d : not probed, needs %d of %d images\n", candidates[c], 2 * candidates[c], run->num_images);
+
+	double best = 0;
+	int chosen = 0;
+	double throughput[AUTO_BATCH_PROBES];
+	for (int c = num_candidates - 1; c >= first; c--) {
+		throughput[c] = probe_batch_size(run, candidates[c], first_image, shard_in, shard_out);
+		best = std::max(best, throughput[c]);
+		printf("  batch_size %5d : %10.1lf images/sec\n", candidates[c], throughput[c]);
+	}
+	for (int c = first; c < num_candidates; c++)
+		if (throughput[c] > 0 && throughput[c] >= best * (1 - AUTO_BATCH_TOLERANCE))
+			chosen = candidates[c];
+	// too few images to probe any, or throughput still rising at the largest probed
+	if (!chosen || (first > 0 && chosen == candidates[first]))
+		chosen = max_size;
+	printf("auto batch_size : %d images classified while probing\n", *first_image);
+	return chosen;
+#endif
+}
+
+static void run_network(float *images, network_t *net, int *labels, float *confidences, int num_images, int batch_size,
+	const int *image_id, int total_images) {
+	// upload conv weights and biases, shared by all lanes
+	int num_copies = 1;
+#ifdef HETERO_SCHEDULE
+	num_copies = num_devices;
+#endif
+	size_t shard_in_size = 0, shard_out_size = 0;   // per image
+	for (int l = 0; l < net->num_layers; l++) {
+		layer_t *layer = &net->layers[l];
+#ifndef HETERO_SCHEDULE
+		layer->target = TARGET_ACCEL;
+#endif
+		if (layer->type != LAYER_CONV)
+			continue;
+#ifdef MODEL_PARALLEL
+		// weight-heavy layers keep one slice of output channels per device
+		if (num_devices > 1 && l > 0 && !layer->sparse_blocks && (size_t)layer->D2 * layer->D1 * 3 * 3 >= SHARD_MIN_WEIGHTS) {
+			layer->num_shards = num_devices;
+			for (int s = 0; s < num_devices; s++) {
+				int o0 = shard_begin(layer, s);
+				int D2s = shard_begin(layer, s + 1) - o0;
+				if (D2s == 0)
+					continue;
+				layer->w[s] = alloc_weight(&devices[s], layer->packed_weights + (size_t)o0 * CHANNEL_PAD(layer->D1) * 3 * 3, D2s, layer->D1);
+				layer->b[s] = alloc_bias(&devices[s], layer->packed_biases + o0, D2s);
+			}
+			if (shard_in_size < layer_in_storage(layer))
+				shard_in_size = layer_in_storage(layer);
+			if (shard_out_size < layer_out_storage(layer))
+				shard_out_size = layer_out_storage(layer);
+			continue;
+		}
+#endif
+		for (int d = 0; d < num_copies; d++) {
+			if (layer->sparse_blocks) {
+				const int rows = CHANNEL_PAD(layer->D2) / FILTER_BLOCK;
+				layer->w[d] = alloc_buffer(&devices[d], layer->packed_weights, sizeof(float) * layer->sparse_blocks * 3 * 3 * FILTER_BLOCK * FILTER_BLOCK);
+				layer->blocks[d] = alloc_buffer(&devices[d], layer->packed_blocks, sizeof(int) * (rows + 1 + layer->sparse_blocks));
+			}
+			else {
+				layer->w[d] = alloc_weight(&devices[d], layer->packed_weights, layer->D2, layer->D1);
+			}
+			layer->b[d] = alloc_bias(&devices[d], layer->packed_biases, layer->D2);
+		}
+	}
+
+	run_t run;
+	run.net = net;
+	run.batch_size = batch_size;
+	run.images = images;
+	run.num_images = num_images;
+	run.image_id = image_id;
+	run.total_images = total_images;
+	run.labels = labels;
+	run.confidences = confidences;
+	run.early_exit = 0;
+#ifdef EARLY_EXIT
+	run.early_exit = net->num_exits > 0 && exit_threshold > 0;
+	if (run.early_exit) {
+		if (!net->exit_of)
+			net->exit_of = (int*)malloc(sizeof(int) * num_images);
+		for (int i = 0; i < num_images; i++)
+			net->exit_of[i] = -1;
+		printf("early exit : %d heads, threshold %f\n", net->num_exits, exit_threshold);
+	}
+#endif
+
+	// leading conv/pool layers run on the device
+	run.num_device_layers = 0;
+	while (run.num_device_layers < net->num_layers &&
+		(net->layers[run.num_device_layers].type == LAYER_CONV || net->layers[run.num_device_layers].type == LAYER_POOL))
+		run.num_device_layers++;
+#ifdef MODEL_PARALLEL
+	// sharded layers run after the lane, from the first one on
+	for (int l = 0; l < run.num_device_layers; l++) {
+		if (net->layers[l].num_shards > 1) {
+			printf("model parallel : layers %d - %d, sharded convs split over %d devices\n", l, net->num_layers - 1, num_devices);
+			run.num_device_layers = l;
+			break;
+		}
+	}
+#endif
+
+	// plan and allocate memory for the activations, one set per lane
+	plan_images(&run);
+	plan_fusion(&run);
+	run.plan = plan_memory(net);
+	plan_head(&run);
+#ifndef HETERO_SCHEDULE
+	metrics_start(net);
+	roofline_start(net, &devices[0]);
+#endif
+	int first_image = 0;    // images classified by the batch size probes
+	if (batch_size <= 0)
+		batch_size = auto_batch_size(&run, shard_in_size, shard_out_size, &first_image);
+	run.batch_size = batch_size;
+	print_memory_plan(run.plan, batch_size);
+	if (shard_in_size)
+		alloc_shard_buffers(shard_in_size * batch_size, shard_out_size * batch_size);
+#ifdef HETERO_SCHEDULE
+	cnn_pipeline(&run);
+#else
+	if (num_lanes > 1)
+		printf("%d queues, %d batches in flight\n", num_lanes, num_lanes);
+	lane_t *lanes = alloc_lanes(&run, num_lanes);
+
+	// run network, batches go to the lanes round robin
+	int next = 0;
+	for (int i = first_image; i < num_images; i += batch_size)
+	{
+		int imageCnt = batch_size;
+		if (num_images - i < batch_size)
+			imageCnt = num_images - i;
+
+		lane_t *lane = &lanes[next];
+		next = (next + 1) % num_lanes;
+		if (lane->imageCnt)
+			finish_batch(&run, lane);
+		submit_batch(&run, lane, i, imageCnt);
+	}
+	for (int k = 0; k < num_lanes; k++) {
+		lane_t *lane = &lanes[next];
+		next = (next + 1) % num_lanes;
+		if (lane->imageCnt)
+			finish_batch(&run, lane);
+	}
+
+	release_lanes(&run, lanes, num_lanes);
+	roofline_stop();
+#endif
+	free_memory_plan(run.plan);
+	free_head(&run.head);
+	metrics_stop();
+
+	for (int l = 0; l < net->num_layers; l++) {
+		layer_t *layer = &net->layers[l];
+		if (layer->type == LAYER_CONV) {
+			for (int d = 0; d < num_devices; d++) {
+				if (layer->w[d])
+					release_buffer(layer->w[d]);
+				if (layer->b[d])
+					release_buffer(layer->b[d]);
+				if (layer->blocks[d])
+					release_buffer(layer->blocks[d]);
+			}
+		}
+	}
+	if (shard_in_size)
+		free_shard_buffers();
+}
+
+/*
+ * With RESULT_CACHE, images classified before take their cached results,
+ * copies of an image within the call run once, and only those go through
+ * the network, packed back to back so they fill whole batches.
+ */
+void cnn(float *images, network_t *net, int *labels, float *confidences, int num_images, int batch_size) {
+#ifdef RESULT_CACHE
+	const size_t image_size = layer_in_size(&net->layers[0]);
+	unsigned long long *keys = (unsigned long long*)malloc(sizeof(unsigned long long) * num_images);
+	int *exits = (int*)malloc(sizeof(int) * num_images);
+	int *miss_of = (int*)malloc(sizeof(int) * num_images);     // image of each image run
+	int *run_of = (int*)malloc(sizeof(int) * num_images);      // image run for each image, -1 if cached
+	int num_miss = 0, num_copies = 0, cached_exit = 0;
+
+	// keys of the images run so far, open addressing on miss index + 1
+	size_t capacity = 16;
+	while (capacity < 2 * (size_t)num_images)
+		capacity *= 2;
+	int *run_index = (int*)calloc(capacity, sizeof(int));
+
+	result_cache_open(net);
+	for (int i = 0; i < num_images; i++) {
+		run_of[i] = -1;
+		if (result_cache_find(images + image_size * i, image_size, &keys[i], &labels[i], &confidences[i], &exits[i])) {
+			cached_exit |= exits[i] >= 0;
+#ifdef LOG_IMAGES
+			fprintf(stdout, "Image %04d/%04d: %s %f (cached)\n", i, num_images - 1, CLASS_NAME[labels[i]], confidences[i]);
+#endif
+			continue;
+		}
+		exits[i] = -1;
+		size_t slot = (size_t)(keys[i] ^ (keys[i] >> 32)) & (capacity - 1);
+		while (run_index[slot] && keys[miss_of[run_index[slot] - 1]] != keys[i])
+			slot = (slot + 1) & (capacity - 1);
+		if (run_index[slot]) {
+			run_of[i] = run_index[slot] - 1;
+			num_copies++;
+			continue;
+		}
+		run_of[i] = num_miss;
+		miss_of[num_miss++] = i;
+		run_index[slot] = num_miss;
+	}
+	free(run_index);
+	if (num_copies)
+		printf("result cache : %d copies of images in this run classified once\n", num_copies);
+
+	int *run_labels = labels, *run_exits = NULL;
+	float *run_confidences = confidences;
+	if (num_miss == num_images) {
+		run_network(images, net, labels, confidences, num_images, batch_size, NULL, num_images);
+	}
+	else if (num_miss > 0) {
+		float *pending = alloc_layer(image_size * num_miss);
+		run_labels = (int*)malloc(sizeof(int) * num_miss);
+		run_confidences = (float*)malloc(sizeof(float) * num_miss);
+		for (int k = 0; k < num_miss; k++)
+			memcpy(pending + image_size * k, images + image_size * miss_of[k], sizeof(float) * image_size);
+		run_network(pending, net, run_labels, run_confidences, num_miss, batch_size, miss_of, num_images);
+		free(pending);
+	}
+	// exit_of of the run is per image run, make it per image given
+	if (num_miss > 0)
+		run_exits = net->exit_of;
+
+	for (int i = 0; i < num_images; i++) {
+		const int k = run_of[i];
+		if (k < 0)
+			continue;
+		labels[i] = run_labels[k];
+		confidences[i] = run_confidences[k];
+		if (run_exits)
+			exits[i] = run_exits[k];
+#ifdef LOG_IMAGES
+		if (miss_of[k] != i)
+			fprintf(stdout, "Image %04d/%04d: %s %f (same as %04d)\n", i, num_images - 1, CLASS_NAME[labels[i]], confidences[i], miss_of[k]);
+#endif
+	}
+	for (int k = 0; k < num_miss; k++)
+		result_cache_insert(keys[miss_of[k]], run_labels[k], run_confidences[k], exits[miss_of[k]]);
+	if (run_labels != labels) {
+		free(run_labels);
+		free(run_confidences);
+	}
+	if (net->exit_of || cached_exit) {
+		free(net->exit_of);
+		net->exit_of = exits;
+	}
+	else {
+		free(exits);
+	}
+	result_cache_close();
+	free(keys);
+	free(miss_of);
+	free(run_of);
+#else
+	run_network(images, net, labels, confidences, num_images, batch_size, NULL, num_images);
+#endif
 }
@@ -5,25 +5,474 @@
 #include <math.h>
 #include <string.h>
 #include <chrono>
+#include <atomic>
 #include <CL/cl.h>
 #define PROFILE_ENABLE
 
+/*
+ * Print an "Image ..." line for every image as it is classified.
+ */
+#define LOG_IMAGES
+
+/*
+ * Keep lock-free counters and latency histograms while cnn() runs (images,
+ * batches in flight, device memory, time per stage, per layer and per batch)
+ * and write them in Prometheus text format to METRICS_FILE every
+ * METRICS_INTERVAL_MS from a background thread.
+ */
+#define METRICS
+#define METRICS_FILE "metrics.prom"
+#define WORKER_METRICS_FILE "metrics.%d.prom"    // of a MULTI_PROCESS worker, by its first image
+#define METRICS_INTERVAL_MS 1000
+
+/*
+ * Keep the activations of the device layers in image2d_array_t objects
+ * instead of buffers: an RGBA float texel holds 4 channels of a pixel, one
+ * slice per 4 channels of an image, and reads go through a CLK_ADDRESS_CLAMP
+ * sampler that returns 0 outside the plane, which is the zero padding of
+ * the convolution. A batch goes through in chunks whose slices fit
+ * CL_DEVICE_IMAGE_MAX_ARRAY_SIZE, converted from and back to the buffer
+ * layout at both ends. Used instead of FUSED_BLOCKS, and only when the
+ * device supports images and no device layer is block-sparse.
+ * Requires ASYNC_DISPATCH.
+ */
+//#define IMAGE_ACTIVATIONS
+#define MAX_IMAGE_WIDTHS 8
+
+/*
+ * Measure the peak FLOP/s, memory bandwidth and launch latency of the
+ * accelerator with calibration kernels when cnn() starts, and at the end
+ * report for each device layer its kernel time against the roofline bound
+ * of its FLOPs and bytes, and whether it is compute-, memory- or
+ * launch-bound. A layer is launch-bound when a launch takes less than
+ * ROOFLINE_LAUNCH_FACTOR times the launch latency.
+ * Requires ASYNC_DISPATCH.
+ */
+//#define ROOFLINE
+#define ROOFLINE_LAUNCH_FACTOR 4
+
+/*
+ * Store conv and pool activations as (batch, D/C, N, N, C) and filters as
+ * (D2/C, D1/C, 3, 3, C, C) with C = LAYOUT_NCHWC (8 or 16).
+ * Channel counts are zero-padded up to a multiple of C.
+ */
+//#define LAYOUT_NCHWC 8
+
+/*
+ * Store every conv and pool activation plane with a 1-pixel ring of zeros,
+ * (N + 2) x (N + 2) in memory, so conv reads all 3x3 taps of a pixel without
+ * bounds checks. The device kernels compute the interior only and a small
+ * halo kernel writes the ring of their output.
+ */
+#define ZERO_HALO
+
+/*
+ * Enqueue the leading conv/pool layers of a batch back to back on the device
+ * and read back only their last output, instead of a blocking round trip
+ * per layer with pooling on the host.
+ */
+#define ASYNC_DISPATCH
+
+/*
+ * Split the layers into pipeline stages running on different targets:
+ * the accelerator, a CPU OpenCL device and native host threads.
+ * cnn_init asks for the CPU device and the number of host threads.
+ * Requires ASYNC_DISPATCH.
+ */
+//#define HETERO_SCHEDULE
+
+#if defined(HETERO_SCHEDULE) && !defined(ASYNC_DISPATCH)
+#error HETERO_SCHEDULE requires ASYNC_DISPATCH
+#endif
+#if defined(IMAGE_ACTIVATIONS) && (!defined(ASYNC_DISPATCH) || defined(HETERO_SCHEDULE))
+#error IMAGE_ACTIVATIONS requires ASYNC_DISPATCH and cannot be combined with HETERO_SCHEDULE
+#endif
+#if defined(ROOFLINE) && (!defined(ASYNC_DISPATCH) || defined(HETERO_SCHEDULE))
+#error ROOFLINE requires ASYNC_DISPATCH and cannot be combined with HETERO_SCHEDULE
+#endif
+
+/*
+ * Run the trailing fc layers, softmax and argmax as one classifier head per
+ * batch. On the lane it is one kernel right after the device layers and only
+ * labels and confidences are read back; otherwise the host runs it on the
+ * whole batch at once. Not used with HETERO_SCHEDULE.
+ */
+#define FUSED_HEAD
+#define HEAD_IMAGES 4           // images per work-group of the head kernel
+#define HEAD_GROUP_SIZE 256
+
+/*
+ * Run a conv block whose planes are at most FUSED_MAX_PIXELS pixels (the
+ * 4x4 and 2x2 blocks at the end of VGG) as one kernel: its convs and the
+ * pool after them, for a few images per work-group in local memory.
+ * This saves launches and activation traffic, but each work-group reads
+ * all weights of the block for its few images, where conv reads a filter
+ * once per 256 pixels: compare the two with ROOFLINE on the device before
+ * turning it on. On the lane only, not with HETERO_SCHEDULE.
+ */
+//#define FUSED_BLOCKS
+#define FUSED_MAX_PIXELS 16     // also the most images * pixels a work-item sums
+#define FUSED_MAX_CONVS 4
+#define FUSED_IMAGES 4          // most images per work-group, fewer if local memory is short
+#define FUSED_GROUP_SIZE 256
+
+/*
+ * Split the output channels of conv layers with at least SHARD_MIN_WEIGHTS
+ * weights across several GPUs, each holding only its slice of the weights.
+ * cnn_init asks for the number of GPUs, taken from gpu_idx upwards.
+ */
+//#define MODEL_PARALLEL
+#define SHARD_MIN_WEIGHTS (1 << 20)
+
+#if defined(MODEL_PARALLEL) && defined(HETERO_SCHEDULE)
+#error MODEL_PARALLEL and HETERO_SCHEDULE cannot be combined
+#endif
+
+/*
+ * Evaluate the exit heads of network.cfg and stop images whose softmax
+ * confidence reaches the threshold asked in cnn_init there; the rest of the
+ * batch is compacted and goes on. Not supported with HETERO_SCHEDULE.
+ */
+//#define EARLY_EXIT
+
+#if defined(EARLY_EXIT) && defined(HETERO_SCHEDULE)
+#error EARLY_EXIT and HETERO_SCHEDULE cannot be combined
+#endif
+
+/*
+ * main asks for a number of worker processes. With workers, the images are
+ * split between them, each runs this program on its own device (from gpu_idx
+ * upwards, over as many devices as asked) and the results are merged here.
+ * A worker that fails is started again up to WORKER_RETRIES times.
+ */
+//#define MULTI_PROCESS
+#define WORKER_RETRIES 2
+
+/*
+ * Look every image up by a hash of its pixels and of the model before
+ * batching, and only run the ones not classified before. Results are kept
+ * in RESULT_CACHE_FILE between runs.
+ */
+//#define RESULT_CACHE
+#define RESULT_CACHE_FILE "result.cache"
+
+/*
+ * Remove pruned channels (all-zero filters, or never read) from the network
+ * at load, and store conv filters whose share of nonzero blocks is at most
+ * SPARSE_MAX_DENSITY block-sparse for the conv_sparse kernels.
+ * A block is one 3x3 filter, or a C x C tile of them with LAYOUT_NCHWC.
+ */
+//#define SPARSE_WEIGHTS
+#define SPARSE_MAX_DENSITY 0.75
+
+#ifdef LAYOUT_NCHWC
+#define CHANNEL_PAD(D) (((D) + LAYOUT_NCHWC - 1) / LAYOUT_NCHWC * LAYOUT_NCHWC)
+#define FILTER_BLOCK LAYOUT_NCHWC
+#else
+#define CHANNEL_PAD(D) (D)
+#define FILTER_BLOCK 1
+#endif
+
+// the kernels read the conv weights in another layout than network.bin, keep them in the compiled model cache
+#if defined(LAYOUT_NCHWC) || defined(SPARSE_WEIGHTS)
+#define MODEL_CACHE
+#endif
+
+#ifdef ZERO_HALO
+#define HALO 1
+#else
+#define HALO 0
+#endif
+// floats of an N x N activation plane, and the offset of pixel (i, j) in it
+#define PLANE_SIZE(N) (((N) + 2 * HALO) * ((N) + 2 * HALO))
+#define PIXEL_INDEX(i, j, N) (((i) + HALO) * ((N) + 2 * HALO) + (j) + HALO)
+
 using namespace std::chrono;
 
+#define MAX_BLOCKS 16
+#define MAX_DEVICES 4
+
+// execution targets of a layer, >= 0 is an index into devices[]
+#define TARGET_ACCEL 0
+#define TARGET_CPU   1
+#define TARGET_HOST  (-1)
+#define TARGET_AUTO  (-2)
+
+enum layer_type {
+	LAYER_CONV,
+	LAYER_POOL,
+	LAYER_FC,
+	LAYER_SOFTMAX
+};
+
+/*
+ * conv    : D1 = input channel size, D2 = output channel size, N = width and height
+ * pool    : D1 = D2 = channel size, N = width and height of the output
+ * fc      : D1 = input size, D2 = output size, N = 1
+ * softmax : D1 = D2 = size, N = 1
+ */
+typedef struct {
+	int type;
+	int D1, D2, N;
+	int index;          // position in the network
+	int block;          // conv block index, used for profiling
+	int target;         // TARGET_*, conv and pool only
+	int num_shards;     // devices sharing the output channels (conv, MODEL_PARALLEL)
+	int exit;           // exit head on the output, -1 if none
+	int fused_last;     // last layer of the fused block starting here, -1 if none (FUSED_BLOCKS)
+	int fused_images;   // images per work-group of the fused block
+	float *weights;     // sliced from network.bin (conv, fc), NULL for conv with MODEL_CACHE but on the host
+	float *biases;
+	float *packed_weights;  // kernel layout, from load_network (conv)
+	float *packed_biases;
+	int *packed_blocks;     // block_ptr and block_idx of block-sparse filters
+	int sparse_blocks;      // nonzero filter blocks if block-sparse, 0 if dense
+	cl_mem w[MAX_DEVICES], b[MAX_DEVICES];  // device copies or shards (conv)
+	cl_mem blocks[MAX_DEVICES];             // device copies of packed_blocks
+} layer_t;
+
+/*
+ * Early-exit head on the (D, N, N) output of layer after:
+ * global average pooling, fc D -> M and softmax.
+ */
+typedef struct {
+	int after;
+	int D, N, M;
+	float *weights;     // (M, D), sliced from network_exits.bin
+	float *biases;
+} exit_t;
+
+typedef struct {
+	int num_layers;
+	layer_t *layers;
+	int num_blocks;
+	size_t num_params;  // number of floats expected in network.bin
+	int num_exits;
+	exit_t *exits;
+	size_t num_exit_params;
+	int *exit_of;       // exit head each image left at, -1 for the full network (EARLY_EXIT)
+	unsigned long long model_key;   // hash of the description and the contents of network.bin, from load_network
+} network_t;
+
+typedef struct {
+	int index;
+	cl_device_id id;
+	cl_device_type type;
+	cl_context context;
+	cl_program program;
+	cl_command_queue queue;     // weight uploads, mapping and synchronous conv
+	cl_kernel conv;
+	cl_kernel conv_sparse;
+	cl_kernel halo;             // ZERO_HALO
+	cl_bool host_unified_memory;
+	cl_ulong local_mem_size;
+	size_t max_work_group_size;
+	cl_ulong global_mem_size;
+	cl_ulong max_mem_alloc_size;
+	size_t mem_used;            // bytes in buffers from create_buffer
+	cl_bool image_support;
+	size_t image_max_array_size;
+} device_t;
+
+/*
+ * Host buffer and its device mirror.
+ * host is mapped from pinned, or from dev itself when the device shares
+ * memory with the host (pinned is NULL then).
+ * host may move whenever the device uses the arena, do not keep it.
+ * size is in floats for the whole batch.
+ */
+typedef struct {
+	float *host;
+	cl_mem dev;
+	cl_mem pinned;
+	size_t size;
+	device_t *device;
+} arena_t;
+
+typedef struct {
+	cl_event event;
+	int kind;
+	int layer;
+	int block;
+	int images;         // of a kernel, 0 for transfers
+} pending_event_t;
+
+/*
+ * A command queue with its own kernel objects and activation arenas,
+ * running one batch at a time (ASYNC_DISPATCH).
+ */
+typedef struct {
+	device_t *device;
+	cl_command_queue queue;
+	cl_kernel conv;
+	cl_kernel conv_sparse;
+	cl_kernel pool;
+	cl_kernel halo;             // ZERO_HALO
+	arena_t *arenas;
+	pending_event_t *pending;   // events of the batch in flight
+	int num_pending, max_pending;
+	int first_image;            // batch in flight, imageCnt == 0 if idle
+	int imageCnt;
+	int *image_of;              // image index of each batch slot, slots move when images exit early
+	int next_layer;             // first layer not enqueued yet
+	cl_kernel head;
+	cl_kernel block;            // fused conv block (FUSED_BLOCKS)
+	cl_mem dev_results;         // classifier head output on the device
+	float *results;             // confidence and label of each batch slot (FUSED_HEAD)
+	cl_kernel to_image, from_image, conv_image, pool_image;    // IMAGE_ACTIVATIONS
+	cl_mem act_images[MAX_IMAGE_WIDTHS][2];
+	long long submit_nsec;      // metrics_now() when the loaded batch was submitted
+} lane_t;
+
+/*
+ * Sizes are in floats per image.
+ */
+typedef struct {
+	int num_tensors;
+	int *arena_of;      // arena holding each tensor
+	int num_arenas;
+	size_t *arena_size;
+	size_t naive_size;  // one buffer per tensor
+	size_t peak_size;   // sum of arena sizes
+} memory_plan_t;
+
+/*
+ * Fused classifier head (FUSED_HEAD): fc layers [first, num_layers - 1) and
+ * the final softmax.
+ */
+typedef struct {
+	int first;          // num_layers if the tail is not fused
+	int num_fc;
+	int width;          // widest fc input or output
+	int on_device;      // runs on the lane after the device layers
+	float *params;      // fc weights transposed to (D1, D2) and biases (on_device)
+	int *table;         // D1, D2, weight offset, bias offset in params of each fc layer
+	cl_mem dev_params, dev_table;
+} head_t;
+
+/*
+ * Image arrays of the device layers (IMAGE_ACTIVATIONS), two for each plane
+ * width so a layer reads one and writes the other.
+ */
+typedef struct {
+	int enabled;
+	int num_widths;
+	int width[MAX_IMAGE_WIDTHS];
+	int slices[MAX_IMAGE_WIDTHS];   // per image, for the widest tensor of that width
+	int chunk;                      // images per pass, from CL_DEVICE_IMAGE_MAX_ARRAY_SIZE
+} image_plan_t;
+
+typedef struct {
+	network_t *net;
+	memory_plan_t *plan;
+	int num_device_layers;  // leading conv/pool layers, enqueued on a lane
+	int batch_size;
+	float *images;
+	int num_images;
+	const int *image_id;    // index of each image in the caller's images, NULL if the same (RESULT_CACHE)
+	int total_images;       // images given to cnn()
+	int *labels;
+	float *confidences;
+	int early_exit;         // evaluate the exit heads
+	head_t head;
+	image_plan_t image_plan;
+} run_t;
+
+// stages of a batch in the metrics
+enum {
+	STAGE_LOAD,         // images into the input tensor
+	STAGE_DEVICE,       // device layers, until the batch is back on the host
+	STAGE_HOST,         // layers run on the host
+	STAGE_CLASSIFY,
+	NUM_STAGES
+};
+
 void cnn_init();
-void cnn(float *images, float **network, int *labels, float *confidences, int num_images, int batch_size);
+void cnn_settings();
+void write_cnn_settings(FILE *f, int device_offset);
+int coordinate(const char *program, int num_images, int batch_size, int num_workers, int *labels, float *confidences);
+void cnn(float *images, network_t *net, int *labels, float *confidences, int num_images, int batch_size);
 
 void print_usage_and_exit(char **argv);
 void* read_bytes(const char *fn, size_t n);
-float* read_images(size_t n);
+void* read_bytes_at(const char *fn, size_t offset, size_t n);
+float* read_images(size_t first, size_t n);
 int* read_labels(size_t n);
-float* read_network();
-float** slice_network(float *p);
+network_t* read_network_desc(const char *fn);
+float* read_network(network_t *net);
+void slice_network(network_t *net, float *p);
+float* load_network(network_t *net, float **exits);
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+unsigned long long hash_bytes(unsigned long long h, const void *p, size_t n);
+unsigned long long hash_words(unsigned long long h, const void *p, size_t n);
+float* read_exits(network_t *net);
+void prune_network(network_t *net);
+void print_exit_report(network_t *net, int *labels, int *labels_ans, int num_images, const char *full_run);
+size_t layer_in_size(const layer_t *layer);
+size_t layer_out_size(const layer_t *layer);
+size_t layer_in_storage(const layer_t *layer);
+size_t layer_out_storage(const layer_t *layer);
 float* alloc_layer(size_t n);
-void convolution_layer(float *inputs, float *outputs, cl_mem filters, cl_mem biases, int D2, int D1, int N, int batch_size, int imageCnt);
+memory_plan_t* plan_memory(network_t *net);
+void print_memory_plan(memory_plan_t *plan, int batch_size);
+void free_memory_plan(memory_plan_t *plan);
+void convolution_layer(arena_t *inputs, arena_t *outputs, cl_mem filters, cl_mem biases, cl_mem blocks, int D2, int D1, int N, int imageCnt);
 void pooling_layer(float *inputs, float *outputs, int D, int N);
+int shard_begin(const layer_t *layer, int s);
+void convolution_shard_layer(float *inputs, float *outputs, layer_t *layer, int imageCnt);
+void convolution_host_layer(float *inputs, float *outputs, float *filters, float *biases, int D2, int D1, int N, int imageCnt);
+void run_layer(layer_t *layer, layer_t *prev, arena_t *in, arena_t *out, int imageCnt);
+void load_batch(run_t *run, float *input, int first_image, int imageCnt);
+void classify_batch(run_t *run, float *output, int first_image, int imageCnt, const int *image_of);
+void classify_results(run_t *run, const float *results, int first_image, int imageCnt, const int *image_of);
+void cnn_pipeline(run_t *run);
+
+long long metrics_now();
+void metrics_start(network_t *net);
+void metrics_stop();
+void metrics_stage(int stage, long long nsec);
+void metrics_layer(int layer, long long nsec);
+void metrics_batch(int imageCnt, long long nsec);
+void metrics_exit(int head);
+void metrics_in_flight(int delta);
+void metrics_device_memory(long long bytes);
+void metrics_combine(char (*files)[64], int num_files);
+
+void roofline_start(network_t *net, device_t *dev);
+void roofline_stop();
+void roofline_layer(int layer, int images, long long nsec);
+
+void result_cache_open(network_t *net);
+int result_cache_find(const float *image, size_t n, unsigned long long *key, int *label, float *confidence, int *exit);
+void result_cache_insert(unsigned long long key, int label, float confidence, int exit);
+void result_cache_close();
 
 void initOpenCL(int platform_idx, int gpu_idx);
-void clConv(float *inputs, float *outputs, cl_mem filters, cl_mem biases, int D2, int D1, int N, int batch_size, int imageCnt);
+int addDevice(int platform_idx, int device_idx, cl_device_type type);
+cl_mem alloc_buffer(device_t *dev, const void *data, size_t size);
+cl_mem create_buffer(device_t *dev, cl_mem_flags flags, size_t size);
+cl_mem create_image_array(device_t *dev, int width, int slices);
+void release_buffer(cl_mem buf);
+void alloc_arena(device_t *dev, arena_t *arena, size_t n);
+void free_arena(arena_t *arena);
+void clConv(arena_t *inputs, arena_t *outputs, cl_mem filters, cl_mem biases, cl_mem blocks, int D2, int D1, int N, int imageCnt);
+lane_t* create_lanes(device_t *dev, int num_lanes);
+void free_lanes(lane_t *lanes, int num_lanes);
+void clCalibrate(device_t *dev, double *flops, double *bytes, double *launch);
+void clBeginBatch(lane_t *lane, arena_t *input, size_t input_size, int num_arenas);
+void clEnqueueConv(lane_t *lane, arena_t *inputs, arena_t *outputs, cl_mem filters, cl_mem biases, cl_mem blocks, int D2, int D1, int N, int layer, int block, int imageCnt);
+void clEnqueuePool(lane_t *lane, arena_t *inputs, arena_t *outputs, int D, int N, int layer, int imageCnt);
+void clEnqueueReadback(lane_t *lane, arena_t *output, size_t output_size, int num_arenas);
+void clEnqueueBlock(lane_t *lane, arena_t *inputs, arena_t *outputs, layer_t *layers, int num_layers, int imageCnt);
+void clEnqueueHead(lane_t *lane, arena_t *inputs, head_t *head, int D, int N, size_t in_storage, int layer, int imageCnt, int num_arenas);
+void clEnqueueToImage(lane_t *lane, arena_t *inputs, cl_mem image, int D, int N, size_t storage, int first_image, int imageCnt);
+void clEnqueueFromImage(lane_t *lane, cl_mem image, arena_t *outputs, int D, int N, size_t storage, int first_image, int imageCnt);
+void clEnqueueConvImage(lane_t *lane, cl_mem inputs, cl_mem outputs, cl_mem filters, cl_mem biases, int D2, int D1, int N, int layer, int block, int imageCnt);
+void clEnqueuePoolImage(lane_t *lane, cl_mem inputs, cl_mem outputs, int D, int N, int layer, int imageCnt);
+double clWaitBatch(lane_t *lane);
+void profile_add(double *counter, double sec);
+void alloc_shard_buffers(size_t in_size, size_t out_size);
+void free_shard_buffers();
+void clConvShards(float *inputs, float *outputs, layer_t *layer, int imageCnt);
 
-#endif 
+#endif
@@ -0,0 +1,179 @@
+#pragma warning(disable:4996)
+#include "cnn.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#endif
+
+/*
+ * Multi-process coordinator (MULTI_PROCESS).
+ * The images are split into one contiguous shard per worker. A worker is
+ * this program started as "<program> --worker <first image>", reading its
+ * answers to the prompts of main and cnn_init from worker<k>.in, and it
+ * prints one "Result <image> <label> <confidence>" line per image. One
+ * thread per worker reads them through a pipe.
+ * With MODEL_CACHE the pack is written here before the workers start, so
+ * they all load it instead of repacking network.bin and racing to write it.
+ * Each worker writes its metrics to WORKER_METRICS_FILE and a thread here
+ * adds them up into METRICS_FILE.
+ */
+typedef struct {
+	int index;
+	int first, count;       // images of the shard
+	int device;             // offset from gpu_idx
+	int *labels;            // of all images, the shard's are filled in
+	float *confidences;
+	int ok;
+} worker_t;
+
+static const char *worker_program;
+
+#ifdef METRICS
+static std::mutex combiner_lock;
+static std::condition_variable combiner_cond;
+static int combiner_stop;
+
+/*
+ * Publish the combined metrics of the workers every METRICS_INTERVAL_MS,
+ * and once more after they are done.
+ */
+static void combiner_main(char (*files)[64], int num_workers)
+{
+	std::unique_lock<std::mutex> guard(combiner_lock);
+	for (;;) {
+		int stop = combiner_cond.wait_for(guard, milliseconds(METRICS_INTERVAL_MS), [] { return combiner_stop != 0; });
+		metrics_combine(files, num_workers);
+		if (stop)
+			break;
+	}
+}
+#endif
+
+/*
+ * Run the worker once, 1 if it exited cleanly with a result for every image.
+ */
+static int run_worker(worker_t *w, char *received)
+{
+	char cmd[1024], line[1024];
+	sprintf(cmd, "\"%s\" --worker %d < worker%d.in", worker_program, w->first, w->index);
+	FILE *p = popen(cmd, "r");
+	if (!p)
+		return 0;
+	int num_received = 0;
+	memset(received, 0, w->count);
+	while (fgets(line, sizeof(line), p)) {
+		int i, label;
+		float confidence;
+		if (sscanf(line, "Result %d %d %f", &i, &label, &confidence) != 3 || i < w->first || i >= w->first + w->count)
+			continue;
+		w->labels[i] = label;
+		w->confidences[i] = confidence;
+		num_received += !received[i - w->first];
+		received[i - w->first] = 1;
+	}
+	return pclose(p) == 0 && num_received == w->count;
+}
+
+static void worker_main(worker_t *w)
+{
+	char *received = (char*)malloc(w->count);
+	for (int attempt = 0; attempt <= WORKER_RETRIES && !w->ok; attempt++) {
+		if (attempt)
+			fprintf(stderr, "worker %d (images %d - %d) failed, retry %d of %d\n",
+				w->index, w->first, w->first + w->count - 1, attempt, WORKER_RETRIES);
+		w->ok = run_worker(w, received);
+	}
+	free(received);
+}
+
+/*
+ * Classify num_images images with num_workers worker processes started from
+ * program. Returns the number of shards that still failed after their retries.
+ */
+int coordinate(const char *program, int num_images, int batch_size, int num_workers, int *labels, float *confidences)
+{
+	cnn_settings();
+	int num_worker_devices = 1;
+	printf("worker_devices : ");
+	scanf("%d", &num_worker_devices);
+	if (num_worker_devices < 1)
+		num_worker_devices = 1;
+	if (num_workers > num_images)
+		num_workers = num_images;
+
+#ifdef MODEL_CACHE
+	network_t *net = read_network_desc("network.cfg");
+	float *exits;
+	free(load_network(net, &exits));
+	free(exits);
+	free(net->layers);
+	free(net);
+#endif
+
+	worker_program = program;
+	worker_t *workers = (worker_t*)calloc(num_workers, sizeof(worker_t));
+	for (int k = 0; k < num_workers; k++) {
+		worker_t *w = &workers[k];
+		w->index = k;
+		w->first = (int)((long long)num_images * k / num_workers);
+		w->count = (int)((long long)num_images * (k + 1) / num_workers) - w->first;
+		w->device = k % num_worker_devices;
+		w->labels = labels;
+		w->confidences = confidences;
+
+		char fn[64];
+		sprintf(fn, "worker%d.in", k);
+		FILE *f = fopen(fn, "w");
+		if (!f) {
+			fprintf(stderr, "%s: cannot write the worker settings\n", fn);
+			exit(EXIT_FAILURE);
+		}
+		fprintf(f, "%d\n%d\n0\n", w->count, batch_size);    // num_images, batch_size, num_workers
+		write_cnn_settings(f, w->device);
+		fclose(f);
+		printf("worker %d : images %d - %d, device gpu_idx + %d\n", k, w->first, w->first + w->count - 1, w->device);
+	}
+
+#ifdef METRICS
+	char (*metrics_files)[64] = (char(*)[64])malloc(num_workers * sizeof(*metrics_files));
+	for (int k = 0; k < num_workers; k++)
+		sprintf(metrics_files[k], WORKER_METRICS_FILE, workers[k].first);
+	combiner_stop = 0;
+	std::thread combiner(combiner_main, metrics_files, num_workers);
+	printf("metrics : %s every %d ms, from the workers\n", METRICS_FILE, METRICS_INTERVAL_MS);
+#endif
+
+	std::thread *threads = new std::thread[num_workers];
+	for (int k = 0; k < num_workers; k++)
+		threads[k] = std::thread(worker_main, &workers[k]);
+	int failed = 0;
+	for (int k = 0; k < num_workers; k++) {
+		threads[k].join();
+		if (!workers[k].ok) {
+			fprintf(stderr, "worker %d (images %d - %d) failed after %d retries\n",
+				k, workers[k].first, workers[k].first + workers[k].count - 1, WORKER_RETRIES);
+			failed++;
+		}
+		char fn[64];
+		sprintf(fn, "worker%d.in", k);
+		remove(fn);
+	}
+	delete[] threads;
+#ifdef METRICS
+	{
+		std::lock_guard<std::mutex> guard(combiner_lock);
+		combiner_stop = 1;
+	}
+	combiner_cond.notify_all();
+	combiner.join();
+	for (int k = 0; k < num_workers; k++)
+		remove(metrics_files[k]);
+	free(metrics_files);
+#endif
+	free(workers);
+	return failed;
+}
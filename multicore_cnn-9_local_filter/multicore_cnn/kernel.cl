@@ -1,5 +1,22 @@
 #define ReLU(x) (((x)>0)?(x):0)
 
+/*
+ * With ZERO_HALO every N x N activation plane is stored as (N + 2) x (N + 2)
+ * with a ring of zeros. The 3x3 taps of conv then never leave the plane and
+ * INSIDE folds to 1, so the tap loops have no branches. conv and pool are
+ * launched over the N x N interior only, the halo kernel writes the ring.
+ */
+#ifdef ZERO_HALO
+#define HALO 1
+#else
+#define HALO 0
+#endif
+#define WIDTH(N) ((N) + 2 * HALO)
+#define PLANE_SIZE(N) (WIDTH(N) * WIDTH(N))
+#define PIXEL_INDEX(i, j, N) (((i) + HALO) * WIDTH(N) + (j) + HALO)
+#define INSIDE(x, y, N) (HALO || ((x) >= 0 && (x) < (N) && (y) >= 0 && (y) < (N)))
+#define BORDER(i, j, N) ((i) < 0 || (i) >= (N) || (j) < 0 || (j) >= (N))
+
 __kernel void conv(
 		__global float* inputs,
 		__global float* filters,
@@ -13,14 +30,14 @@ __kernel void conv(
 	) 
 {
 	const int out_channel = get_global_id(0);
-	const int batch = get_global_id(1) / (N*N);
-	const int remain = get_global_id(1) % (N*N);
+	const int batch = get_global_id(1) / (N * N);
+	const int remain = get_global_id(1) % (N * N);
 	const int i = remain / N;
 	const int j = remain % N;
 	const int lid = get_local_id(1);
 	const int lsize = get_local_size(1);
 
-    __global float* output = outputs + N * N * (D2*batch + out_channel);
+    __global float* output = outputs + PLANE_SIZE(N) * (D2*batch + out_channel);
 	__global float* filter = filters + out_channel * D1 * 3 * 3;
 
 	if (lid < D1)
@@ -37,18 +54,611 @@ __kernel void conv(
 	float sum = 0;
 	for (int in_channel = 0; in_channel < D1; in_channel++)
     {
-		__global float* input = inputs + N * N * (D1*batch + in_channel);
+		__global float* input = inputs + PLANE_SIZE(N) * (D1*batch + in_channel);
 		//__global float* filter = filters + 3 * 3 * (out_channel * D1 + in_channel);
 
 		for (int k = 0; k < 3; k++) {
 			for (int l = 0; l < 3; l++) {
 				int x = i + k - 1;
 				int y = j + l - 1;
-				if (x >= 0 && x < N && y >= 0 && y < N)
-					sum += input[x * N + y] * l_filter[(in_channel*3*3) + (k*3) + l];
+				if (INSIDE(x, y, N))
+					sum += input[PIXEL_INDEX(x, y, N)] * l_filter[(in_channel*3*3) + (k*3) + l];
 			}
 		}
 	}
 	float bias = biases[out_channel];
-	output[i * N + j] = ReLU(sum + bias);
+	output[PIXEL_INDEX(i, j, N)] = ReLU(sum + bias);
+}
+
+/*
+ * Block-sparse conv, only the nonzero 3x3 filters are stored.
+ * blocks : block_ptr (D2 + 1) then block_idx.
+ * The filters of out_channel are filters[block_ptr[o] .. block_ptr[o + 1])
+ * and filter e reads input channel block_idx[e].
+ */
+__kernel void conv_sparse(
+		__global const float* inputs,
+		__global const float* filters,
+		__global const int* blocks,
+		__global float* outputs,
+		__constant float* biases,
+		const int D1,
+		const int D2,
+		const int N,
+		const int imageCnt
+	)
+{
+	const int out_channel = get_global_id(0);
+	const int batch = get_global_id(1) / (N * N);
+	const int remain = get_global_id(1) % (N * N);
+	const int i = remain / N;
+	const int j = remain % N;
+
+	if (batch >= imageCnt)
+		return;
+
+	__global const int* block_idx = blocks + D2 + 1;
+	float sum = biases[out_channel];
+	for (int e = blocks[out_channel]; e < blocks[out_channel + 1]; e++)
+	{
+		__global const float* input = inputs + PLANE_SIZE(N) * (D1*batch + block_idx[e]);
+		__global const float* filter = filters + 3 * 3 * e;
+
+		for (int k = 0; k < 3; k++) {
+			for (int l = 0; l < 3; l++) {
+				int x = i + k - 1;
+				int y = j + l - 1;
+				if (INSIDE(x, y, N))
+					sum += input[PIXEL_INDEX(x, y, N)] * filter[k * 3 + l];
+			}
+		}
+	}
+	outputs[PLANE_SIZE(N) * (D2*batch + out_channel) + PIXEL_INDEX(i, j, N)] = ReLU(sum);
+}
+
+#ifdef LAYOUT_NCHWC
+#define C LAYOUT_NCHWC
+#if C == 16
+#define floatC float16
+#define vloadC vload16
+#define vstoreC vstore16
+#else
+#define floatC float8
+#define vloadC vload8
+#define vstoreC vstore8
+#endif
+
+/*
+ * inputs  : (batch, D1/C, N, N, C)
+ * filters : (D2/C, D1/C, 3, 3, C, C), innermost index is the output channel
+ * outputs : (batch, D2/C, N, N, C)
+ * D1 and D2 are already padded to a multiple of C.
+ * Each work-item computes C output channels of one pixel.
+ */
+__kernel void conv_nchwc(
+		__global const float* inputs,
+		__global const float* filters,
+		__global float* outputs,
+		__constant float* biases,
+		const int D1,
+		const int D2,
+		const int N,
+		const int imageCnt
+	)
+{
+	const int out_block = get_global_id(0);
+	const int batch = get_global_id(1) / (N * N);
+	const int remain = get_global_id(1) % (N * N);
+	const int i = remain / N;
+	const int j = remain % N;
+	const int B1 = D1 / C;
+	const int B2 = D2 / C;
+
+	if (batch >= imageCnt)
+		return;
+
+	floatC sum = vloadC(out_block, biases);
+	for (int in_block = 0; in_block < B1; in_block++)
+	{
+		__global const float* input = inputs + PLANE_SIZE(N) * C * (B1*batch + in_block);
+		__global const float* filter = filters + 3 * 3 * C * C * (B1*out_block + in_block);
+
+		for (int k = 0; k < 3; k++) {
+			int x = i + k - 1;
+			for (int l = 0; l < 3; l++) {
+				int y = j + l - 1;
+				if (!INSIDE(x, y, N))
+					continue;
+				__global const float* pixel = input + PIXEL_INDEX(x, y, N) * C;
+				__global const float* tap = filter + (k * 3 + l) * C * C;
+				for (int c = 0; c < C; c++)
+					sum = mad((floatC)(pixel[c]), vloadC(c, tap), sum);
+			}
+		}
+	}
+	vstoreC(fmax(sum, (floatC)(0.0f)), PLANE_SIZE(N) * (B2*batch + out_block) + PIXEL_INDEX(i, j, N), outputs);
+}
+
+/*
+ * conv_nchwc with block-sparse filters, only the nonzero C x C tiles are stored.
+ * blocks : block_ptr (D2/C + 1) then block_idx, as in conv_sparse with
+ * channel blocks in place of channels.
+ */
+__kernel void conv_nchwc_sparse(
+		__global const float* inputs,
+		__global const float* filters,
+		__global const int* blocks,
+		__global float* outputs,
+		__constant float* biases,
+		const int D1,
+		const int D2,
+		const int N,
+		const int imageCnt
+	)
+{
+	const int out_block = get_global_id(0);
+	const int batch = get_global_id(1) / (N * N);
+	const int remain = get_global_id(1) % (N * N);
+	const int i = remain / N;
+	const int j = remain % N;
+	const int B1 = D1 / C;
+	const int B2 = D2 / C;
+
+	if (batch >= imageCnt)
+		return;
+
+	__global const int* block_idx = blocks + B2 + 1;
+	floatC sum = vloadC(out_block, biases);
+	for (int e = blocks[out_block]; e < blocks[out_block + 1]; e++)
+	{
+		__global const float* input = inputs + PLANE_SIZE(N) * C * (B1*batch + block_idx[e]);
+		__global const float* filter = filters + 3 * 3 * C * C * e;
+
+		for (int k = 0; k < 3; k++) {
+			int x = i + k - 1;
+			for (int l = 0; l < 3; l++) {
+				int y = j + l - 1;
+				if (!INSIDE(x, y, N))
+					continue;
+				__global const float* pixel = input + PIXEL_INDEX(x, y, N) * C;
+				__global const float* tap = filter + (k * 3 + l) * C * C;
+				for (int c = 0; c < C; c++)
+					sum = mad((floatC)(pixel[c]), vloadC(c, tap), sum);
+			}
+		}
+	}
+	vstoreC(fmax(sum, (floatC)(0.0f)), PLANE_SIZE(N) * (B2*batch + out_block) + PIXEL_INDEX(i, j, N), outputs);
+}
+#endif
+
+/*
+ * 2x2 max pooling.
+ * inputs  : (batch, D, N * 2, N * 2)
+ * outputs : (batch, D, N, N)
+ */
+__kernel void pool(
+		__global const float* inputs,
+		__global float* outputs,
+		const int D,
+		const int N,
+		const int imageCnt
+	)
+{
+	const int channel = get_global_id(0);
+	const int batch = get_global_id(1) / (N * N);
+	const int remain = get_global_id(1) % (N * N);
+	const int i = remain / N;
+	const int j = remain % N;
+
+	if (batch >= imageCnt)
+		return;
+
+	__global float* output = outputs + PLANE_SIZE(N) * (D*batch + channel);
+	__global const float* input = inputs + PLANE_SIZE(2 * N) * (D*batch + channel);
+	float max = 0;
+	for (int k = 0; k < 2; k++)
+		for (int l = 0; l < 2; l++)
+			max = fmax(max, input[PIXEL_INDEX(i * 2 + k, j * 2 + l, 2 * N)]);
+	output[PIXEL_INDEX(i, j, N)] = max;
+}
+
+#ifdef LAYOUT_NCHWC
+/*
+ * 2x2 max pooling on blocks of C channels, B = D/C.
+ * inputs  : (batch, B, N * 2, N * 2, C)
+ * outputs : (batch, B, N, N, C)
+ */
+__kernel void pool_nchwc(
+		__global const float* inputs,
+		__global float* outputs,
+		const int B,
+		const int N,
+		const int imageCnt
+	)
+{
+	const int block = get_global_id(0);
+	const int batch = get_global_id(1) / (N * N);
+	const int remain = get_global_id(1) % (N * N);
+	const int i = remain / N;
+	const int j = remain % N;
+
+	if (batch >= imageCnt)
+		return;
+
+	__global const float* input = inputs + PLANE_SIZE(2 * N) * C * (B*batch + block);
+	floatC max = (floatC)(0.0f);
+	for (int k = 0; k < 2; k++)
+		for (int l = 0; l < 2; l++)
+			max = fmax(max, vloadC(PIXEL_INDEX(i * 2 + k, j * 2 + l, 2 * N), input));
+	vstoreC(max, PLANE_SIZE(N) * (B*batch + block) + PIXEL_INDEX(i, j, N), outputs);
+}
+#endif
+
+#ifdef ZERO_HALO
+/*
+ * Zero the halo ring of (N + 2) x (N + 2) planes, of floats or of
+ * pixels of C floats with LAYOUT_NCHWC: the top and bottom rows, then the
+ * left and right pixels of the rows between, 4 (N + 1) per plane.
+ */
+__kernel void halo(
+		__global float* outputs,
+		const int N
+	)
+{
+	const int plane = get_global_id(0);
+	const int r = get_global_id(1);
+	int i, j;
+	if (r < 2 * WIDTH(N)) {
+		i = (r < WIDTH(N)) ? -1 : N;
+		j = r % WIDTH(N) - 1;
+	}
+	else {
+		i = (r - 2 * WIDTH(N)) / 2;
+		j = (r % 2) ? N : -1;
+	}
+#ifdef LAYOUT_NCHWC
+	vstoreC((floatC)(0.0f), PLANE_SIZE(N) * plane + PIXEL_INDEX(i, j, N), outputs);
+#else
+	outputs[PLANE_SIZE(N) * plane + PIXEL_INDEX(i, j, N)] = 0;
+#endif
+}
+#endif
+
+#ifdef LAYOUT_NCHWC
+#define ACT_INDEX(c, i, j, N) ((((c) / C) * PLANE_SIZE(N) + PIXEL_INDEX(i, j, N)) * C + (c) % C)
+#else
+#define ACT_INDEX(c, i, j, N) ((c) * PLANE_SIZE(N) + PIXEL_INDEX(i, j, N))
+#endif
+
+// weight of tap k of 3x3 filter (o, i), in the layout of conv / conv_nchwc
+#ifdef LAYOUT_NCHWC
+#define FILTER_INDEX(o, i, k, D1) (((((o) / C) * ((D1) / C) + (i) / C) * 9 + (k)) * C * C + ((i) % C) * C + (o) % C)
+#else
+#define FILTER_INDEX(o, i, k, D1) (((o) * (D1) + (i)) * 9 + (k))
+#endif
+
+/*
+ * Fused conv block: num_convs 3x3 convs with D output channels (the first
+ * one from D1 channels), then a 2x2 max pool if pool != 0.
+ * A work-group takes `images` images and keeps their activations in local
+ * memory, (images, D, N, N) without halo, and the block is one launch.
+ * Every group reads all weights of the block once, for only its `images`
+ * images; a work-item keeps images * N * N <= FUSED_MAX_PIXELS sums.
+ * inputs  : block input in the activation layout, D1 channels
+ * outputs : block output in the activation layout, D channels
+ * buf     : 2 * images * max(D1, D) * N * N floats
+ */
+__kernel void conv_block(
+		__global const float* inputs,
+		__global float* outputs,
+		__global const float* filters0,
+		__global const float* filters1,
+		__global const float* filters2,
+		__global const float* filters3,
+		__global const float* biases0,
+		__global const float* biases1,
+		__global const float* biases2,
+		__global const float* biases3,
+		const int D1,
+		const int D,
+		const int N,
+		const int num_convs,
+		const int pool,
+		const int images,
+		const int imageCnt,
+		__local float* buf
+	)
+{
+	const int first = get_group_id(0) * images;
+	const int lid = get_local_id(0);
+	const int lsize = get_local_size(0);
+	const int NN = N * N;
+	const int width = max(D1, D) * NN;
+	__local float* cur = buf;
+	__local float* next = buf + images * width;
+
+	for (int k = lid; k < images * D1 * NN; k += lsize) {
+		const int b = k / (D1 * NN);
+		const int c = k / NN % D1;
+		const int p = k % NN;
+		cur[b * width + c * NN + p] = (first + b < imageCnt) ?
+			inputs[D1 * PLANE_SIZE(N) * (first + b) + ACT_INDEX(c, p / N, p % N, N)] : 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	int Din = D1;
+	for (int f = 0; f < num_convs; f++) {
+		__global const float* filters = (f == 0) ? filters0 : (f == 1) ? filters1 : (f == 2) ? filters2 : filters3;
+		__global const float* biases = (f == 0) ? biases0 : (f == 1) ? biases1 : (f == 2) ? biases2 : biases3;
+		for (int o = lid; o < D; o += lsize) {
+			float sum[FUSED_MAX_PIXELS];
+			for (int e = 0; e < images * NN; e++)
+				sum[e] = biases[o];
+			for (int i = 0; i < Din; i++) {
+				__local const float* plane = cur + i * NN;
+				for (int k = 0; k < 9; k++) {
+					const float w = filters[FILTER_INDEX(o, i, k, Din)];
+					const int dy = k / 3 - 1;
+					const int dx = k % 3 - 1;
+					for (int p = 0; p < NN; p++) {
+						const int y = p / N + dy;
+						const int x = p % N + dx;
+						if (y < 0 || y >= N || x < 0 || x >= N)
+							continue;
+						for (int b = 0; b < images; b++)
+							sum[b * NN + p] = mad(w, plane[b * width + y * N + x], sum[b * NN + p]);
+					}
+				}
+			}
+			for (int b = 0; b < images; b++)
+				for (int p = 0; p < NN; p++)
+					next[b * width + o * NN + p] = ReLU(sum[b * NN + p]);
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+		__local float* t = cur;
+		cur = next;
+		next = t;
+		Din = D;
+	}
+
+	const int M = pool ? N / 2 : N;
+	for (int k = lid; k < images * D * PLANE_SIZE(M); k += lsize) {
+		const int b = k / (D * PLANE_SIZE(M));
+		const int c = k / PLANE_SIZE(M) % D;
+		const int remain = k % PLANE_SIZE(M);
+		const int i = remain / WIDTH(M) - HALO;
+		const int j = remain % WIDTH(M) - HALO;
+		if (first + b >= imageCnt)
+			continue;
+		float value = 0;
+		if (!BORDER(i, j, M)) {
+			__local const float* plane = cur + b * width + c * NN;
+			if (pool) {
+				for (int y = 0; y < 2; y++)
+					for (int x = 0; x < 2; x++)
+						value = fmax(value, plane[(i * 2 + y) * N + j * 2 + x]);
+			}
+			else {
+				value = plane[i * N + j];
+			}
+		}
+		outputs[D * PLANE_SIZE(M) * (first + b) + ACT_INDEX(c, i, j, M)] = value;
+	}
+}
+
+/*
+ * Fused classifier head: fc layers (with ReLU), softmax and argmax.
+ * inputs  : output of the last device layer, (D, N, N) in the activation
+ *           layout, in_storage floats per image
+ * params  : fc weights as (D1, D2), so neighbouring work-items read
+ *           neighbouring weights, and biases
+ * table   : D1, D2, weight offset and bias offset in params of each fc layer
+ * results : confidence and label of each image
+ * A work-group runs HEAD_IMAGES images with their activations in local
+ * memory (2 * HEAD_IMAGES * width floats), each weight is read once for all
+ * of them. softmax takes one exp per element.
+ */
+__kernel void classifier_head(
+		__global const float* inputs,
+		__global const float* params,
+		__constant int* table,
+		__global float* results,
+		const int num_fc,
+		const int D,
+		const int N,
+		const int in_storage,
+		const int width,
+		const int imageCnt,
+		__local float* buf
+	)
+{
+	const int first = get_group_id(0) * HEAD_IMAGES;
+	const int lid = get_local_id(0);
+	const int lsize = get_local_size(0);
+	__local float* cur = buf;
+	__local float* next = buf + HEAD_IMAGES * width;
+
+	// flatten to (D, N, N), the order the fc weights expect
+	const int size = D * N * N;
+	for (int k = lid; k < HEAD_IMAGES * size; k += lsize) {
+		const int b = k / size;
+		const int e = k % size;
+		const int p = e % (N*N);
+		cur[b * width + e] = (first + b < imageCnt) ?
+			inputs[in_storage * (first + b) + ACT_INDEX(e / (N*N), p / N, p % N, N)] : 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int f = 0; f < num_fc; f++) {
+		const int D1 = table[4 * f];
+		const int D2 = table[4 * f + 1];
+		__global const float* weights = params + table[4 * f + 2];
+		__global const float* biases = params + table[4 * f + 3];
+		for (int j = lid; j < D2; j += lsize) {
+			float sum[HEAD_IMAGES];
+			for (int b = 0; b < HEAD_IMAGES; b++)
+				sum[b] = biases[j];
+			for (int i = 0; i < D1; i++) {
+				const float w = weights[i * D2 + j];
+				for (int b = 0; b < HEAD_IMAGES; b++)
+					sum[b] = mad(w, cur[b * width + i], sum[b]);
+			}
+			for (int b = 0; b < HEAD_IMAGES; b++)
+				next[b * width + j] = ReLU(sum[b]);
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+		__local float* t = cur;
+		cur = next;
+		next = t;
+	}
+
+	if (lid >= HEAD_IMAGES || first + lid >= imageCnt)
+		return;
+	__local const float* x = cur + lid * width;
+	const int M = table[4 * (num_fc - 1) + 1];
+	float max = x[0];
+	for (int i = 1; i < M; i++)
+		max = fmax(max, x[i]);
+	float sum = 0;
+	float best = 0;
+	int label = 0;
+	for (int i = 0; i < M; i++) {
+		const float e = exp(x[i] - max);
+		sum += e;
+		if (best < e) {
+			best = e;
+			label = i;
+		}
+	}
+	results[2 * (first + lid)] = best / sum;
+	results[2 * (first + lid) + 1] = label;
+}
+
+#ifdef IMAGE_ACTIVATIONS
+/*
+ * Activations in image2d_array_t (IMAGE_ACTIVATIONS).
+ * An RGBA float texel holds channels 4 * c4 .. 4 * c4 + 3 of pixel (i, j) at
+ * coordinate (j, i, b * D4 + c4) for image b of the chunk, D4 = (D + 3) / 4.
+ * The planes have no halo: outside them the sampler returns 0, the zero
+ * padding of the convolution. Channel counts are padded (CHANNEL_PAD).
+ */
+__constant sampler_t ZERO_PAD = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP | CLK_FILTER_NEAREST;
+
+float texel_channel(float4 v, int k)
+{
+	return (k == 0) ? v.x : (k == 1) ? v.y : (k == 2) ? v.z : v.w;
+}
+
+// images [first, first + chunk) of the buffer into the image array
+__kernel void to_image(
+	__global const float* inputs,
+	__write_only image2d_array_t outputs,
+	int D, int N, int storage, int first)
+{
+	const int p = get_global_id(0);
+	const int c4 = get_global_id(1);
+	const int b = get_global_id(2);
+	const int i = p / N;
+	const int j = p % N;
+	__global const float* in = inputs + (size_t)storage * (first + b);
+
+	float v[4];
+	for (int k = 0; k < 4; k++)
+		v[k] = (4 * c4 + k < D) ? in[ACT_INDEX(4 * c4 + k, i, j, N)] : 0;
+	write_imagef(outputs, (int4)(j, i, b * get_global_size(1) + c4, 0), (float4)(v[0], v[1], v[2], v[3]));
+}
+
+// back into images [first, first + chunk) of the buffer, halo included
+__kernel void from_image(
+	__read_only image2d_array_t inputs,
+	__global float* outputs,
+	int D, int N, int storage, int first)
+{
+	const int p = get_global_id(0);
+	const int c = get_global_id(1);
+	const int b = get_global_id(2);
+	const int i = p / WIDTH(N) - HALO;
+	const int j = p % WIDTH(N) - HALO;
+
+	float v = 0;
+	if (!BORDER(i, j, N))
+		v = texel_channel(read_imagef(inputs, ZERO_PAD, (int4)(j, i, b * ((D + 3) / 4) + c / 4, 0)), c % 4);
+	outputs[(size_t)storage * (first + b) + ACT_INDEX(c, i, j, N)] = v;
+}
+
+// 3x3 convolution + ReLU of 4 output channels of a pixel, N x N from the image size
+__kernel void conv_image(
+	__read_only image2d_array_t inputs,
+	__global const float* filters,
+	__global const float* biases,
+	__write_only image2d_array_t outputs,
+	int D1, int D2)
+{
+	const int j = get_global_id(0);
+	const int i = get_global_id(1);
+	const int D1_4 = (D1 + 3) / 4;
+	const int D2_4 = (D2 + 3) / 4;
+	const int b = get_global_id(2) / D2_4;
+	const int o4 = get_global_id(2) % D2_4;
+
+	float sum[4];
+	for (int r = 0; r < 4; r++)
+		sum[r] = (4 * o4 + r < D2) ? biases[4 * o4 + r] : 0;
+	for (int c4 = 0; c4 < D1_4; c4++) {
+		const int c = 4 * c4;
+		for (int k = 0; k < 9; k++) {
+			const float4 x = read_imagef(inputs, ZERO_PAD, (int4)(j + k % 3 - 1, i + k / 3 - 1, b * D1_4 + c4, 0));
+			for (int r = 0; r < 4 && 4 * o4 + r < D2; r++) {
+				const int o = 4 * o4 + r;
+				for (int t = 0; t < 4 && c + t < D1; t++)
+					sum[r] = mad(texel_channel(x, t), filters[FILTER_INDEX(o, c + t, k, D1)], sum[r]);
+			}
+		}
+	}
+	write_imagef(outputs, (int4)(j, i, get_global_id(2), 0), (float4)(ReLU(sum[0]), ReLU(sum[1]), ReLU(sum[2]), ReLU(sum[3])));
+}
+
+// 2x2 max pooling, N x N output; a slice holds the same channels in and out
+__kernel void pool_image(
+	__read_only image2d_array_t inputs,
+	__write_only image2d_array_t outputs)
+{
+	const int j = get_global_id(0);
+	const int i = get_global_id(1);
+	const int s = get_global_id(2);
+	const float4 a = read_imagef(inputs, ZERO_PAD, (int4)(2 * j, 2 * i, s, 0));
+	const float4 b = read_imagef(inputs, ZERO_PAD, (int4)(2 * j + 1, 2 * i, s, 0));
+	const float4 c = read_imagef(inputs, ZERO_PAD, (int4)(2 * j, 2 * i + 1, s, 0));
+	const float4 d = read_imagef(inputs, ZERO_PAD, (int4)(2 * j + 1, 2 * i + 1, s, 0));
+	write_imagef(outputs, (int4)(j, i, s, 0), fmax(fmax(a, b), fmax(c, d)));
+}
+#endif
+
+/*
+ * Calibration kernels of the roofline analysis (ROOFLINE).
+ * roofline_fma: iters rounds of 4 independent float4 mads per work-item,
+ * 32 flops a round. roofline_copy: one float4 per work-item.
+ */
+__kernel void roofline_fma(__global float* out, float s, int iters)
+{
+	const int id = get_global_id(0);
+	const float4 m = (float4)(s);
+	const float4 k = (float4)(1.0f - s);
+	float4 a = (float4)(id, id + 1, id + 2, id + 3) * 0.001f;
+	float4 b = a + 0.25f;
+	float4 c = a + 0.5f;
+	float4 d = a + 0.75f;
+	for (int i = 0; i < iters; i++) {
+		a = mad(a, m, k);
+		b = mad(b, m, k);
+		c = mad(c, m, k);
+		d = mad(d, m, k);
+	}
+	out[id] = dot(a + b + c + d, (float4)(1.0f));
+}
+
+__kernel void roofline_copy(__global const float4* in, __global float4* out)
+{
+	const int id = get_global_id(0);
+	out[id] = in[id];
 }
@@ -3,12 +3,38 @@
 
 int compare_result(int argc, char **argv);
 
-extern double before_kernel_sec, profile_sec, pooling_sec, conv_sec, conv1_sec, conv2_sec, conv3_sec, conv4_sec, conv5_sec, fc_sec, softmax_sec, find_max_sec, RELU_sec;
+extern double before_kernel_sec, profile_sec, pooling_sec, conv_sec, conv_block_sec[], fc_sec, softmax_sec, find_max_sec, RELU_sec;
 extern long long write_nsec, kernel_nsec, read_nsec;
 extern const char *CLASS_NAME[];
+#ifdef RESULT_CACHE
+extern const char *result_cache_file;
+#endif
+#ifdef METRICS
+extern const char *metrics_file;
+#endif
+
+static void write_result(const char *fn, int *labels, float *confidences, int *labels_ans, int num_images)
+{
+    FILE *of = fopen(fn, "w");
+    double acc = 0;
+    for (int i = 0; i < num_images; ++i) {
+        fprintf(of, "Image %04d: %s %f\n", i, CLASS_NAME[labels[i]], confidences[i]);
+        if (labels[i] == labels_ans[i]) ++acc;
+    }
+    fprintf(of, "Accuracy: %f\n", acc / num_images);
+    fclose(of);
+}
 
 int main(int argc, char **argv)
 {
+    // a worker of the coordinator: images from first_image on, results on stdout
+    int worker = 0, first_image = 0;
+#ifdef MULTI_PROCESS
+    if (argc == 3 && strcmp(argv[1], "--worker") == 0) {
+        worker = 1;
+        first_image = atoi(argv[2]);
+    }
+#endif
     if (argc != 3) {
         print_usage_and_exit(argv);
     }
@@ -18,40 +44,96 @@ int main(int argc, char **argv)
 	scanf("%d", &num_images);
 
 	int batch_size = 256;
-	printf("batch_size : ");
+	printf("batch_size (0 = auto) : ");
 	scanf("%d", &batch_size);
 
-    float *images = read_images(num_images);
-    float *network = read_network();
-    float **network_sliced = slice_network(network);
+#ifdef MULTI_PROCESS
+	int num_workers = 0;
+	printf("num_workers (0 = none) : ");
+	scanf("%d", &num_workers);
+	if (num_workers > 0 && !worker) {
+		int *labels = (int*)calloc(num_images, sizeof(int));
+		float *confidences = (float*)calloc(num_images, sizeof(float));
+		clock_t start = clock();
+		int failed = coordinate(argv[0], num_images, batch_size, num_workers, labels, confidences);
+		clock_t end = clock();
+		if (failed) {
+			fprintf(stderr, "%d of %d workers failed\n", failed, num_workers);
+			exit(EXIT_FAILURE);
+		}
+		printf("Elapsed time: %f sec\n", (double)(end - start) / CLK_TCK);
+		int *labels_ans = read_labels(num_images);
+		write_result(argv[2], labels, confidences, labels_ans, num_images);
+		free(labels);
+		free(confidences);
+		free(labels_ans);
+
+		char* params[] = { "", "result.out", "seq.out", NULL };
+		compare_result(3, params);
+		return 0;
+	}
+#endif
+#ifdef RESULT_CACHE
+	// workers would overwrite each other's file
+	if (worker)
+		result_cache_file = NULL;
+#endif
+#ifdef METRICS
+	// the coordinator adds up the files of its workers
+	char worker_metrics_file[64];
+	if (worker) {
+		sprintf(worker_metrics_file, WORKER_METRICS_FILE, first_image);
+		metrics_file = worker_metrics_file;
+	}
+#endif
+
+    float *images = read_images(first_image, num_images);
+    network_t *net = read_network_desc("network.cfg");
+    float *exits;
+    float *network = load_network(net, &exits);
+#ifdef PROFILE_ENABLE
+    int net_blocks = net->num_blocks;   // net is freed before the profile is printed
+#endif
     int *labels = (int*)calloc(num_images, sizeof(int));
     float *confidences = (float*)calloc(num_images, sizeof(float));
 
     cnn_init();
     clock_t start = clock();
-    cnn(images, network_sliced, labels, confidences, num_images, batch_size);
+    cnn(images, net, labels, confidences, num_images, batch_size);
 	clock_t end = clock();
     printf("Elapsed time: %f sec\n", (double)(end - start) / CLK_TCK);
 
-    FILE *of = fopen(argv[2], "w");
-    int *labels_ans = read_labels(num_images);
-    double acc = 0;
-    for (int i = 0; i < num_images; ++i) {
-        fprintf(of, "Image %04d: %s %f\n", i, CLASS_NAME[labels[i]], confidences[i]);
-        if (labels[i] == labels_ans[i]) ++acc;
+    int *labels_ans = NULL;
+    if (worker) {
+        for (int i = 0; i < num_images; ++i)
+            printf("Result %d %d %.9g\n", first_image + i, labels[i], confidences[i]);
+        fflush(stdout);
     }
-    fprintf(of, "Accuracy: %f\n", acc / num_images);
-    fclose(of);
+    else {
+        labels_ans = read_labels(num_images);
+        write_result(argv[2], labels, confidences, labels_ans, num_images);
+    }
+#ifdef EARLY_EXIT
+    if (net->exit_of && !worker)
+        print_exit_report(net, labels, labels_ans, num_images, "seq.out");
+    free(net->exit_of);
+    free(net->exits);
+#endif
 
     free(images);
     free(network);
-    free(network_sliced);
+    free(exits);
+    free(net->layers);
+    free(net);
     free(labels);
     free(confidences);
     free(labels_ans);
 
 #ifdef PROFILE_ENABLE
-	printf("  - conv     : %lf sec = (%.2lf + %.2lf + %.2lf + %.2lf + %.2lf) sec \n", conv_sec, conv1_sec, conv2_sec, conv3_sec, conv4_sec, conv5_sec);
+	printf("  - conv     : %lf sec = (", conv_sec);
+	for (int b = 0; b < net_blocks; b++)
+		printf(b ? " + %.2lf" : "%.2lf", conv_block_sec[b]);
+	printf(") sec \n");
 	printf("    - before kernel : %lf sec \n", before_kernel_sec);
 	printf("      - write       : %lf sec \n", write_nsec / 1000000000.0);
 	printf("    - kernel        : %lf sec \n", kernel_nsec / 1000000000.0);
@@ -64,6 +146,8 @@ int main(int argc, char **argv)
 	printf("  - find_max : %lf sec \n", find_max_sec);
 #endif
 
+	if (worker)
+		return 0;
 	char* params[] = { "", "result.out", "seq.out", NULL };
 	compare_result(3, params);
 
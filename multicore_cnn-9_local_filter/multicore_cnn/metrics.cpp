@@ -0,0 +1,314 @@
+#pragma warning(disable:4996)
+#include "cnn.h"
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <algorithm>
+
+/*
+ * Run-time metrics (METRICS).
+ * The inference threads only do relaxed atomic increments, a background
+ * thread turns them into a Prometheus text snapshot in METRICS_FILE.
+ * The snapshot is written to a temporary file and renamed, so a reader never
+ * sees half of it.
+ *
+ * A worker of the coordinator (MULTI_PROCESS) writes its own file, and the
+ * coordinator adds them up into METRICS_FILE (metrics_combine).
+ *
+ * Histograms have fixed buckets, upper bounds HIST_MIN_NSEC * 2^k, and keep
+ * per-bucket counts; they are made cumulative when written out.
+ */
+#define HIST_BUCKETS 18             // 100 us .. 13 s, then +Inf
+#define HIST_MIN_NSEC 100000LL
+
+const char *metrics_file = METRICS_FILE;
+
+typedef struct {
+	std::atomic<long long> bucket[HIST_BUCKETS + 1];
+	std::atomic<long long> count;
+	std::atomic<long long> sum_nsec;
+} histogram_t;
+
+long long metrics_now()
+{
+#ifdef METRICS
+	return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+#else
+	return 0;
+#endif
+}
+
+#ifdef METRICS
+static const char *STAGE_NAME[NUM_STAGES] = { "load", "device", "host", "classify" };
+static const char *LAYER_TYPE_NAME[] = { "conv", "pool", "fc", "softmax" };
+
+static std::atomic<long long> images_total, batches_total, in_flight, device_memory;
+static histogram_t stage_hist[NUM_STAGES], batch_hist;
+static histogram_t *layer_hist;
+static std::atomic<long long> *exit_total;
+static network_t *metrics_net;
+static long long start_nsec;
+
+static std::thread writer;
+static std::mutex writer_lock;
+static std::condition_variable writer_cond;
+static int writer_stop;
+
+static void observe(histogram_t *h, long long nsec)
+{
+	int k = 0;
+	while (k < HIST_BUCKETS && nsec > (HIST_MIN_NSEC << k))
+		k++;
+	h->bucket[k].fetch_add(1, std::memory_order_relaxed);
+	h->count.fetch_add(1, std::memory_order_relaxed);
+	h->sum_nsec.fetch_add(nsec, std::memory_order_relaxed);
+}
+
+static void write_histogram(FILE *f, const char *name, const char *labels, histogram_t *h)
+{
+	const char *sep = labels[0] ? "," : "";
+	long long cumulative = 0;
+	for (int k = 0; k <= HIST_BUCKETS; k++) {
+		cumulative += h->bucket[k].load(std::memory_order_relaxed);
+		if (k < HIST_BUCKETS)
+			fprintf(f, "%s_bucket{%s%sle=\"%g\"} %lld\n", name, labels, sep, (HIST_MIN_NSEC << k) / 1e9, cumulative);
+		else
+			fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %lld\n", name, labels, sep, cumulative);
+	}
+	fprintf(f, "%s_sum%s%s%s %.9lf\n", name, sep[0] ? "{" : "", labels, sep[0] ? "}" : "", h->sum_nsec.load(std::memory_order_relaxed) / 1e9);
+	fprintf(f, "%s_count%s%s%s %lld\n", name, sep[0] ? "{" : "", labels, sep[0] ? "}" : "", h->count.load(std::memory_order_relaxed));
+}
+
+static void write_snapshot(double images_per_sec)
+{
+	char tmp[64];
+	sprintf(tmp, "%s.tmp", metrics_file);
+	FILE *f = fopen(tmp, "w");
+	if (!f)
+		return;
+
+	fprintf(f, "# HELP cnn_images_total Images classified, early exits included.\n");
+	fprintf(f, "# TYPE cnn_images_total counter\n");
+	fprintf(f, "cnn_images_total %lld\n", images_total.load());
+	fprintf(f, "# HELP cnn_batches_total Batches completed.\n");
+	fprintf(f, "# TYPE cnn_batches_total counter\n");
+	fprintf(f, "cnn_batches_total %lld\n", batches_total.load());
+	if (metrics_net->num_exits > 0) {
+		fprintf(f, "# HELP cnn_exit_images_total Images classified at an exit head.\n");
+		fprintf(f, "# TYPE cnn_exit_images_total counter\n");
+		for (int k = 0; k < metrics_net->num_exits; k++)
+			fprintf(f, "cnn_exit_images_total{head=\"%d\"} %lld\n", k, exit_total[k].load());
+	}
+	fprintf(f, "# HELP cnn_images_per_second Throughput over the last interval.\n");
+	fprintf(f, "# TYPE cnn_images_per_second gauge\n");
+	fprintf(f, "cnn_images_per_second %.2lf\n", images_per_sec);
+	fprintf(f, "# HELP cnn_batches_in_flight Batches submitted and not classified yet.\n");
+	fprintf(f, "# TYPE cnn_batches_in_flight gauge\n");
+	fprintf(f, "cnn_batches_in_flight %lld\n", in_flight.load());
+	fprintf(f, "# HELP cnn_device_memory_bytes OpenCL buffers allocated on the devices.\n");
+	fprintf(f, "# TYPE cnn_device_memory_bytes gauge\n");
+	fprintf(f, "cnn_device_memory_bytes %lld\n", device_memory.load());
+	fprintf(f, "# HELP cnn_uptime_seconds Time since cnn() started.\n");
+	fprintf(f, "# TYPE cnn_uptime_seconds gauge\n");
+	fprintf(f, "cnn_uptime_seconds %.3lf\n", (metrics_now() - start_nsec) / 1e9);
+
+	char labels[64];
+	fprintf(f, "# HELP cnn_batch_seconds Time from submitting a loaded batch to classifying it.\n");
+	fprintf(f, "# TYPE cnn_batch_seconds histogram\n");
+	write_histogram(f, "cnn_batch_seconds", "", &batch_hist);
+	fprintf(f, "# HELP cnn_stage_seconds Time a batch spends in each stage.\n");
+	fprintf(f, "# TYPE cnn_stage_seconds histogram\n");
+	for (int s = 0; s < NUM_STAGES; s++) {
+		sprintf(labels, "stage=\"%s\"", STAGE_NAME[s]);
+		write_histogram(f, "cnn_stage_seconds", labels, &stage_hist[s]);
+	}
+	fprintf(f, "# HELP cnn_layer_seconds Time of each layer per batch, kernel time for layers on a lane.\n");
+	fprintf(f, "# TYPE cnn_layer_seconds histogram\n");
+	for (int l = 0; l < metrics_net->num_layers; l++) {
+		sprintf(labels, "layer=\"%d\",type=\"%s\"", l, LAYER_TYPE_NAME[metrics_net->layers[l].type]);
+		write_histogram(f, "cnn_layer_seconds", labels, &layer_hist[l]);
+	}
+
+	if (fclose(f) != 0)
+		return;
+	// rename does not replace an existing file everywhere
+	remove(metrics_file);
+	rename(tmp, metrics_file);
+}
+
+static void writer_main()
+{
+	long long last_images = 0, last_nsec = start_nsec;
+	std::unique_lock<std::mutex> guard(writer_lock);
+	for (;;) {
+		int stop = writer_cond.wait_for(guard, milliseconds(METRICS_INTERVAL_MS), [] { return writer_stop != 0; });
+		const long long now = metrics_now(), images = images_total.load();
+		write_snapshot(now > last_nsec ? (images - last_images) * 1e9 / (now - last_nsec) : 0);
+		last_images = images;
+		last_nsec = now;
+		if (stop)
+			break;
+	}
+}
+#endif
+
+void metrics_start(network_t *net)
+{
+#ifdef METRICS
+	metrics_net = net;
+	layer_hist = new histogram_t[net->num_layers]();
+	exit_total = new std::atomic<long long>[net->num_exits + 1]();
+	start_nsec = metrics_now();
+	writer_stop = 0;
+	writer = std::thread(writer_main);
+	printf("metrics : %s every %d ms\n", metrics_file, METRICS_INTERVAL_MS);
+#endif
+}
+
+/*
+ * Write the final snapshot and stop the writer.
+ */
+void metrics_stop()
+{
+#ifdef METRICS
+	{
+		std::lock_guard<std::mutex> guard(writer_lock);
+		writer_stop = 1;
+	}
+	writer_cond.notify_all();
+	writer.join();
+	delete[] layer_hist;
+	delete[] exit_total;
+	layer_hist = NULL;
+	exit_total = NULL;
+#endif
+}
+
+/*
+ * Stage and layer times are only kept between metrics_start and metrics_stop,
+ * so warm-up and probing runs (HETERO_SCHEDULE) do not show up.
+ */
+void metrics_stage(int stage, long long nsec)
+{
+#ifdef METRICS
+	if (layer_hist)
+		observe(&stage_hist[stage], nsec);
+#endif
+}
+
+void metrics_layer(int layer, long long nsec)
+{
+#ifdef METRICS
+	if (layer_hist)
+		observe(&layer_hist[layer], nsec);
+#endif
+}
+
+/*
+ * A batch is done, imageCnt images went through the whole network.
+ */
+void metrics_batch(int imageCnt, long long nsec)
+{
+#ifdef METRICS
+	images_total.fetch_add(imageCnt, std::memory_order_relaxed);
+	batches_total.fetch_add(1, std::memory_order_relaxed);
+	observe(&batch_hist, nsec);
+#endif
+}
+
+void metrics_exit(int head)
+{
+#ifdef METRICS
+	images_total.fetch_add(1, std::memory_order_relaxed);
+	if (exit_total)
+		exit_total[head].fetch_add(1, std::memory_order_relaxed);
+#endif
+}
+
+void metrics_in_flight(int delta)
+{
+#ifdef METRICS
+	in_flight.fetch_add(delta, std::memory_order_relaxed);
+#endif
+}
+
+void metrics_device_memory(long long bytes)
+{
+#ifdef METRICS
+	device_memory.fetch_add(bytes, std::memory_order_relaxed);
+#endif
+}
+
+/*
+ * Add up the snapshots in files (one per worker) into METRICS_FILE: every
+ * sample is the sum over the workers, but the uptime is the longest one.
+ * Files not written yet are skipped. The workers run the same network, so
+ * all files have the same lines in the same order.
+ */
+void metrics_combine(char (*files)[64], int num_files)
+{
+#ifdef METRICS
+	typedef struct {
+		char text[256];         // comment line, or the sample without its value
+		double value;
+		int sample;
+	} line_t;
+	line_t *lines = NULL;
+	int num_lines = 0, max_lines = 0;
+	char text[256];
+	for (int k = 0; k < num_files; k++) {
+		FILE *f = fopen(files[k], "r");
+		if (!f)
+			continue;
+		int next = 0;
+		while (fgets(text, sizeof(text), f)) {
+			text[strcspn(text, "\n")] = '\0';
+			const int sample = text[0] != '#';
+			char *space = strrchr(text, ' ');
+			if (!text[0] || (sample && !space))
+				continue;
+			double value = 0;
+			if (sample) {
+				value = atof(space + 1);
+				*space = '\0';
+			}
+			// usually the next line of the first file
+			int l = next;
+			if (l >= num_lines || strcmp(lines[l].text, text) != 0)
+				for (l = 0; l < num_lines && strcmp(lines[l].text, text) != 0; l++);
+			if (l == num_lines) {
+				if (num_lines == max_lines) {
+					max_lines = max_lines ? 2 * max_lines : 256;
+					lines = (line_t*)realloc(lines, max_lines * sizeof(line_t));
+				}
+				strcpy(lines[l].text, text);
+				lines[l].value = value;
+				lines[l].sample = sample;
+				num_lines++;
+			}
+			else if (strcmp(text, "cnn_uptime_seconds") == 0)
+				lines[l].value = std::max(lines[l].value, value);
+			else
+				lines[l].value += value;
+			next = l + 1;
+		}
+		fclose(f);
+	}
+
+	char tmp[64];
+	sprintf(tmp, "%s.tmp", METRICS_FILE);
+	FILE *f = fopen(tmp, "w");
+	if (f) {
+		for (int l = 0; l < num_lines; l++)
+			if (lines[l].sample)
+				fprintf(f, "%s %.12g\n", lines[l].text, lines[l].value);
+			else
+				fprintf(f, "%s\n", lines[l].text);
+		if (fclose(f) == 0) {
+			remove(METRICS_FILE);
+			rename(tmp, METRICS_FILE);
+		}
+	}
+	free(lines);
+#endif
+}
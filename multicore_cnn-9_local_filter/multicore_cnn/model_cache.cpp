@@ -0,0 +1,479 @@
+#pragma warning(disable:4996)
+#include "cnn.h"
+
+/*
+ * Compiled model cache (MODEL_CACHE).
+ * When the kernels read conv weights in another layout than network.bin
+ * (NCHWc blocking, block-sparse filters), the repacked weights are kept in
+ * a file next to network.bin, together with everything else the run needs:
+ * the layer sizes after pruning, fc weights, exit heads, and the plain conv
+ * weights of host layers with HETERO_SCHEDULE. A run that finds a matching
+ * file only hashes network.bin, it does not slice, prune or repack it.
+ * The file is keyed by the network description, a hash of the contents of
+ * the parameter files and the layout, so retrained weights of the same size
+ * and time are never mixed up with old ones. The first run repacks and
+ * writes it.
+ * Every tensor starts on a PACK_ALIGN-byte boundary so the file can be
+ * mapped and handed to the device directly.
+ * With SPARSE_WEIGHTS, filters with few nonzero blocks keep only those,
+ * followed by their block index (see conv_sparse in kernel.cl).
+ *
+ * File layout: pack_header_t, then D1, D2 and the number of nonzero blocks
+ * (0 if dense) of each layer and D of each exit head, then per layer the
+ * conv weights, biases, block index and plain weights and biases, or the fc
+ * weights and biases, then the weights and biases of the exit heads.
+ */
+#define PACK_MAGIC "CNNPACK"
+#define PACK_VERSION 3
+#define PACK_ALIGN 64
+
+typedef struct {
+	char magic[8];
+	unsigned int version;
+	unsigned int layout;        // LAYOUT_NCHWC, 0 for plain (D2, D1, 3, 3)
+	unsigned long long key;
+	unsigned long long num_floats;  // after the size table, ints of block indices included
+} pack_header_t;
+
+#define PACK_FLOATS(n) (((n) + PACK_ALIGN / sizeof(float) - 1) / (PACK_ALIGN / sizeof(float)) * (PACK_ALIGN / sizeof(float)))
+
+// FNV-1a
+unsigned long long hash_bytes(unsigned long long h, const void *p, size_t n)
+{
+	const unsigned char *bytes = (const unsigned char*)p;
+	for (size_t i = 0; i < n; i++) {
+		h ^= bytes[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+/*
+ * FNV-1a over 8-byte words, with a shift to fold the high bits back,
+ * about eight times fewer steps than hash_bytes on an image or a weight file.
+ */
+unsigned long long hash_words(unsigned long long h, const void *p, size_t n)
+{
+	const unsigned char *bytes = (const unsigned char*)p;
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		unsigned long long w;
+		memcpy(&w, bytes + i, 8);
+		h ^= w;
+		h *= 1099511628211ULL;
+		h ^= h >> 29;
+	}
+	return hash_bytes(h, bytes + i, n - i);
+}
+
+#ifdef MODEL_CACHE
+#define BLOCK_SIZE (3 * 3 * FILTER_BLOCK * FILTER_BLOCK)
+
+static int block_rows(const layer_t *layer)
+{
+	return CHANNEL_PAD(layer->D2) / FILTER_BLOCK;
+}
+
+static int block_cols(const layer_t *layer)
+{
+	return CHANNEL_PAD(layer->D1) / FILTER_BLOCK;
+}
+
+static size_t packed_weight_size(const layer_t *layer)
+{
+	if (layer->sparse_blocks)
+		return PACK_FLOATS((size_t)layer->sparse_blocks * BLOCK_SIZE);
+	return PACK_FLOATS((size_t)CHANNEL_PAD(layer->D2) * CHANNEL_PAD(layer->D1) * 3 * 3);
+}
+
+static size_t packed_block_size(const layer_t *layer)
+{
+	if (layer->sparse_blocks == 0)
+		return 0;
+	return PACK_FLOATS((size_t)block_rows(layer) + 1 + layer->sparse_blocks);
+}
+
+static size_t packed_bias_size(const layer_t *layer)
+{
+	return PACK_FLOATS((size_t)CHANNEL_PAD(layer->D2));
+}
+
+#ifdef LAYOUT_NCHWC
+/*
+ * (D2, D1, 3, 3) -> (D2/C, D1/C, 3, 3, C, C), innermost index is the output channel.
+ * Padded channels get zero weights.
+ */
+static void pack_weight_nchwc(const float* filters, float* packed, int D2, int D1)
+{
+	const int C = LAYOUT_NCHWC;
+	const int B1 = CHANNEL_PAD(D1) / C;
+
+	for (int o = 0; o < D2; o++)
+		for (int i = 0; i < D1; i++)
+			for (int k = 0; k < 3 * 3; k++)
+				packed[((((size_t)(o / C) * B1 + i / C) * 3 * 3 + k) * C + i % C) * C + o % C] =
+					filters[((size_t)o * D1 + i) * 3 * 3 + k];
+}
+#endif
+
+/*
+ * Dense filters in the kernel layout, block (row, col) of BLOCK_SIZE floats
+ * is at (row * block_cols + col) * BLOCK_SIZE.
+ */
+static float* pack_dense(const layer_t *layer)
+{
+	float *w = (float*)calloc((size_t)CHANNEL_PAD(layer->D2) * CHANNEL_PAD(layer->D1) * 3 * 3, sizeof(float));
+#ifdef LAYOUT_NCHWC
+	pack_weight_nchwc(layer->weights, w, layer->D2, layer->D1);
+#else
+	memcpy(w, layer->weights, sizeof(float) * layer->D2 * layer->D1 * 3 * 3);
+#endif
+	return w;
+}
+
+#ifdef SPARSE_WEIGHTS
+static int count_blocks(const layer_t *layer)
+{
+	float *dense = pack_dense(layer);
+	const size_t num_blocks = (size_t)block_rows(layer) * block_cols(layer);
+	int nnz = 0;
+	for (size_t blk = 0; blk < num_blocks; blk++) {
+		const float *p = dense + blk * BLOCK_SIZE;
+		for (int e = 0; e < BLOCK_SIZE; e++) {
+			if (p[e] != 0.0f) {
+				nnz++;
+				break;
+			}
+		}
+	}
+	free(dense);
+	return (nnz <= SPARSE_MAX_DENSITY * num_blocks) ? nnz : 0;
+}
+#endif
+
+static void pack_layer(const layer_t *layer, float *w, float *b, int *blocks)
+{
+	memset(w, 0, sizeof(float) * packed_weight_size(layer));
+	memset(b, 0, sizeof(float) * packed_bias_size(layer));
+	memcpy(b, layer->biases, sizeof(float) * layer->D2);
+
+	float *dense = pack_dense(layer);
+	if (layer->sparse_blocks == 0) {
+		memcpy(w, dense, sizeof(float) * CHANNEL_PAD(layer->D2) * CHANNEL_PAD(layer->D1) * 3 * 3);
+		free(dense);
+		return;
+	}
+
+	// block_ptr (rows + 1) then block_idx, the blocks of a row are stored back to back
+	const int rows = block_rows(layer), cols = block_cols(layer);
+	int *block_idx = blocks + rows + 1;
+	int nnz = 0;
+	for (int r = 0; r < rows; r++) {
+		blocks[r] = nnz;
+		for (int col = 0; col < cols; col++) {
+			const float *p = dense + ((size_t)r * cols + col) * BLOCK_SIZE;
+			int e = 0;
+			while (e < BLOCK_SIZE && p[e] == 0.0f)
+				e++;
+			if (e == BLOCK_SIZE)
+				continue;
+			memcpy(w + (size_t)nnz * BLOCK_SIZE, p, sizeof(float) * BLOCK_SIZE);
+			block_idx[nnz++] = col;
+		}
+	}
+	blocks[rows] = nnz;
+	free(dense);
+}
+
+// floats of the plain weights and biases a layer keeps in the file
+static size_t plain_size(const layer_t *layer)
+{
+	if (layer->type == LAYER_FC)
+		return PACK_FLOATS((size_t)layer->D2 * layer->D1) + PACK_FLOATS((size_t)layer->D2);
+#ifdef HETERO_SCHEDULE
+	// a conv scheduled on TARGET_HOST runs on the plain weights
+	if (layer->type == LAYER_CONV)
+		return PACK_FLOATS((size_t)layer->D2 * layer->D1 * 3 * 3) + PACK_FLOATS((size_t)layer->D2);
+#endif
+	return 0;
+}
+
+static int exits_in_pack(const network_t *net)
+{
+#ifdef EARLY_EXIT
+	return net->num_exits;
+#else
+	return 0;
+#endif
+}
+
+static size_t table_size(const network_t *net)
+{
+	return PACK_FLOATS((size_t)3 * net->num_layers + net->num_exits) * sizeof(float);
+}
+
+static size_t pack_floats(const network_t *net)
+{
+	size_t n = 0;
+	for (int l = 0; l < net->num_layers; l++) {
+		const layer_t *layer = &net->layers[l];
+		if (layer->type == LAYER_CONV)
+			n += packed_weight_size(layer) + packed_bias_size(layer) + packed_block_size(layer);
+		n += plain_size(layer);
+	}
+	for (int k = 0; k < exits_in_pack(net); k++)
+		n += PACK_FLOATS((size_t)net->exits[k].M * net->exits[k].D) + PACK_FLOATS((size_t)net->exits[k].M);
+	return n;
+}
+
+// point the plain tensor *t of n floats to p, copying it there first if copy
+static float* place(float **t, size_t n, float *p, int copy)
+{
+	if (copy)
+		memcpy(p, *t, sizeof(float) * n);
+	*t = p;
+	return p + PACK_FLOATS(n);
+}
+
+/*
+ * Point the tensors of net into pack. With repack, the conv weights are
+ * packed and the plain tensors copied there first.
+ */
+static void place_network(network_t *net, float *pack, int repack)
+{
+	float *p = pack;
+	for (int l = 0; l < net->num_layers; l++) {
+		layer_t *layer = &net->layers[l];
+		if (layer->type == LAYER_CONV) {
+			layer->packed_weights = p;
+			p += packed_weight_size(layer);
+			layer->packed_biases = p;
+			p += packed_bias_size(layer);
+			layer->packed_blocks = layer->sparse_blocks ? (int*)p : NULL;
+			p += packed_block_size(layer);
+			if (repack)
+				pack_layer(layer, layer->packed_weights, layer->packed_biases, layer->packed_blocks);
+			if (layer->sparse_blocks)
+				printf("sparse layer %2d : %d of %d filter blocks\n", l, layer->sparse_blocks, block_rows(layer) * block_cols(layer));
+		}
+		if (plain_size(layer)) {
+			const size_t k = layer->type == LAYER_CONV ? 3 * 3 : 1;
+			p = place(&layer->weights, (size_t)layer->D2 * layer->D1 * k, p, repack);
+			p = place(&layer->biases, layer->D2, p, repack);
+		}
+		else {
+			layer->weights = layer->biases = NULL;
+		}
+	}
+	for (int k = 0; k < exits_in_pack(net); k++) {
+		exit_t *head = &net->exits[k];
+		p = place(&head->weights, (size_t)head->M * head->D, p, repack);
+		p = place(&head->biases, head->M, p, repack);
+	}
+}
+
+/*
+ * Read fn into net if it holds the pack of key. The layer sizes are only
+ * changed on success.
+ */
+static float* read_pack(network_t *net, const char *fn, const pack_header_t *header)
+{
+	FILE *f = fopen(fn, "rb");
+	if (!f)
+		return NULL;
+	const size_t table_ints = table_size(net) / sizeof(int);
+	int *table = (int*)malloc(sizeof(int) * table_ints);
+	pack_header_t cached;
+	int hit = fread(&cached, sizeof(cached), 1, f) == 1 &&
+		memcmp(cached.magic, header->magic, sizeof(header->magic)) == 0 &&
+		cached.version == header->version && cached.layout == header->layout && cached.key == header->key &&
+		fseek(f, PACK_ALIGN, SEEK_SET) == 0 &&
+		fread(table, sizeof(int), table_ints, f) == table_ints;
+
+	float *pack = NULL;
+	if (hit) {
+		layer_t *layers = (layer_t*)malloc(sizeof(layer_t) * net->num_layers);
+		exit_t *exits = (exit_t*)malloc(sizeof(exit_t) * (net->num_exits + 1));
+		memcpy(layers, net->layers, sizeof(layer_t) * net->num_layers);
+		memcpy(exits, net->exits, sizeof(exit_t) * net->num_exits);
+		for (int l = 0; l < net->num_layers; l++) {
+			net->layers[l].D1 = table[3 * l];
+			net->layers[l].D2 = table[3 * l + 1];
+			net->layers[l].sparse_blocks = table[3 * l + 2];
+		}
+		for (int k = 0; k < net->num_exits; k++)
+			net->exits[k].D = table[3 * net->num_layers + k];
+		hit = pack_floats(net) == cached.num_floats;
+		if (hit) {
+			pack = (float*)malloc(sizeof(float) * cached.num_floats);
+			hit = fread(pack, sizeof(float), cached.num_floats, f) == cached.num_floats;
+		}
+		if (!hit) {
+			memcpy(net->layers, layers, sizeof(layer_t) * net->num_layers);
+			memcpy(net->exits, exits, sizeof(exit_t) * net->num_exits);
+			free(pack);
+			pack = NULL;
+		}
+		free(layers);
+		free(exits);
+	}
+	free(table);
+	fclose(f);
+	return pack;
+}
+
+static void write_pack(network_t *net, const char *fn, const pack_header_t *header, const float *pack)
+{
+	const size_t table_ints = table_size(net) / sizeof(int);
+	int *table = (int*)calloc(table_ints, sizeof(int));
+	for (int l = 0; l < net->num_layers; l++) {
+		table[3 * l] = net->layers[l].D1;
+		table[3 * l + 1] = net->layers[l].D2;
+		table[3 * l + 2] = net->layers[l].sparse_blocks;
+	}
+	for (int k = 0; k < net->num_exits; k++)
+		table[3 * net->num_layers + k] = net->exits[k].D;
+
+	FILE *f = fopen(fn, "wb");
+	if (f) {
+		char pad[PACK_ALIGN] = { 0 };
+		size_t n = fwrite(header, sizeof(*header), 1, f) +
+			fwrite(pad, PACK_ALIGN - sizeof(*header), 1, f) +
+			(fwrite(table, sizeof(int), table_ints, f) == table_ints) +
+			(fwrite(pack, sizeof(float), header->num_floats, f) == header->num_floats);
+		if (fclose(f) != 0 || n != 4) {
+			fprintf(stderr, "%s: could not write the model cache\n", fn);
+			remove(fn);
+		}
+	}
+	free(table);
+}
+#endif
+
+/*
+ * Hash of the contents and size of fn, in one streaming pass of
+ * FILE_HASH_CHUNK bytes at a time (a multiple of 8, so the words line up
+ * as in one hash_words call). A missing file hashes like an empty one of
+ * size -1.
+ */
+#define FILE_HASH_CHUNK (1 << 20)
+
+static unsigned long long file_hash(unsigned long long h, const char *fn)
+{
+	long long size = -1;
+	FILE *f = fopen(fn, "rb");
+	if (f) {
+		unsigned char *chunk = (unsigned char*)malloc(FILE_HASH_CHUNK);
+		size_t n;
+		size = 0;
+		while ((n = fread(chunk, 1, FILE_HASH_CHUNK, f)) > 0) {
+			h = hash_words(h, chunk, n);
+			size += n;
+		}
+		free(chunk);
+		fclose(f);
+	}
+	return hash_bytes(h, &size, sizeof(size));
+}
+
+/*
+ * Read network.bin (and network_exits.bin with EARLY_EXIT), slice it into
+ * the layers, prune them with SPARSE_WEIGHTS and put the conv weights in
+ * the kernel layout, or load all of that from the compiled model cache.
+ * Returns the buffer the layers point into and the one of the exit heads in
+ * *exits (NULL if none), free them after cnn().
+ */
+float* load_network(network_t *net, float **exits)
+{
+	net->model_key = FNV_OFFSET_BASIS;
+	for (int l = 0; l < net->num_layers; l++) {
+		layer_t *layer = &net->layers[l];
+		int desc[5] = { layer->type, layer->D1, layer->D2, layer->N, layer->exit };
+		net->model_key = hash_bytes(net->model_key, desc, sizeof(desc));
+	}
+	for (int k = 0; k < net->num_exits; k++) {
+		exit_t *head = &net->exits[k];
+		int desc[4] = { head->after, head->D, head->N, head->M };
+		net->model_key = hash_bytes(net->model_key, desc, sizeof(desc));
+	}
+	net->model_key = file_hash(net->model_key, "network.bin");
+	*exits = NULL;
+
+#ifdef MODEL_CACHE
+	pack_header_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PACK_MAGIC, sizeof(PACK_MAGIC));
+	header.version = PACK_VERSION;
+#ifdef LAYOUT_NCHWC
+	header.layout = LAYOUT_NCHWC;
+#endif
+	header.key = hash_bytes(net->model_key, &header.layout, sizeof(header.layout));
+	if (exits_in_pack(net))
+		header.key = file_hash(header.key, "network_exits.bin");
+#ifdef SPARSE_WEIGHTS
+	const double max_density = SPARSE_MAX_DENSITY;
+	header.key = hash_bytes(header.key, &max_density, sizeof(max_density));
+#endif
+#ifdef HETERO_SCHEDULE
+	header.key = hash_bytes(header.key, "host", 4);
+#endif
+
+	char fn[64];
+	if (header.layout)
+		sprintf(fn, "network.nchwc%u.pack", header.layout);
+	else
+		sprintf(fn, "network.nchw.pack");
+
+	high_resolution_clock::time_point t1 = high_resolution_clock::now();
+	float *pack = read_pack(net, fn, &header);
+	const int hit = pack != NULL;
+	if (hit) {
+		place_network(net, pack, 0);
+	}
+	else {
+		float *params = read_network(net);
+		slice_network(net, params);
+		float *exit_params = NULL;
+#ifdef EARLY_EXIT
+		exit_params = read_exits(net);
+#endif
+#ifdef SPARSE_WEIGHTS
+		prune_network(net);
+#endif
+		for (int l = 0; l < net->num_layers; l++) {
+			layer_t *layer = &net->layers[l];
+			layer->sparse_blocks = 0;
+#ifdef SPARSE_WEIGHTS
+			if (layer->type == LAYER_CONV)
+				layer->sparse_blocks = count_blocks(layer);
+#endif
+		}
+		header.num_floats = pack_floats(net);
+		pack = (float*)malloc(sizeof(float) * header.num_floats);
+		place_network(net, pack, 1);
+		free(params);
+		free(exit_params);
+		write_pack(net, fn, &header, pack);
+	}
+
+	duration<double> time_span = duration_cast<duration<double>>(high_resolution_clock::now() - t1);
+	printf("model cache : %s %s, %.2lf MB in %.3lf sec\n", hit ? "loaded" : "wrote", fn,
+		sizeof(float) * pack_floats(net) / (1024.0 * 1024.0), time_span.count());
+	return pack;
+#else
+	// the kernels read network.bin as is
+	float *params = read_network(net);
+	slice_network(net, params);
+#ifdef EARLY_EXIT
+	*exits = read_exits(net);
+#endif
+	for (int l = 0; l < net->num_layers; l++) {
+		layer_t *layer = &net->layers[l];
+		layer->packed_weights = layer->weights;
+		layer->packed_biases = layer->biases;
+		layer->packed_blocks = NULL;
+		layer->sparse_blocks = 0;
+	}
+	return params;
+#endif
+}
@@ -1,5 +1,6 @@
 #pragma warning(disable:4996)
 #include "cnn.h"
+#include <mutex>
 #define CHECK_ERROR(err) \
   if (err != CL_SUCCESS) { \
     printf("[%s:%d] OpenCL error %d %s\n", __FILE__, __LINE__, err, getErrorString(err)); \
@@ -10,9 +11,9 @@
 #define NOT !
 #define STR_LEN 65536
 
-cl_context context;
-cl_command_queue kernel_queue;
-cl_kernel convKernel;
+// devices[0] is the accelerator selected in cnn_init
+device_t devices[MAX_DEVICES];
+int num_devices;
 
 const char *getErrorString(cl_int error)
 {
@@ -113,11 +114,10 @@ char* getSourceCode(_In_ const char *file_name, _Out_ size_t *len) {
 	return source_code;
 }
 
-cl_kernel getKernel(cl_context context, cl_device_id device, const char* source_file_name, const char* kernel_name)
+cl_program getProgram(cl_context context, cl_device_id device, const char* source_file_name)
 {
 	char str[STR_LEN] = { 0 };
 	cl_int err;
-	cl_kernel kernel;
 
 	cl_uint src_cnt = 1;
 	size_t source_size;
@@ -130,19 +130,40 @@ cl_kernel getKernel(cl_context context, cl_device_id device, const char* source_
 
 	char option[1024] = { 0 };
 	//sprintf(option, R"(-g -s "C:\Users\hojong\Desktop\multicore_cnn\multicore_cnn\kernel.cl")");
+#ifdef LAYOUT_NCHWC
+	sprintf(option, "-DLAYOUT_NCHWC=%d", LAYOUT_NCHWC);
+#else
 	sprintf(option, "");
+#endif
+#ifdef ZERO_HALO
+	strcat(option, " -DZERO_HALO");
+#endif
+	sprintf(option + strlen(option), " -DHEAD_IMAGES=%d -DFUSED_MAX_PIXELS=%d", HEAD_IMAGES, FUSED_MAX_PIXELS);
+#ifdef IMAGE_ACTIVATIONS
+	// the image kernels do not build without image support
+	cl_bool image_support = CL_FALSE;
+	clGetDeviceInfo(device, CL_DEVICE_IMAGE_SUPPORT, sizeof(cl_bool), &image_support, NULL);
+	if (image_support)
+		strcat(option, " -DIMAGE_ACTIVATIONS");
+#endif
 	err = clBuildProgram(program, 1, &device, option, NULL, NULL);
 	clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, STR_LEN, str, NULL);
 	printf("%s \n", str);
 	CHECK_ERROR(err);
 
-	kernel = clCreateKernel(program, kernel_name, &err);
+	return program;
+}
+
+cl_kernel getKernel(cl_program program, const char* kernel_name)
+{
+	cl_int err;
+	cl_kernel kernel = clCreateKernel(program, kernel_name, &err);
 	CHECK_ERROR(err);
 
 	return kernel;
 }
 
-cl_device_id getDevice(int platform_idx, int gpu_idx)
+cl_device_id getDevice(int platform_idx, int gpu_idx, cl_device_type required_type)
 {
 	char str[STR_LEN] = { 0 };
 	cl_int err;
@@ -246,9 +267,9 @@ cl_device_id getDevice(int platform_idx, int gpu_idx)
 
 			if (p == platform_idx AND d == gpu_idx)
 			{
-				if (!(device_type & CL_DEVICE_TYPE_GPU))
+				if (!(device_type & required_type))
 				{
-					fprintf(stderr, "selected device is not GPU, exit \n");
+					fprintf(stderr, "selected device is not %s, exit \n", (required_type & CL_DEVICE_TYPE_GPU) ? "GPU" : "CPU");
 					exit(1);
 				}
 				device = devices[d];
@@ -263,62 +284,218 @@ cl_device_id getDevice(int platform_idx, int gpu_idx)
 	return device;
 }
 
-cl_mem alloc_weight(float* filters, int D2, int D1)
+/*
+ * Device buffers go through these two so the metrics and the automatic batch
+ * size see the memory in use. Pinned host staging buffers are not counted.
+ */
+cl_mem create_buffer(device_t *dev, cl_mem_flags flags, size_t size)
 {
 	cl_int err;
+	cl_mem buf = clCreateBuffer(dev->context, flags, size, NULL, &err);
+	CHECK_ERROR(err);
+	dev->mem_used += size;
+	metrics_device_memory((long long)size);
+	return buf;
+}
 
-	const int filters_size = sizeof(float) * 3 * 3 * D2 * D1;
+/*
+ * width x width x slices image array of RGBA float texels (IMAGE_ACTIVATIONS).
+ */
+cl_mem create_image_array(device_t *dev, int width, int slices)
+{
+	cl_int err;
+	cl_image_format format;
+	format.image_channel_order = CL_RGBA;
+	format.image_channel_data_type = CL_FLOAT;
+	cl_image_desc desc;
+	memset(&desc, 0, sizeof(desc));
+	desc.image_type = CL_MEM_OBJECT_IMAGE2D_ARRAY;
+	desc.image_width = width;
+	desc.image_height = width;
+	desc.image_array_size = slices;
+	cl_mem image = clCreateImage(dev->context, CL_MEM_READ_WRITE, &format, &desc, NULL, &err);
+	CHECK_ERROR(err);
+	const size_t size = sizeof(float) * 4 * width * width * slices;
+	dev->mem_used += size;
+	metrics_device_memory((long long)size);
+	return image;
+}
+
+void release_buffer(cl_mem buf)
+{
+	size_t size = 0;
+	cl_context context = NULL;
+	clGetMemObjectInfo(buf, CL_MEM_SIZE, sizeof(size), &size, NULL);
+	clGetMemObjectInfo(buf, CL_MEM_CONTEXT, sizeof(context), &context, NULL);
+	for (int d = 0; d < num_devices; d++)
+		if (devices[d].context == context)
+			devices[d].mem_used -= size;
+	metrics_device_memory(-(long long)size);
+	clReleaseMemObject(buf);
+}
 
-	cl_mem bufFilters = clCreateBuffer(context, CL_MEM_READ_ONLY, filters_size, NULL, &err);
+/*
+ * Read-only device copy of size bytes.
+ */
+cl_mem alloc_buffer(device_t *dev, const void *data, size_t size)
+{
+	cl_int err;
+	cl_mem buf = create_buffer(dev, CL_MEM_READ_ONLY, size);
+	err = clEnqueueWriteBuffer(dev->queue, buf, CL_TRUE, 0, size, data, 0, NULL, NULL);
 	CHECK_ERROR(err);
-	err = clEnqueueWriteBuffer(kernel_queue, bufFilters, CL_FALSE, 0, filters_size, filters, 0, NULL, NULL);
+	return buf;
+}
+
+/*
+ * filters and bias are already in the kernel layout (load_network).
+ */
+cl_mem alloc_weight(device_t *dev, float* filters, int D2, int D1)
+{
+	cl_int err;
+
+	const size_t filters_size = sizeof(float) * 3 * 3 * CHANNEL_PAD(D2) * CHANNEL_PAD(D1);
+	cl_mem bufFilters = create_buffer(dev, CL_MEM_READ_ONLY, filters_size);
+	err = clEnqueueWriteBuffer(dev->queue, bufFilters, CL_TRUE, 0, filters_size, filters, 0, NULL, NULL);
 	CHECK_ERROR(err);
 
 	return bufFilters;
 }
 
-cl_mem alloc_bias(float* bias, int D2)
+cl_mem alloc_bias(device_t *dev, float* bias, int D2)
 {
 	cl_int err;
 
-	const int bias_size = sizeof(float) * D2;
-
-	cl_mem bufBias = clCreateBuffer(context, CL_MEM_READ_ONLY, bias_size, NULL, &err);
-	CHECK_ERROR(err);
-	err = clEnqueueWriteBuffer(kernel_queue, bufBias, CL_FALSE, 0, bias_size, bias, 0, NULL, NULL);
+	const size_t bias_size = sizeof(float) * CHANNEL_PAD(D2);
+	cl_mem bufBias = create_buffer(dev, CL_MEM_READ_ONLY, bias_size);
+	err = clEnqueueWriteBuffer(dev->queue, bufBias, CL_TRUE, 0, bias_size, bias, 0, NULL, NULL);
 	CHECK_ERROR(err);
 
 	return bufBias;
 }
 
-double before_kernel_sec, profile_sec;
-long long write_nsec, kernel_nsec, read_nsec;
+static float* map_arena(device_t *dev, cl_mem mem, size_t n, cl_event *event)
+{
+	cl_int err;
+	float *p = (float*)clEnqueueMapBuffer(dev->queue, mem, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE,
+		0, sizeof(float) * n, 0, NULL, event, &err);
+	CHECK_ERROR(err);
+	return p;
+}
 
-void clConv(float *inputs, float *outputs, cl_mem bufFilters, cl_mem bufBiases, int D2, int D1, int N, int batch_size, int imageCnt)
+/*
+ * Host side of an arena is pinned (CL_MEM_ALLOC_HOST_PTR) memory mapped into
+ * the host address space, so transfers are DMA'd without a staging copy.
+ * If the device shares memory with the host, the device buffer itself is
+ * mapped and no transfer is needed at all (zero-copy).
+ */
+void alloc_arena(device_t *dev, arena_t *arena, size_t n)
 {
 	cl_int err;
-#ifdef PROFILE_ENABLE
-	high_resolution_clock::time_point t1, t2;
-	duration<double> time_span;
 
-	t1 = high_resolution_clock::now();
-#endif
-	const int inputs_size = sizeof(float) * D1*N*N * imageCnt;
-	const int outputs_size = sizeof(float) * D2*N*N * imageCnt;
-	cl_mem bufInputs = clCreateBuffer(context, CL_MEM_READ_ONLY, inputs_size, NULL, &err);
+	arena->size = n;
+	arena->device = dev;
+	if (dev->host_unified_memory) {
+		arena->pinned = NULL;
+		arena->dev = create_buffer(dev, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, sizeof(float) * n);
+		arena->host = map_arena(dev, arena->dev, n, NULL);
+	}
+	else {
+		arena->pinned = clCreateBuffer(dev->context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, sizeof(float) * n, NULL, &err);
+		CHECK_ERROR(err);
+		arena->host = map_arena(dev, arena->pinned, n, NULL);
+		arena->dev = create_buffer(dev, CL_MEM_READ_WRITE, sizeof(float) * n);
+	}
+}
+
+void free_arena(arena_t *arena)
+{
+	cl_int err;
+	cl_command_queue queue = arena->device->queue;
+	cl_mem mapped = arena->pinned ? arena->pinned : arena->dev;
+
+	err = clEnqueueUnmapMemObject(queue, mapped, arena->host, 0, NULL, NULL);
 	CHECK_ERROR(err);
-	cl_mem bufOutputs = clCreateBuffer(context, CL_MEM_READ_WRITE, outputs_size, NULL, &err);
+	err = clFinish(queue);
 	CHECK_ERROR(err);
+	if (arena->pinned)
+		clReleaseMemObject(arena->pinned);
+	release_buffer(arena->dev);
+	arena->host = NULL;
+	arena->dev = NULL;
+	arena->pinned = NULL;
+}
 
-	cl_event write_event;
-	err = clEnqueueWriteBuffer(kernel_queue, bufInputs, CL_FALSE, 0, inputs_size, inputs, 0, NULL, &write_event);
+double before_kernel_sec, profile_sec;
+long long write_nsec, kernel_nsec, read_nsec;
+extern double pooling_sec, conv_sec, conv_block_sec[], fc_sec;
+
+// lanes of different pipeline stages and host stage threads update the counters concurrently (HETERO_SCHEDULE)
+static std::mutex profile_lock;
+
+// called per image by fc, softmax and find_max: only lock when other threads can be adding too
+void profile_add(double *counter, double sec)
+{
+#ifdef HETERO_SCHEDULE
+	std::lock_guard<std::mutex> guard(profile_lock);
+#endif
+	*counter += sec;
+}
+
+static long long event_nsec(cl_event event)
+{
+	cl_ulong start_nsec, end_nsec;
+	clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start_nsec, NULL);
+	clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end_nsec, NULL);
+	return (long long)(end_nsec - start_nsec);
+}
+
+/*
+ * Zero the halo rings of the D-channel output planes of imageCnt images with
+ * haloKernel, after wait_event (ZERO_HALO). conv and pool only write the
+ * interior. The queue is in order, so the kernel after this one waits for
+ * it; its event is not kept, the ring is 4 (N + 1) pixels a plane.
+ */
+static void enqueue_halo(cl_command_queue queue, cl_kernel haloKernel, cl_mem bufOutputs, int D, int N, int imageCnt, cl_event wait_event)
+{
+#ifdef ZERO_HALO
+	cl_int err;
+	err = clSetKernelArg(haloKernel, 0, sizeof(cl_mem), &bufOutputs);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(haloKernel, 1, sizeof(cl_int), &N);
+	CHECK_ERROR(err);
+	const size_t global_work_size[] = { (size_t)CHANNEL_PAD(D) / FILTER_BLOCK * imageCnt, (size_t)4 * (N + 1) };
+	cl_event event;
+	err = clEnqueueNDRangeKernel(queue, haloKernel, 2, NULL, global_work_size, NULL,
+		wait_event ? 1 : 0, wait_event ? &wait_event : NULL, &event);
 	CHECK_ERROR(err);
+	clReleaseEvent(event);
+#endif
+}
+
+/*
+ * Set arguments of the conv kernel and enqueue it after wait_event (if any).
+ * Block-sparse filters (bufBlocks != NULL) run with sparseKernel.
+ */
+static cl_event enqueue_conv(cl_command_queue queue, cl_kernel denseKernel, cl_kernel sparseKernel, cl_kernel haloKernel, cl_mem bufInputs, cl_mem bufOutputs,
+	cl_mem bufFilters, cl_mem bufBiases, cl_mem bufBlocks, int D2, int D1, int N, int imageCnt, cl_event wait_event)
+{
+	cl_int err;
+	enqueue_halo(queue, haloKernel, bufOutputs, D2, N, imageCnt, wait_event);
+#ifdef LAYOUT_NCHWC
+	D1 = CHANNEL_PAD(D1);
+	D2 = CHANNEL_PAD(D2);
+#endif
+	cl_kernel convKernel = bufBlocks ? sparseKernel : denseKernel;
 
 	int i = 0;
 	err = clSetKernelArg(convKernel, i++, sizeof(cl_mem), &bufInputs);
 	CHECK_ERROR(err);
 	err = clSetKernelArg(convKernel, i++, sizeof(cl_mem), &bufFilters);
 	CHECK_ERROR(err);
+	if (bufBlocks) {
+		err = clSetKernelArg(convKernel, i++, sizeof(cl_mem), &bufBlocks);
+		CHECK_ERROR(err);
+	}
 	err = clSetKernelArg(convKernel, i++, sizeof(cl_mem), &bufOutputs);
 	CHECK_ERROR(err);
 	err = clSetKernelArg(convKernel, i++, sizeof(cl_mem), &bufBiases);
@@ -331,12 +508,60 @@ void clConv(float *inputs, float *outputs, cl_mem bufFilters, cl_mem bufBiases,
 	CHECK_ERROR(err);
 	err = clSetKernelArg(convKernel, i++, sizeof(cl_int), &imageCnt);
 	CHECK_ERROR(err);
-	err = clSetKernelArg(convKernel, i++, sizeof(cl_float)*D1*3*3, NULL);
-	CHECK_ERROR(err);
+	// one work-item per interior pixel of the output planes, rounded up to whole work-groups
+	const size_t local_work_size[] = { 1, 256 };
+	const size_t pixels = ((size_t)N*N*imageCnt + local_work_size[1] - 1) / local_work_size[1] * local_work_size[1];
+#ifdef LAYOUT_NCHWC
+	int work_dim = 2;
+	const size_t global_work_size[] = { (size_t)D2 / LAYOUT_NCHWC, pixels };
+#else
+	if (!bufBlocks) {
+		err = clSetKernelArg(convKernel, i++, sizeof(cl_float)*D1*3*3, NULL);
+		CHECK_ERROR(err);
+	}
 
 	int work_dim = 2;
-	const size_t global_work_size[] = { D2, N*N*batch_size };
-	const size_t local_work_size[] = { 1, 256 };
+	const size_t global_work_size[] = { (size_t)D2, pixels };
+#endif
+
+	cl_event kernel_event;
+	err = clEnqueueNDRangeKernel(
+		queue, convKernel, work_dim, NULL,
+		global_work_size, local_work_size,
+		wait_event ? 1 : 0, wait_event ? &wait_event : NULL, &kernel_event);
+	CHECK_ERROR(err);
+
+	return kernel_event;
+}
+
+void clConv(arena_t *inputs, arena_t *outputs, cl_mem bufFilters, cl_mem bufBiases, cl_mem bufBlocks, int D2, int D1, int N, int imageCnt)
+{
+	cl_int err;
+	device_t *dev = inputs->device;
+	cl_command_queue kernel_queue = dev->queue;
+#ifdef PROFILE_ENABLE
+	high_resolution_clock::time_point t1, t2;
+	duration<double> time_span;
+
+	t1 = high_resolution_clock::now();
+#endif
+	const size_t inputs_size = sizeof(float) * CHANNEL_PAD(D1)*PLANE_SIZE(N) * imageCnt;
+	const size_t outputs_size = sizeof(float) * CHANNEL_PAD(D2)*PLANE_SIZE(N) * imageCnt;
+	cl_mem bufInputs = inputs->dev;
+	cl_mem bufOutputs = outputs->dev;
+
+	// zero-copy: hand the buffers back to the device instead of copying
+	cl_event write_event;
+	if (dev->host_unified_memory) {
+		err = clEnqueueUnmapMemObject(kernel_queue, bufInputs, inputs->host, 0, NULL, &write_event);
+		CHECK_ERROR(err);
+		err = clEnqueueUnmapMemObject(kernel_queue, bufOutputs, outputs->host, 0, NULL, NULL);
+		CHECK_ERROR(err);
+	}
+	else {
+		err = clEnqueueWriteBuffer(kernel_queue, bufInputs, CL_FALSE, 0, inputs_size, inputs->host, 0, NULL, &write_event);
+		CHECK_ERROR(err);
+	}
 
 #ifdef PROFILE_ENABLE
 	t2 = high_resolution_clock::now();
@@ -344,62 +569,678 @@ void clConv(float *inputs, float *outputs, cl_mem bufFilters, cl_mem bufBiases,
 	before_kernel_sec += time_span.count();
 #endif
 
-	cl_event kernel_event;
-	err = clEnqueueNDRangeKernel(
-		kernel_queue, convKernel, work_dim, NULL,
-		global_work_size, local_work_size,
-		0, NULL, &kernel_event);
+	cl_event kernel_event = enqueue_conv(kernel_queue, dev->conv, dev->conv_sparse, dev->halo, bufInputs, bufOutputs, bufFilters, bufBiases, bufBlocks,
+		D2, D1, N, imageCnt, NULL);
+
+	cl_event read_event;
+	if (dev->host_unified_memory) {
+		inputs->host = map_arena(dev, bufInputs, inputs->size, NULL);
+		outputs->host = map_arena(dev, bufOutputs, outputs->size, &read_event);
+	}
+	else {
+		err = clEnqueueReadBuffer(kernel_queue, bufOutputs, CL_TRUE, 0, outputs_size, outputs->host,
+			0, NULL, &read_event);
+		CHECK_ERROR(err);
+	}
+
+#ifdef PROFILE_ENABLE
+	t1 = high_resolution_clock::now();
+
+	write_nsec += event_nsec(write_event);
+	kernel_nsec += event_nsec(kernel_event);
+	read_nsec += event_nsec(read_event);
+
+	t2 = high_resolution_clock::now();
+	time_span = duration_cast<duration<double>>(t2 - t1);
+	profile_sec += time_span.count();
+#endif
+	clReleaseEvent(write_event);
+	clReleaseEvent(kernel_event);
+	clReleaseEvent(read_event);
+}
+
+/*
+ * Asynchronous dispatch.
+ * clBeginBatch, clEnqueueConv/clEnqueuePool and clEnqueueReadback enqueue a
+ * whole chain of device layers on a lane back to back, each waiting on the
+ * previous command's event, with a single readback at the end. clWaitBatch
+ * waits for the lane and only then profiles and releases its events.
+ * Each lane has its own queue and kernel objects, so several batches can be
+ * in flight on the device at once.
+ */
+enum { EVENT_WRITE, EVENT_CONV, EVENT_POOL, EVENT_HEAD, EVENT_READ };
+
+static void push_event(lane_t *lane, cl_event event, int kind, int layer, int block, int images)
+{
+	if (lane->num_pending == lane->max_pending) {
+		lane->max_pending = lane->max_pending ? lane->max_pending * 2 : 64;
+		lane->pending = (pending_event_t*)realloc(lane->pending, sizeof(pending_event_t) * lane->max_pending);
+	}
+	pending_event_t *pending = &lane->pending[lane->num_pending++];
+	pending->event = event;
+	pending->kind = kind;
+	pending->layer = layer;
+	pending->block = block;
+	pending->images = images;
+}
+
+static cl_event last_event(lane_t *lane)
+{
+	return lane->num_pending ? lane->pending[lane->num_pending - 1].event : NULL;
+}
+
+lane_t* create_lanes(device_t *dev, int num_lanes)
+{
+	cl_int err;
+	lane_t *lanes = (lane_t*)calloc(num_lanes, sizeof(lane_t));
+
+	for (int k = 0; k < num_lanes; k++) {
+		lanes[k].device = dev;
+		lanes[k].queue = clCreateCommandQueue(dev->context, dev->id, CL_QUEUE_PROFILING_ENABLE, &err);
+		CHECK_ERROR(err);
+#ifdef LAYOUT_NCHWC
+		lanes[k].conv = getKernel(dev->program, "conv_nchwc");
+		lanes[k].conv_sparse = getKernel(dev->program, "conv_nchwc_sparse");
+		lanes[k].pool = getKernel(dev->program, "pool_nchwc");
+#else
+		lanes[k].conv = getKernel(dev->program, "conv");
+		lanes[k].conv_sparse = getKernel(dev->program, "conv_sparse");
+		lanes[k].pool = getKernel(dev->program, "pool");
+#endif
+#ifdef ZERO_HALO
+		lanes[k].halo = getKernel(dev->program, "halo");
+#endif
+		lanes[k].head = getKernel(dev->program, "classifier_head");
+		lanes[k].block = getKernel(dev->program, "conv_block");
+#ifdef IMAGE_ACTIVATIONS
+		if (dev->image_support) {
+			lanes[k].to_image = getKernel(dev->program, "to_image");
+			lanes[k].from_image = getKernel(dev->program, "from_image");
+			lanes[k].conv_image = getKernel(dev->program, "conv_image");
+			lanes[k].pool_image = getKernel(dev->program, "pool_image");
+		}
+#endif
+	}
+	return lanes;
+}
+
+void free_lanes(lane_t *lanes, int num_lanes)
+{
+	for (int k = 0; k < num_lanes; k++) {
+		clReleaseKernel(lanes[k].conv);
+		clReleaseKernel(lanes[k].conv_sparse);
+		clReleaseKernel(lanes[k].pool);
+		if (lanes[k].halo)
+			clReleaseKernel(lanes[k].halo);
+		clReleaseKernel(lanes[k].head);
+		clReleaseKernel(lanes[k].block);
+		if (lanes[k].to_image) {
+			clReleaseKernel(lanes[k].to_image);
+			clReleaseKernel(lanes[k].from_image);
+			clReleaseKernel(lanes[k].conv_image);
+			clReleaseKernel(lanes[k].pool_image);
+		}
+		clReleaseCommandQueue(lanes[k].queue);
+		free(lanes[k].pending);
+	}
+	free(lanes);
+}
+
+void clBeginBatch(lane_t *lane, arena_t *input, size_t input_size, int num_arenas)
+{
+	cl_int err;
+	cl_event write_event;
+
+	if (lane->device->host_unified_memory) {
+		for (int a = 0; a < num_arenas; a++) {
+			err = clEnqueueUnmapMemObject(lane->queue, lane->arenas[a].dev, lane->arenas[a].host, 0, NULL, NULL);
+			CHECK_ERROR(err);
+		}
+		err = clEnqueueMarkerWithWaitList(lane->queue, 0, NULL, &write_event);
+		CHECK_ERROR(err);
+	}
+	else {
+		err = clEnqueueWriteBuffer(lane->queue, input->dev, CL_FALSE, 0, input_size, input->host, 0, NULL, &write_event);
+		CHECK_ERROR(err);
+	}
+	push_event(lane, write_event, EVENT_WRITE, -1, 0, 0);
+}
+
+void clEnqueueConv(lane_t *lane, arena_t *inputs, arena_t *outputs, cl_mem filters, cl_mem biases, cl_mem blocks, int D2, int D1, int N, int layer, int block, int imageCnt)
+{
+	cl_event event = enqueue_conv(lane->queue, lane->conv, lane->conv_sparse, lane->halo, inputs->dev, outputs->dev, filters, biases, blocks,
+		D2, D1, N, imageCnt, last_event(lane));
+	push_event(lane, event, EVENT_CONV, layer, block, imageCnt);
+}
+
+void clEnqueuePool(lane_t *lane, arena_t *inputs, arena_t *outputs, int D, int N, int layer, int imageCnt)
+{
+	cl_int err;
+	cl_event wait_event = last_event(lane);
+	enqueue_halo(lane->queue, lane->halo, outputs->dev, D, N, imageCnt, wait_event);
+#ifdef LAYOUT_NCHWC
+	D = CHANNEL_PAD(D) / LAYOUT_NCHWC;
+#endif
+
+	int i = 0;
+	err = clSetKernelArg(lane->pool, i++, sizeof(cl_mem), &inputs->dev);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->pool, i++, sizeof(cl_mem), &outputs->dev);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->pool, i++, sizeof(cl_int), &D);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->pool, i++, sizeof(cl_int), &N);
 	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->pool, i++, sizeof(cl_int), &imageCnt);
+	CHECK_ERROR(err);
+
+	const size_t global_work_size[] = { (size_t)D, (size_t)N*N*imageCnt };
+	cl_event event;
+	err = clEnqueueNDRangeKernel(lane->queue, lane->pool, 2, NULL, global_work_size, NULL,
+		wait_event ? 1 : 0, wait_event ? &wait_event : NULL, &event);
+	CHECK_ERROR(err);
+	push_event(lane, event, EVENT_POOL, layer, 0, imageCnt);
+}
 
+void clEnqueueReadback(lane_t *lane, arena_t *output, size_t output_size, int num_arenas)
+{
+	cl_int err;
+	cl_event wait_event = last_event(lane);
 	cl_event read_event;
-	err = clEnqueueReadBuffer(kernel_queue, bufOutputs, CL_TRUE, 0, outputs_size, outputs,
-		0, NULL, &read_event);
+
+	if (lane->device->host_unified_memory) {
+		for (int a = 0; a < num_arenas; a++) {
+			arena_t *arena = &lane->arenas[a];
+			arena->host = (float*)clEnqueueMapBuffer(lane->queue, arena->dev, CL_FALSE, CL_MAP_READ | CL_MAP_WRITE,
+				0, sizeof(float) * arena->size, 1, &wait_event, arena == output ? &read_event : NULL, &err);
+			CHECK_ERROR(err);
+		}
+	}
+	else {
+		err = clEnqueueReadBuffer(lane->queue, output->dev, CL_FALSE, 0, output_size, output->host,
+			1, &wait_event, &read_event);
+		CHECK_ERROR(err);
+	}
+	push_event(lane, read_event, EVENT_READ, -1, 0, 0);
+
+	err = clFlush(lane->queue);
+	CHECK_ERROR(err);
+}
+
+/*
+ * Enqueue the fused conv block layers[0 .. num_layers) (FUSED_BLOCKS): its
+ * convs, then the pool if it ends with one.
+ */
+void clEnqueueBlock(lane_t *lane, arena_t *inputs, arena_t *outputs, layer_t *layers, int num_layers, int imageCnt)
+{
+	cl_int err;
+	const int device = lane->device->index;
+	const int pool = layers[num_layers - 1].type == LAYER_POOL;
+	const int num_convs = num_layers - pool;
+	const int D1 = layers[0].D1;
+	const int D = layers[0].D2;
+	const int N = layers[0].N;
+	const int images = layers[0].fused_images;
+
+	int i = 0;
+	err = clSetKernelArg(lane->block, i++, sizeof(cl_mem), &inputs->dev);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->block, i++, sizeof(cl_mem), &outputs->dev);
+	CHECK_ERROR(err);
+	// unused filter and bias slots repeat the first conv
+	for (int f = 0; f < FUSED_MAX_CONVS; f++) {
+		err = clSetKernelArg(lane->block, i++, sizeof(cl_mem), &layers[f < num_convs ? f : 0].w[device]);
+		CHECK_ERROR(err);
+	}
+	for (int f = 0; f < FUSED_MAX_CONVS; f++) {
+		err = clSetKernelArg(lane->block, i++, sizeof(cl_mem), &layers[f < num_convs ? f : 0].b[device]);
+		CHECK_ERROR(err);
+	}
+	err = clSetKernelArg(lane->block, i++, sizeof(cl_int), &D1);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->block, i++, sizeof(cl_int), &D);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->block, i++, sizeof(cl_int), &N);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->block, i++, sizeof(cl_int), &num_convs);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->block, i++, sizeof(cl_int), &pool);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->block, i++, sizeof(cl_int), &images);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->block, i++, sizeof(cl_int), &imageCnt);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->block, i++, sizeof(cl_float) * 2 * images * (D1 > D ? D1 : D) * N * N, NULL);
+	CHECK_ERROR(err);
+
+	const size_t global_work_size[] = { (size_t)(imageCnt + images - 1) / images * FUSED_GROUP_SIZE };
+	const size_t local_work_size[] = { FUSED_GROUP_SIZE };
+	cl_event wait_event = last_event(lane);
+	cl_event event;
+	err = clEnqueueNDRangeKernel(lane->queue, lane->block, 1, NULL, global_work_size, local_work_size,
+		wait_event ? 1 : 0, wait_event ? &wait_event : NULL, &event);
+	CHECK_ERROR(err);
+	push_event(lane, event, EVENT_CONV, layers[0].index, layers[0].block, imageCnt);
+}
+
+/*
+ * Run the classifier head on the output of the device layers in place of
+ * clEnqueueReadback: only the confidence and label of each image come back,
+ * into lane->results.
+ */
+void clEnqueueHead(lane_t *lane, arena_t *inputs, head_t *head, int D, int N, size_t in_storage, int layer, int imageCnt, int num_arenas)
+{
+	cl_int err;
+	const int storage = (int)in_storage;
+
+	int i = 0;
+	err = clSetKernelArg(lane->head, i++, sizeof(cl_mem), &inputs->dev);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->head, i++, sizeof(cl_mem), &head->dev_params);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->head, i++, sizeof(cl_mem), &head->dev_table);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->head, i++, sizeof(cl_mem), &lane->dev_results);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->head, i++, sizeof(cl_int), &head->num_fc);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->head, i++, sizeof(cl_int), &D);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->head, i++, sizeof(cl_int), &N);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->head, i++, sizeof(cl_int), &storage);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->head, i++, sizeof(cl_int), &head->width);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->head, i++, sizeof(cl_int), &imageCnt);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->head, i++, sizeof(cl_float) * 2 * HEAD_IMAGES * head->width, NULL);
+	CHECK_ERROR(err);
+
+	const size_t global_work_size[] = { (size_t)(imageCnt + HEAD_IMAGES - 1) / HEAD_IMAGES * HEAD_GROUP_SIZE };
+	const size_t local_work_size[] = { HEAD_GROUP_SIZE };
+	cl_event wait_event = last_event(lane);
+	cl_event kernel_event, read_event;
+	err = clEnqueueNDRangeKernel(lane->queue, lane->head, 1, NULL, global_work_size, local_work_size,
+		wait_event ? 1 : 0, wait_event ? &wait_event : NULL, &kernel_event);
+	CHECK_ERROR(err);
+	push_event(lane, kernel_event, EVENT_HEAD, layer, 0, imageCnt);
+
+	err = clEnqueueReadBuffer(lane->queue, lane->dev_results, CL_FALSE, 0, sizeof(float) * 2 * imageCnt, lane->results,
+		1, &kernel_event, &read_event);
+	CHECK_ERROR(err);
+	push_event(lane, read_event, EVENT_READ, -1, 0, 0);
+
+	// the host gets its arenas back, as after clEnqueueReadback
+	if (lane->device->host_unified_memory) {
+		for (int a = 0; a < num_arenas; a++) {
+			arena_t *arena = &lane->arenas[a];
+			arena->host = (float*)clEnqueueMapBuffer(lane->queue, arena->dev, CL_FALSE, CL_MAP_READ | CL_MAP_WRITE,
+				0, sizeof(float) * arena->size, 1, &kernel_event, NULL, &err);
+			CHECK_ERROR(err);
+		}
+	}
+
+	err = clFlush(lane->queue);
+	CHECK_ERROR(err);
+}
+
+/*
+ * Image activations (IMAGE_ACTIVATIONS).
+ * The conv and pool layers of a chunk of imageCnt images read and write
+ * image arrays; clEnqueueToImage and clEnqueueFromImage convert the chunk
+ * from images [first_image, first_image + imageCnt) of an arena and back,
+ * storage floats per image. Channel counts D are padded (CHANNEL_PAD).
+ * The conversions count as the write and read of the batch when profiling.
+ */
+static void enqueue_image_kernel(lane_t *lane, cl_kernel kernel, const size_t *global_work_size, int kind, int layer, int block, int imageCnt)
+{
+	cl_event wait_event = last_event(lane);
+	cl_event event;
+	cl_int err = clEnqueueNDRangeKernel(lane->queue, kernel, 3, NULL, global_work_size, NULL,
+		wait_event ? 1 : 0, wait_event ? &wait_event : NULL, &event);
+	CHECK_ERROR(err);
+	push_event(lane, event, kind, layer, block, imageCnt);
+}
+
+void clEnqueueToImage(lane_t *lane, arena_t *inputs, cl_mem image, int D, int N, size_t storage, int first_image, int imageCnt)
+{
+	cl_int err;
+	const int in_storage = (int)storage;
+
+	int i = 0;
+	err = clSetKernelArg(lane->to_image, i++, sizeof(cl_mem), &inputs->dev);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->to_image, i++, sizeof(cl_mem), &image);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->to_image, i++, sizeof(cl_int), &D);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->to_image, i++, sizeof(cl_int), &N);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->to_image, i++, sizeof(cl_int), &in_storage);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->to_image, i++, sizeof(cl_int), &first_image);
+	CHECK_ERROR(err);
+
+	const size_t global_work_size[] = { (size_t)N * N, (size_t)(D + 3) / 4, (size_t)imageCnt };
+	enqueue_image_kernel(lane, lane->to_image, global_work_size, EVENT_WRITE, -1, 0, 0);
+}
+
+void clEnqueueFromImage(lane_t *lane, cl_mem image, arena_t *outputs, int D, int N, size_t storage, int first_image, int imageCnt)
+{
+	cl_int err;
+	const int out_storage = (int)storage;
+
+	int i = 0;
+	err = clSetKernelArg(lane->from_image, i++, sizeof(cl_mem), &image);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->from_image, i++, sizeof(cl_mem), &outputs->dev);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->from_image, i++, sizeof(cl_int), &D);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->from_image, i++, sizeof(cl_int), &N);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->from_image, i++, sizeof(cl_int), &out_storage);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->from_image, i++, sizeof(cl_int), &first_image);
+	CHECK_ERROR(err);
+
+	// the whole plane, the halo ring is zeroed
+	const size_t global_work_size[] = { (size_t)PLANE_SIZE(N), (size_t)D, (size_t)imageCnt };
+	enqueue_image_kernel(lane, lane->from_image, global_work_size, EVENT_READ, -1, 0, 0);
+}
+
+void clEnqueueConvImage(lane_t *lane, cl_mem inputs, cl_mem outputs, cl_mem filters, cl_mem biases, int D2, int D1, int N, int layer, int block, int imageCnt)
+{
+	cl_int err;
+
+	int i = 0;
+	err = clSetKernelArg(lane->conv_image, i++, sizeof(cl_mem), &inputs);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->conv_image, i++, sizeof(cl_mem), &filters);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->conv_image, i++, sizeof(cl_mem), &biases);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->conv_image, i++, sizeof(cl_mem), &outputs);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->conv_image, i++, sizeof(cl_int), &D1);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(lane->conv_image, i++, sizeof(cl_int), &D2);
 	CHECK_ERROR(err);
 
-	err = clReleaseMemObject(bufInputs);
+	// one work-item per output texel, 4 channels of a pixel
+	const size_t global_work_size[] = { (size_t)N, (size_t)N, (size_t)(D2 + 3) / 4 * imageCnt };
+	enqueue_image_kernel(lane, lane->conv_image, global_work_size, EVENT_CONV, layer, block, imageCnt);
+}
+
+void clEnqueuePoolImage(lane_t *lane, cl_mem inputs, cl_mem outputs, int D, int N, int layer, int imageCnt)
+{
+	cl_int err;
+
+	int i = 0;
+	err = clSetKernelArg(lane->pool_image, i++, sizeof(cl_mem), &inputs);
 	CHECK_ERROR(err);
-	err = clReleaseMemObject(bufOutputs);
+	err = clSetKernelArg(lane->pool_image, i++, sizeof(cl_mem), &outputs);
 	CHECK_ERROR(err);
 
+	const size_t global_work_size[] = { (size_t)N, (size_t)N, (size_t)(D + 3) / 4 * imageCnt };
+	enqueue_image_kernel(lane, lane->pool_image, global_work_size, EVENT_POOL, layer, 0, imageCnt);
+}
+
+/*
+ * Returns the kernel time of the batch in seconds.
+ */
+double clWaitBatch(lane_t *lane)
+{
+	cl_int err = clFinish(lane->queue);
+	CHECK_ERROR(err);
+
+	// the whole batch has completed, collect profiling info now
+	double kernel_sec = 0;
+	std::lock_guard<std::mutex> guard(profile_lock);
+	for (int e = 0; e < lane->num_pending; e++) {
+		pending_event_t *pending = &lane->pending[e];
+		long long nsec = event_nsec(pending->event);
+		if (pending->kind == EVENT_CONV || pending->kind == EVENT_POOL || pending->kind == EVENT_HEAD) {
+			kernel_sec += nsec / 1000000000.0;
+			metrics_layer(pending->layer, nsec);
+			roofline_layer(pending->layer, pending->images, nsec);
+		}
 #ifdef PROFILE_ENABLE
-	t1 = high_resolution_clock::now();
+		switch (pending->kind) {
+		case EVENT_WRITE: write_nsec += nsec; break;
+		case EVENT_READ:  read_nsec += nsec; break;
+		case EVENT_POOL:  pooling_sec += nsec / 1000000000.0; break;
+		case EVENT_HEAD:  fc_sec += nsec / 1000000000.0; break;
+		case EVENT_CONV:
+			kernel_nsec += nsec;
+			conv_sec += nsec / 1000000000.0;
+			conv_block_sec[pending->block] += nsec / 1000000000.0;
+			break;
+		}
+#endif
+		clReleaseEvent(pending->event);
+	}
+	lane->num_pending = 0;
+	return kernel_sec;
+}
 
-	cl_ulong start_nsec, end_nsec;
-	clGetEventProfilingInfo(write_event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start_nsec, NULL);
-	clGetEventProfilingInfo(write_event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end_nsec, NULL);
-	write_nsec += end_nsec - start_nsec;
+/*
+ * Roofline calibration (ROOFLINE): peak FLOP/s, memory bandwidth in bytes/s
+ * and launch latency in seconds of dev.
+ * FLOP/s and bandwidth are the best of ROOFLINE_RUNS runs of roofline_fma
+ * and roofline_copy after a warm-up run, from their event times. The launch
+ * latency is the host time of ROOFLINE_LAUNCHES one-item kernels back to
+ * back, divided by their number.
+ */
+#define ROOFLINE_RUNS 5
+#define ROOFLINE_LAUNCHES 200
+#define ROOFLINE_FMA_ITEMS (1 << 20)
+#define ROOFLINE_FMA_ITERS 256
+#define ROOFLINE_COPY_BYTES (64 << 20)
 
-	clGetEventProfilingInfo(kernel_event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start_nsec, NULL);
-	clGetEventProfilingInfo(kernel_event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end_nsec, NULL);
-	kernel_nsec += end_nsec - start_nsec;
+static double time_kernel(cl_command_queue queue, cl_kernel kernel, size_t global_work_size)
+{
+	cl_event event;
+	cl_int err = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &global_work_size, NULL, 0, NULL, &event);
+	CHECK_ERROR(err);
+	err = clWaitForEvents(1, &event);
+	CHECK_ERROR(err);
+	const double sec = event_nsec(event) / 1000000000.0;
+	clReleaseEvent(event);
+	return sec;
+}
 
-	clGetEventProfilingInfo(read_event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start_nsec, NULL);
-	clGetEventProfilingInfo(read_event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end_nsec, NULL);
-	read_nsec += end_nsec - start_nsec;
+void clCalibrate(device_t *dev, double *flops, double *bytes, double *launch)
+{
+	cl_int err;
+	cl_kernel fma = getKernel(dev->program, "roofline_fma");
+	cl_kernel copy = getKernel(dev->program, "roofline_copy");
 
-	t2 = high_resolution_clock::now();
-	time_span = duration_cast<duration<double>>(t2 - t1);
-	profile_sec += time_span.count();
+	size_t copy_bytes = ROOFLINE_COPY_BYTES;
+	if (copy_bytes > dev->max_mem_alloc_size / 2)
+		copy_bytes = (size_t)dev->max_mem_alloc_size / 2;
+	copy_bytes = copy_bytes / (4 * sizeof(float) * 256) * (4 * sizeof(float) * 256);
+	const size_t fma_bytes = sizeof(float) * ROOFLINE_FMA_ITEMS;
+	cl_mem in = create_buffer(dev, CL_MEM_READ_WRITE, copy_bytes);
+	cl_mem out = create_buffer(dev, CL_MEM_READ_WRITE, copy_bytes > fma_bytes ? copy_bytes : fma_bytes);
+
+	const float s = 0.999f;
+	const int iters = ROOFLINE_FMA_ITERS;
+	err = clSetKernelArg(fma, 0, sizeof(cl_mem), &out);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(fma, 1, sizeof(cl_float), &s);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(fma, 2, sizeof(cl_int), &iters);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(copy, 0, sizeof(cl_mem), &in);
+	CHECK_ERROR(err);
+	err = clSetKernelArg(copy, 1, sizeof(cl_mem), &out);
+	CHECK_ERROR(err);
+
+	*flops = *bytes = 0;
+	for (int r = 0; r <= ROOFLINE_RUNS; r++) {
+		const double fma_sec = time_kernel(dev->queue, fma, ROOFLINE_FMA_ITEMS);
+		const double copy_sec = time_kernel(dev->queue, copy, copy_bytes / (4 * sizeof(float)));
+		if (r == 0)
+			continue;
+		// 4 float4 mads, 32 flops, per iteration
+		if (fma_sec > 0 && 32.0 * iters * ROOFLINE_FMA_ITEMS / fma_sec > *flops)
+			*flops = 32.0 * iters * ROOFLINE_FMA_ITEMS / fma_sec;
+		if (copy_sec > 0 && 2.0 * copy_bytes / copy_sec > *bytes)
+			*bytes = 2.0 * copy_bytes / copy_sec;
+	}
+
+	const size_t one = 1;
+	high_resolution_clock::time_point t1 = high_resolution_clock::now();
+	for (int k = 0; k < ROOFLINE_LAUNCHES; k++) {
+		err = clEnqueueNDRangeKernel(dev->queue, copy, 1, NULL, &one, NULL, 0, NULL, NULL);
+		CHECK_ERROR(err);
+	}
+	err = clFinish(dev->queue);
+	CHECK_ERROR(err);
+	*launch = duration_cast<duration<double>>(high_resolution_clock::now() - t1).count() / ROOFLINE_LAUNCHES;
+
+	release_buffer(in);
+	release_buffer(out);
+	clReleaseKernel(fma);
+	clReleaseKernel(copy);
+}
+
+/*
+ * Model parallelism (MODEL_PARALLEL).
+ * devices[s] holds output channels [shard_begin(layer, s), shard_begin(layer, s + 1))
+ * of a sharded conv layer. The whole input goes to every device, each one
+ * computes its slice and the slices are gathered on the host.
+ */
+static cl_mem shard_in[MAX_DEVICES], shard_out[MAX_DEVICES];
+static float *shard_host[MAX_DEVICES];
+
+void alloc_shard_buffers(size_t in_size, size_t out_size)
+{
+	for (int s = 0; s < num_devices; s++) {
+		shard_in[s] = create_buffer(&devices[s], CL_MEM_READ_ONLY, sizeof(float) * in_size);
+		shard_out[s] = create_buffer(&devices[s], CL_MEM_WRITE_ONLY, sizeof(float) * out_size);
+		shard_host[s] = alloc_layer(out_size);
+	}
+}
+
+void free_shard_buffers()
+{
+	for (int s = 0; s < num_devices; s++) {
+		release_buffer(shard_in[s]);
+		release_buffer(shard_out[s]);
+		free(shard_host[s]);
+	}
+}
+
+void clConvShards(float *inputs, float *outputs, layer_t *layer, int imageCnt)
+{
+	cl_int err;
+	const int N = layer->N;
+	const size_t inputs_size = sizeof(float) * layer_in_storage(layer) * imageCnt;
+	cl_event write_event[MAX_DEVICES], kernel_event[MAX_DEVICES], read_event[MAX_DEVICES];
+
+	// enqueue every shard before waiting for any, so the devices run concurrently
+	for (int s = 0; s < layer->num_shards; s++) {
+		device_t *dev = &devices[s];
+		const int D2s = shard_begin(layer, s + 1) - shard_begin(layer, s);
+		if (D2s == 0)
+			continue;
+		err = clEnqueueWriteBuffer(dev->queue, shard_in[s], CL_FALSE, 0, inputs_size, inputs, 0, NULL, &write_event[s]);
+		CHECK_ERROR(err);
+		kernel_event[s] = enqueue_conv(dev->queue, dev->conv, dev->conv_sparse, dev->halo, shard_in[s], shard_out[s], layer->w[s], layer->b[s], NULL,
+			D2s, layer->D1, N, imageCnt, write_event[s]);
+		err = clEnqueueReadBuffer(dev->queue, shard_out[s], CL_FALSE, 0, sizeof(float) * D2s * PLANE_SIZE(N) * imageCnt, shard_host[s],
+			1, &kernel_event[s], &read_event[s]);
+		CHECK_ERROR(err);
+		err = clFlush(dev->queue);
+		CHECK_ERROR(err);
+	}
+
+	const size_t out_image = layer_out_storage(layer);
+	for (int s = 0; s < layer->num_shards; s++) {
+		const int o0 = shard_begin(layer, s);
+		const int D2s = shard_begin(layer, s + 1) - o0;
+		if (D2s == 0)
+			continue;
+		err = clWaitForEvents(1, &read_event[s]);
+		CHECK_ERROR(err);
+		// a slice of whole channels (channel blocks with LAYOUT_NCHWC) is contiguous per image
+		for (int batch = 0; batch < imageCnt; batch++)
+			memcpy(outputs + out_image * batch + (size_t)o0 * PLANE_SIZE(N), shard_host[s] + (size_t)D2s * PLANE_SIZE(N) * batch,
+				sizeof(float) * D2s * PLANE_SIZE(N));
+#ifdef PROFILE_ENABLE
+		write_nsec += event_nsec(write_event[s]);
+		kernel_nsec += event_nsec(kernel_event[s]);
+		read_nsec += event_nsec(read_event[s]);
 #endif
+		clReleaseEvent(write_event[s]);
+		clReleaseEvent(kernel_event[s]);
+		clReleaseEvent(read_event[s]);
+	}
 }
 
-void initOpenCL(int platform_idx, int gpu_idx)
+/*
+ * Open a device in its own context, build kernel.cl for it and return its index in devices[].
+ */
+int addDevice(int platform_idx, int device_idx, cl_device_type type)
 {
 	cl_int err = 0;
-	char str[STR_LEN] = { 0 };
+	if (num_devices == MAX_DEVICES) {
+		fprintf(stderr, "too many devices\n");
+		exit(EXIT_FAILURE);
+	}
+	device_t *dev = &devices[num_devices];
+	dev->index = num_devices;
+	dev->id = getDevice(platform_idx, device_idx, type);
 
-	cl_device_id device = getDevice(platform_idx, gpu_idx);
+	err = clGetDeviceInfo(dev->id, CL_DEVICE_TYPE, sizeof(cl_device_type), &dev->type, NULL);
+	CHECK_ERROR(err);
+	err = clGetDeviceInfo(dev->id, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(cl_bool), &dev->host_unified_memory, NULL);
+	CHECK_ERROR(err);
+	printf("device %d zero-copy host buffers : %s\n", dev->index, dev->host_unified_memory ? "on" : "off");
+	err = clGetDeviceInfo(dev->id, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &dev->local_mem_size, NULL);
+	CHECK_ERROR(err);
+	err = clGetDeviceInfo(dev->id, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &dev->max_work_group_size, NULL);
+	CHECK_ERROR(err);
+	err = clGetDeviceInfo(dev->id, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(cl_ulong), &dev->global_mem_size, NULL);
+	CHECK_ERROR(err);
+	err = clGetDeviceInfo(dev->id, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &dev->max_mem_alloc_size, NULL);
+	CHECK_ERROR(err);
+	err = clGetDeviceInfo(dev->id, CL_DEVICE_IMAGE_SUPPORT, sizeof(cl_bool), &dev->image_support, NULL);
+	CHECK_ERROR(err);
+	dev->image_max_array_size = 0;
+	if (dev->image_support) {
+		err = clGetDeviceInfo(dev->id, CL_DEVICE_IMAGE_MAX_ARRAY_SIZE, sizeof(size_t), &dev->image_max_array_size, NULL);
+		CHECK_ERROR(err);
+	}
+	dev->mem_used = 0;
 
-	context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
+	dev->context = clCreateContext(NULL, 1, &dev->id, NULL, NULL, &err);
 	CHECK_ERROR(err);
 
 	// 2.0
 	//cl_queue_properties props[] = { CL_QUEUE_PROPERTIES, CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE | CL_QUEUE_ON_DEVICE | CL_QUEUE_ON_DEVICE_DEFAULT, 0 };
 	//queue = clCreateCommandQueueWithProperties(context, devices[gpu_idx], NULL, &err);
-	cl_command_queue data_queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err);
-	CHECK_ERROR(err);
-	kernel_queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err);
+	dev->queue = clCreateCommandQueue(dev->context, dev->id, CL_QUEUE_PROFILING_ENABLE, &err);
 	CHECK_ERROR(err);
 
-	convKernel = getKernel(context, device, "kernel.cl", "conv");
-}
\ No newline at end of file
+	dev->program = getProgram(dev->context, dev->id, "kernel.cl");
+#ifdef LAYOUT_NCHWC
+	dev->conv = getKernel(dev->program, "conv_nchwc");
+	dev->conv_sparse = getKernel(dev->program, "conv_nchwc_sparse");
+#else
+	dev->conv = getKernel(dev->program, "conv");
+	dev->conv_sparse = getKernel(dev->program, "conv_sparse");
+#endif
+#ifdef ZERO_HALO
+	dev->halo = getKernel(dev->program, "halo");
+#endif
+	return num_devices++;
+}
+
+void initOpenCL(int platform_idx, int gpu_idx)
+{
+	addDevice(platform_idx, gpu_idx, CL_DEVICE_TYPE_GPU);
+}
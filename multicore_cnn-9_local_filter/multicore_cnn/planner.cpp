@@ -0,0 +1,99 @@
+#include "cnn.h"
+
+/*
+ * Activation memory planner.
+ * Tensor 0 is the input batch and tensor l + 1 is the output of layer l.
+ * A tensor is live from the layer that produces it to the last layer that
+ * reads it (the final tensor is read by the classifier after the last layer).
+ * Tensors whose lifetimes do not overlap share an arena, so a plain layer
+ * chain ends up with two ping-pong arenas.
+ */
+memory_plan_t* plan_memory(network_t *net)
+{
+	memory_plan_t *plan = (memory_plan_t*)calloc(1, sizeof(memory_plan_t));
+	const int T = net->num_layers + 1;
+	plan->num_tensors = T;
+	plan->arena_of = (int*)malloc(sizeof(int) * T);
+	plan->arena_size = (size_t*)calloc(T, sizeof(size_t));
+
+	int *first_use = (int*)malloc(sizeof(int) * T);
+	int *last_use = (int*)malloc(sizeof(int) * T);
+	size_t *size = (size_t*)malloc(sizeof(size_t) * T);
+	int *inside = (int*)calloc(T, sizeof(int));
+	for (int k = 0; k < T; k++) {
+		first_use[k] = k - 1;
+		last_use[k] = k;
+		size[k] = (k == 0) ? layer_in_storage(&net->layers[0]) : layer_out_storage(&net->layers[k - 1]);
+		plan->naive_size += size[k];
+	}
+	// a fused block (FUSED_BLOCKS) writes its output while it reads its input,
+	// the tensors inside it are never stored
+	for (int l = 0; l < net->num_layers; l++) {
+		const int last = net->layers[l].fused_last;
+		if (last < 0)
+			continue;
+		for (int k = l + 1; k <= last; k++)
+			inside[k] = 1;
+		first_use[last + 1] = l;
+	}
+
+	// last_use of the tensor currently held by each arena
+	int *arena_busy_until = (int*)malloc(sizeof(int) * T);
+
+	for (int k = 0; k < T; k++) {
+		if (inside[k]) {
+			plan->arena_of[k] = plan->arena_of[k - 1];
+			continue;
+		}
+		int best = -1;
+		for (int a = 0; a < plan->num_arenas; a++) {
+			if (arena_busy_until[a] >= first_use[k])
+				continue;
+			if (best < 0) {
+				best = a;
+				continue;
+			}
+			// best fit: the smallest arena that is large enough,
+			// otherwise the largest one so that it grows the least
+			int fits = plan->arena_size[a] >= size[k];
+			int best_fits = plan->arena_size[best] >= size[k];
+			if ((fits && (!best_fits || plan->arena_size[a] < plan->arena_size[best])) ||
+				(!fits && !best_fits && plan->arena_size[a] > plan->arena_size[best]))
+				best = a;
+		}
+		if (best < 0)
+			best = plan->num_arenas++;
+
+		plan->arena_of[k] = best;
+		if (plan->arena_size[best] < size[k])
+			plan->arena_size[best] = size[k];
+		arena_busy_until[best] = last_use[k];
+	}
+
+	for (int a = 0; a < plan->num_arenas; a++)
+		plan->peak_size += plan->arena_size[a];
+
+	free(inside);
+	free(first_use);
+	free(last_use);
+	free(size);
+	free(arena_busy_until);
+	return plan;
+}
+
+void print_memory_plan(memory_plan_t *plan, int batch_size)
+{
+	const double MB = 1024.0 * 1024.0;
+	printf("memory plan : %d tensors in %d arenas, peak %.2lf MB (unplanned %.2lf MB) per batch of %d, host and device each\n",
+		plan->num_tensors, plan->num_arenas,
+		plan->peak_size * sizeof(float) * batch_size / MB,
+		plan->naive_size * sizeof(float) * batch_size / MB,
+		batch_size);
+}
+
+void free_memory_plan(memory_plan_t *plan)
+{
+	free(plan->arena_of);
+	free(plan->arena_size);
+	free(plan);
+}
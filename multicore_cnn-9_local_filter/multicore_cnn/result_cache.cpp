@@ -0,0 +1,188 @@
+#pragma warning(disable:4996)
+#include "cnn.h"
+
+/*
+ * Result cache (RESULT_CACHE).
+ * Label, confidence and exit head of every image classified so far, keyed
+ * by a hash of its pixels and of the model: net->model_key (the network
+ * description and the contents of network.bin, see load_network), and the
+ * exit heads and exit_threshold when early exit is on, so a changed model
+ * never hits old results, even retrained weights of the same size and time. The table is open addressing with linear probing, key 0
+ * marks an empty slot.
+ * It is loaded from result_cache_file by result_cache_open and written back
+ * by result_cache_close; a file made with another model is ignored. With no
+ * file (MULTI_PROCESS workers, which would overwrite each other's) the table
+ * only lives for one cnn() call.
+ *
+ * File layout: result_header_t, then count result_t.
+ */
+#define RESULT_MAGIC "CNNRES"
+#define RESULT_VERSION 1
+#define RESULT_MIN_CAPACITY 1024
+
+typedef struct {
+	unsigned long long key;
+	int label;
+	float confidence;
+	int exit;           // exit head, -1 for the full network
+	int pad;
+} result_t;
+
+typedef struct {
+	char magic[8];
+	unsigned int version;
+	unsigned int pad;
+	unsigned long long model_key;
+	unsigned long long count;
+	unsigned long long lookups, hits;   // over all runs
+} result_header_t;
+
+extern float exit_threshold;
+
+const char *result_cache_file = RESULT_CACHE_FILE;
+
+static result_t *table;
+static size_t capacity, count;
+static unsigned long long model_key;
+static unsigned long long lookups, hits;            // over all runs
+static unsigned long long run_lookups, run_hits;
+
+static result_t* slot_of(unsigned long long key)
+{
+	size_t i = (size_t)(key ^ (key >> 32)) & (capacity - 1);
+	while (table[i].key && table[i].key != key)
+		i = (i + 1) & (capacity - 1);
+	return &table[i];
+}
+
+static void grow(size_t new_capacity)
+{
+	result_t *old = table;
+	size_t old_capacity = capacity;
+	table = (result_t*)calloc(new_capacity, sizeof(result_t));
+	capacity = new_capacity;
+	for (size_t i = 0; i < old_capacity; i++)
+		if (old[i].key)
+			*slot_of(old[i].key) = old[i];
+	free(old);
+}
+
+void result_cache_open(network_t *net)
+{
+	model_key = net->model_key;
+#ifdef EARLY_EXIT
+	if (net->num_exits > 0 && exit_threshold > 0) {
+		for (int k = 0; k < net->num_exits; k++) {
+			exit_t *head = &net->exits[k];
+			int desc[4] = { head->after, head->D, head->N, head->M };
+			model_key = hash_bytes(model_key, desc, sizeof(desc));
+		}
+		model_key = hash_bytes(model_key, &exit_threshold, sizeof(exit_threshold));
+		for (int k = 0; k < net->num_exits; k++) {
+			exit_t *head = &net->exits[k];
+			model_key = hash_bytes(model_key, head->weights, sizeof(float) * head->M * head->D);
+			model_key = hash_bytes(model_key, head->biases, sizeof(float) * head->M);
+		}
+	}
+#endif
+	count = 0;
+	lookups = hits = run_lookups = run_hits = 0;
+	capacity = RESULT_MIN_CAPACITY;
+	table = (result_t*)calloc(capacity, sizeof(result_t));
+
+	FILE *f = result_cache_file ? fopen(result_cache_file, "rb") : NULL;
+	if (!f)
+		return;
+	result_header_t header;
+	if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, RESULT_MAGIC, sizeof(RESULT_MAGIC)) != 0 ||
+		header.version != RESULT_VERSION || header.model_key != model_key) {
+		printf("result cache : %s is for another model, starting empty\n", result_cache_file);
+		fclose(f);
+		return;
+	}
+	while (capacity < 2 * header.count)
+		capacity *= 2;
+	free(table);
+	table = (result_t*)calloc(capacity, sizeof(result_t));
+	result_t entry;
+	for (unsigned long long i = 0; i < header.count && fread(&entry, sizeof(entry), 1, f) == 1; i++) {
+		if (!entry.key)
+			continue;
+		result_t *slot = slot_of(entry.key);
+		count += slot->key == 0;
+		*slot = entry;
+	}
+	fclose(f);
+	lookups = header.lookups;
+	hits = header.hits;
+	printf("result cache : %d results from %s\n", (int)count, result_cache_file);
+}
+
+/*
+ * Key of the n floats of image, returned in *key; if it was classified
+ * before, its results are stored and 1 is returned.
+ */
+int result_cache_find(const float *image, size_t n, unsigned long long *key, int *label, float *confidence, int *exit)
+{
+	*key = hash_words(model_key, image, sizeof(float) * n);
+	if (!*key)
+		*key = 1;
+	run_lookups++;
+	result_t *slot = slot_of(*key);
+	if (!slot->key)
+		return 0;
+	run_hits++;
+	*label = slot->label;
+	*confidence = slot->confidence;
+	*exit = slot->exit;
+	return 1;
+}
+
+void result_cache_insert(unsigned long long key, int label, float confidence, int exit)
+{
+	if (2 * (count + 1) > capacity)
+		grow(2 * capacity);
+	result_t *slot = slot_of(key);
+	count += slot->key == 0;
+	slot->key = key;
+	slot->label = label;
+	slot->confidence = confidence;
+	slot->exit = exit;
+}
+
+/*
+ * Print the hit rates and write the table back, if there is a file.
+ */
+void result_cache_close()
+{
+	lookups += run_lookups;
+	hits += run_hits;
+	printf("result cache : %llu of %llu images hit (%.1lf%%), %.1lf%% over all runs, %d results\n",
+		run_hits, run_lookups, run_lookups ? 100.0 * run_hits / run_lookups : 0.0,
+		lookups ? 100.0 * hits / lookups : 0.0, (int)count);
+
+	if (result_cache_file) {
+		result_header_t header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, RESULT_MAGIC, sizeof(RESULT_MAGIC));
+		header.version = RESULT_VERSION;
+		header.model_key = model_key;
+		header.count = count;
+		header.lookups = lookups;
+		header.hits = hits;
+		FILE *f = fopen(result_cache_file, "wb");
+		int ok = f != NULL && fwrite(&header, sizeof(header), 1, f) == 1;
+		for (size_t i = 0; ok && i < capacity; i++)
+			if (table[i].key)
+				ok = fwrite(&table[i], sizeof(result_t), 1, f) == 1;
+		if (f && fclose(f) != 0)
+			ok = 0;
+		if (!ok) {
+			fprintf(stderr, "%s: could not write the result cache\n", result_cache_file);
+			remove(result_cache_file);
+		}
+	}
+	free(table);
+	table = NULL;
+	capacity = count = 0;
+}
@@ -0,0 +1,150 @@
+#pragma warning(disable:4996)
+#include "cnn.h"
+#include <algorithm>
+
+/*
+ * Roofline analysis (ROOFLINE).
+ * clWaitBatch hands over the event time of every kernel with its layer and
+ * image count. At the end, the FLOPs and bytes of each layer are derived
+ * from its shape: the useful multiply-adds (nonzero filter blocks of sparse
+ * layers), and the input and output activations of every image plus the
+ * weights once per launch. A fused block and the classifier head count as
+ * one kernel from their first layer to their last.
+ * The bound of a layer is min(peak FLOP/s, bandwidth * FLOPs per byte).
+ */
+typedef struct {
+	long long nsec;
+	long long launches;
+	long long images;
+} layer_time_t;
+
+#ifdef ROOFLINE
+static const char *LAYER_TYPE_NAME[] = { "conv", "pool", "fc", "softmax" };
+enum { BOUND_COMPUTE, BOUND_MEMORY, BOUND_LAUNCH, NUM_BOUNDS };
+static const char *BOUND_NAME[NUM_BOUNDS] = { "compute", "memory", "launch" };
+
+// only written under the profiling lock of clWaitBatch
+static layer_time_t *layer_time;
+static network_t *roofline_net;
+static double peak_flops, peak_bytes, launch_sec;
+
+/*
+ * FLOPs and activation bytes per image and weight bytes per launch of the
+ * kernel starting at layer l; returns its last layer.
+ */
+static int layer_work(network_t *net, int l, double *flops, double *act_bytes, double *weight_bytes)
+{
+	int last = l;
+	if (net->layers[l].fused_last >= 0)
+		last = net->layers[l].fused_last;
+	else if (net->layers[l].type == LAYER_FC)
+		last = net->num_layers - 1;     // the classifier head
+
+	*flops = *weight_bytes = 0;
+	for (int k = l; k <= last; k++) {
+		layer_t *layer = &net->layers[k];
+		const double pixels = (double)layer->N * layer->N;
+		switch (layer->type) {
+		case LAYER_CONV:
+			if (layer->sparse_blocks) {
+				const int rows = CHANNEL_PAD(layer->D2) / FILTER_BLOCK;
+				*flops += 2.0 * 3 * 3 * FILTER_BLOCK * FILTER_BLOCK * layer->sparse_blocks * pixels;
+				*weight_bytes += sizeof(float) * 3 * 3 * FILTER_BLOCK * FILTER_BLOCK * layer->sparse_blocks +
+					sizeof(int) * (rows + 1 + layer->sparse_blocks);
+			}
+			else {
+				*flops += 2.0 * 3 * 3 * layer->D1 * layer->D2 * pixels;
+				*weight_bytes += sizeof(float) * 3 * 3 * CHANNEL_PAD(layer->D1) * CHANNEL_PAD(layer->D2);
+			}
+			*weight_bytes += sizeof(float) * CHANNEL_PAD(layer->D2);
+			break;
+		case LAYER_POOL:
+			*flops += 3.0 * layer->D1 * pixels;     // max of 4
+			break;
+		case LAYER_FC:
+			*flops += 2.0 * layer->D1 * layer->D2;
+			*weight_bytes += sizeof(float) * ((double)layer->D1 * layer->D2 + layer->D2);
+			break;
+		case LAYER_SOFTMAX:
+			*flops += 3.0 * layer->D1;
+			break;
+		}
+	}
+	*act_bytes = sizeof(float) * ((double)layer_in_storage(&net->layers[l]) + layer_out_storage(&net->layers[last]));
+	return last;
+}
+#endif
+
+void roofline_start(network_t *net, device_t *dev)
+{
+#ifdef ROOFLINE
+	roofline_net = net;
+	layer_time = (layer_time_t*)calloc(net->num_layers, sizeof(layer_time_t));
+	clCalibrate(dev, &peak_flops, &peak_bytes, &launch_sec);
+	printf("roofline : device %d, %.1lf GFLOP/s, %.1lf GB/s, ridge %.2lf flop/byte, launch %.1lf us\n",
+		dev->index, peak_flops / 1e9, peak_bytes / 1e9, peak_bytes > 0 ? peak_flops / peak_bytes : 0, launch_sec * 1e6);
+#endif
+}
+
+/*
+ * Print the analysis of the layers run since roofline_start.
+ */
+void roofline_stop()
+{
+#ifdef ROOFLINE
+	network_t *net = roofline_net;
+	double bound_nsec[NUM_BOUNDS] = { 0 }, total_nsec = 0;
+	printf("roofline :\n");
+	printf("  layers   type     launches      GFLOP         GB    time ms    GFLOP/s  flop/byte  of roof  bound\n");
+	for (int l = 0; l < net->num_layers; l++) {
+		layer_time_t *t = &layer_time[l];
+		if (t->launches == 0)
+			continue;
+		double flops, act_bytes, weight_bytes;
+		const int last = layer_work(net, l, &flops, &act_bytes, &weight_bytes);
+		flops *= t->images;
+		const double bytes = act_bytes * t->images + weight_bytes * t->launches;
+		const double sec = t->nsec / 1e9;
+		const double intensity = bytes > 0 ? flops / bytes : 0;
+		const double roof = std::min(peak_flops, intensity * peak_bytes);
+		const double achieved = sec > 0 ? flops / sec : 0;
+
+		int bound;
+		if (sec / t->launches < ROOFLINE_LAUNCH_FACTOR * launch_sec)
+			bound = BOUND_LAUNCH;
+		else if (intensity * peak_bytes < peak_flops)
+			bound = BOUND_MEMORY;
+		else
+			bound = BOUND_COMPUTE;
+		bound_nsec[bound] += t->nsec;
+		total_nsec += t->nsec;
+
+		char layers[32];
+		if (last > l)
+			sprintf(layers, "%d - %d", l, last);
+		else
+			sprintf(layers, "%d", l);
+		const char *type = net->layers[l].fused_last >= 0 ? "block" : net->layers[l].type == LAYER_FC ? "head" : LAYER_TYPE_NAME[net->layers[l].type];
+		printf("  %-8s %-7s %9lld %10.3lf %10.3lf %10.2lf %10.1lf %10.2lf %7.1lf%%  %s\n",
+			layers, type, t->launches, flops / 1e9, bytes / 1e9, sec * 1e3, achieved / 1e9, intensity,
+			roof > 0 ? 100 * achieved / roof : 0, BOUND_NAME[bound]);
+	}
+	if (total_nsec > 0)
+		printf("  kernel time : %.1lf%% compute-bound, %.1lf%% memory-bound, %.1lf%% launch-bound\n",
+			100 * bound_nsec[BOUND_COMPUTE] / total_nsec, 100 * bound_nsec[BOUND_MEMORY] / total_nsec,
+			100 * bound_nsec[BOUND_LAUNCH] / total_nsec);
+	free(layer_time);
+	layer_time = NULL;
+#endif
+}
+
+void roofline_layer(int layer, int images, long long nsec)
+{
+#ifdef ROOFLINE
+	if (!layer_time)
+		return;
+	layer_time[layer].nsec += nsec;
+	layer_time[layer].launches++;
+	layer_time[layer].images += images;
+#endif
+}
@@ -0,0 +1,490 @@
+#include "cnn.h"
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#ifdef HETERO_SCHEDULE
+
+extern device_t devices[];
+extern int num_devices;
+extern int host_threads;
+extern double before_kernel_sec, profile_sec, pooling_sec, conv_sec, conv_block_sec[];
+extern long long write_nsec, kernel_nsec, read_nsec;
+
+/*
+ * Layer-wise heterogeneous scheduling.
+ * The leading conv/pool layers are split into contiguous stages, each on one
+ * target: the accelerator (devices[0]), the CPU OpenCL device (devices[1]) or
+ * native host threads. The fc/softmax tail always runs on the host, in the
+ * last stage. Every stage runs in its own thread and batches flow from stage
+ * to stage, so all targets work on different batches at the same time.
+ */
+#define HOST_SLOT num_devices    // column of TARGET_HOST in cost tables
+#define MAILBOX_SIZE 2           // batches waiting between two stages
+#define PROBE_HOST_IMAGES 4      // host timings are scaled up from this many images
+
+typedef struct {
+	int first, last;    // layers [first, last)
+	int target;
+	double cost;        // estimated seconds per batch
+	lane_t *lane;       // device stages
+	arena_t *arenas;    // full set of arenas on the stage's target
+} stage_t;
+
+typedef struct {
+	int first_image;
+	int imageCnt;       // 0 ends the run
+	float *data;        // output of the previous stage
+	long long start_nsec;   // metrics_now() when the first stage loaded it
+} batch_t;
+
+typedef struct {
+	std::mutex lock;
+	std::condition_variable cond;
+	batch_t items[MAILBOX_SIZE];
+	int head, count;
+} mailbox_t;
+
+typedef struct {
+	int num_stages;
+	stage_t *stages;
+	double bottleneck;  // seconds per batch of the slowest stage
+	double total;       // seconds per batch summed over stages
+} schedule_t;
+
+typedef struct {
+	double (*cost)[MAX_DEVICES + 1];    // seconds per batch of each conv/pool layer on each target
+	double tail;                        // fc/softmax layers on the host
+	double transfer[MAX_DEVICES];       // seconds per float moved to or from a device
+} cost_model_t;
+
+static const char* target_name(int target)
+{
+	switch (target) {
+	case TARGET_ACCEL: return "accelerator";
+	case TARGET_CPU:   return "cpu device";
+	case TARGET_HOST:  return "host";
+	}
+	return "?";
+}
+
+static void mailbox_push(mailbox_t *box, batch_t batch)
+{
+	std::unique_lock<std::mutex> guard(box->lock);
+	box->cond.wait(guard, [box] { return box->count < MAILBOX_SIZE; });
+	box->items[(box->head + box->count) % MAILBOX_SIZE] = batch;
+	box->count++;
+	box->cond.notify_all();
+}
+
+static batch_t mailbox_pop(mailbox_t *box)
+{
+	std::unique_lock<std::mutex> guard(box->lock);
+	box->cond.wait(guard, [box] { return box->count > 0; });
+	batch_t batch = box->items[box->head];
+	box->head = (box->head + 1) % MAILBOX_SIZE;
+	box->count--;
+	box->cond.notify_all();
+	return batch;
+}
+
+static void alloc_stage(run_t *run, stage_t *stage)
+{
+	memory_plan_t *plan = run->plan;
+	stage->arenas = (arena_t*)calloc(plan->num_arenas, sizeof(arena_t));
+	if (stage->target >= 0)
+		stage->lane = create_lanes(&devices[stage->target], 1);
+	for (int a = 0; a < plan->num_arenas; a++) {
+		arena_t *arena = &stage->arenas[a];
+		if (stage->target >= 0) {
+			alloc_arena(&devices[stage->target], arena, plan->arena_size[a] * run->batch_size);
+		}
+		else {
+			arena->size = plan->arena_size[a] * run->batch_size;
+			arena->host = (float*)calloc(arena->size, sizeof(float));
+		}
+	}
+}
+
+static void free_stage(run_t *run, stage_t *stage)
+{
+	for (int a = 0; a < run->plan->num_arenas; a++) {
+		if (stage->target >= 0)
+			free_arena(&stage->arenas[a]);
+		else
+			free(stage->arenas[a].host);
+	}
+	free(stage->arenas);
+	if (stage->lane)
+		free_lanes(stage->lane, 1);
+	stage->arenas = NULL;
+	stage->lane = NULL;
+}
+
+/*
+ * Run layers [first, last) of the stage on the batch in arena_of[first] and
+ * return the arena holding the result.
+ * Returns the kernel time in seconds for device stages.
+ */
+static arena_t* run_stage(run_t *run, stage_t *stage, int first, int last, int imageCnt, double *kernel_sec)
+{
+	network_t *net = run->net;
+	memory_plan_t *plan = run->plan;
+	arena_t *in = &stage->arenas[plan->arena_of[first]];
+
+	if (stage->target >= 0) {
+		lane_t *lane = stage->lane;
+		clBeginBatch(lane, in, sizeof(float) * layer_in_storage(&net->layers[first]) * imageCnt, plan->num_arenas);
+		for (int l = first; l < last; l++) {
+			layer_t *layer = &net->layers[l];
+			arena_t *out = &stage->arenas[plan->arena_of[l + 1]];
+			if (layer->type == LAYER_CONV)
+				clEnqueueConv(lane, in, out, layer->w[stage->target], layer->b[stage->target], layer->blocks[stage->target],
+					layer->D2, layer->D1, layer->N, l, layer->block, imageCnt);
+			else
+				clEnqueuePool(lane, in, out, layer->D1, layer->N, l, imageCnt);
+			in = out;
+		}
+		clEnqueueReadback(lane, in, sizeof(float) * layer_out_storage(&net->layers[last - 1]) * imageCnt, plan->num_arenas);
+		double sec = clWaitBatch(lane);
+		if (kernel_sec)
+			*kernel_sec = sec;
+	}
+	else {
+		for (int l = first; l < last; l++) {
+			arena_t *out = &stage->arenas[plan->arena_of[l + 1]];
+			run_layer(&net->layers[l], l ? &net->layers[l - 1] : NULL, in, out, imageCnt);
+			in = out;
+		}
+	}
+	return in;
+}
+
+/*
+ * Time every conv/pool layer on every target with the weights already
+ * uploaded, and the fc/softmax tail on the host.
+ * Device layers run twice on a full batch and the second run is kept;
+ * host layers run on a few images and are scaled to a batch.
+ * Profiling counters are restored afterwards so the probe does not show up
+ * in the totals.
+ */
+static void probe_costs(run_t *run, cost_model_t *model)
+{
+	network_t *net = run->net;
+	const int L = run->num_device_layers;
+	double saved_sec[4 + MAX_BLOCKS];
+	long long saved_nsec[3] = { write_nsec, kernel_nsec, read_nsec };
+	saved_sec[0] = before_kernel_sec;
+	saved_sec[1] = profile_sec;
+	saved_sec[2] = pooling_sec;
+	saved_sec[3] = conv_sec;
+	memcpy(saved_sec + 4, conv_block_sec, sizeof(double) * MAX_BLOCKS);
+
+	model->cost = (double(*)[MAX_DEVICES + 1])calloc(L, sizeof(*model->cost));
+	model->tail = 0;
+	for (int d = 0; d < num_devices; d++) {
+		stage_t stage = { 0 };
+		stage.target = d;
+		alloc_stage(run, &stage);
+		for (int a = 0; a < run->plan->num_arenas; a++)
+			memset(stage.arenas[a].host, 0, sizeof(float) * stage.arenas[a].size);
+
+		double transfer_sec = 0;
+		size_t transfer_floats = 0;
+		for (int l = 0; l < L; l++) {
+			for (int rep = 0; rep < 2; rep++) {
+				high_resolution_clock::time_point t1 = high_resolution_clock::now();
+				double kernel_sec = 0;
+				run_stage(run, &stage, l, l + 1, run->batch_size, &kernel_sec);
+				duration<double> wall = duration_cast<duration<double>>(high_resolution_clock::now() - t1);
+				if (rep == 1) {
+					model->cost[l][d] = kernel_sec;
+					transfer_sec += wall.count() - kernel_sec;
+					transfer_floats += (layer_in_storage(&net->layers[l]) + layer_out_storage(&net->layers[l])) * run->batch_size;
+				}
+			}
+		}
+		model->transfer[d] = transfer_floats ? transfer_sec / transfer_floats : 0;
+		free_stage(run, &stage);
+	}
+
+	stage_t host = { 0 };
+	host.target = TARGET_HOST;
+	alloc_stage(run, &host);
+	const int P = (run->batch_size < PROBE_HOST_IMAGES) ? run->batch_size : PROBE_HOST_IMAGES;
+	const double scale = (double)run->batch_size / P;
+	for (int l = 0; l < L && host_threads > 0; l++) {
+		layer_t *layer = &net->layers[l];
+		int target = layer->target;
+		layer->target = TARGET_HOST;
+		high_resolution_clock::time_point t1 = high_resolution_clock::now();
+		run_stage(run, &host, l, l + 1, P, NULL);
+		duration<double> wall = duration_cast<duration<double>>(high_resolution_clock::now() - t1);
+		model->cost[l][HOST_SLOT] = wall.count() * scale;
+		layer->target = target;
+	}
+	if (L < net->num_layers) {
+		high_resolution_clock::time_point t1 = high_resolution_clock::now();
+		run_stage(run, &host, L, net->num_layers, P, NULL);
+		duration<double> wall = duration_cast<duration<double>>(high_resolution_clock::now() - t1);
+		model->tail = wall.count() * scale;
+	}
+	free_stage(run, &host);
+
+	write_nsec = saved_nsec[0];
+	kernel_nsec = saved_nsec[1];
+	read_nsec = saved_nsec[2];
+	before_kernel_sec = saved_sec[0];
+	profile_sec = saved_sec[1];
+	pooling_sec = saved_sec[2];
+	conv_sec = saved_sec[3];
+	memcpy(conv_block_sec, saved_sec + 4, sizeof(double) * MAX_BLOCKS);
+}
+
+static double stage_cost(run_t *run, cost_model_t *model, stage_t *stage)
+{
+	network_t *net = run->net;
+	const int L = run->num_device_layers;
+	double cost = 0;
+	for (int l = stage->first; l < stage->last && l < L; l++)
+		cost += model->cost[l][stage->target >= 0 ? stage->target : HOST_SLOT];
+	if (stage->last > L)
+		cost += model->tail;
+	if (stage->target >= 0) {
+		size_t floats = layer_in_storage(&net->layers[stage->first]) + layer_out_storage(&net->layers[stage->last - 1]);
+		cost += model->transfer[stage->target] * floats * run->batch_size;
+	}
+	return cost;
+}
+
+/*
+ * Give the fc/softmax tail to the last stage if it runs on the host,
+ * otherwise to a host stage of its own, and fill in the costs.
+ */
+static void finish_schedule(run_t *run, cost_model_t *model, schedule_t *schedule)
+{
+	network_t *net = run->net;
+	if (run->num_device_layers < net->num_layers) {
+		stage_t *last = &schedule->stages[schedule->num_stages - 1];
+		if (last->target == TARGET_HOST) {
+			last->last = net->num_layers;
+		}
+		else {
+			stage_t *tail = &schedule->stages[schedule->num_stages++];
+			memset(tail, 0, sizeof(stage_t));
+			tail->first = run->num_device_layers;
+			tail->last = net->num_layers;
+			tail->target = TARGET_HOST;
+		}
+	}
+
+	schedule->bottleneck = 0;
+	schedule->total = 0;
+	for (int s = 0; s < schedule->num_stages; s++) {
+		stage_t *stage = &schedule->stages[s];
+		stage->cost = model ? stage_cost(run, model, stage) : 0;
+		if (stage->cost > schedule->bottleneck)
+			schedule->bottleneck = stage->cost;
+		schedule->total += stage->cost;
+	}
+}
+
+/*
+ * Try every split of layers [pos, L) into contiguous stages on targets not
+ * used yet, keeping the schedule with the smallest bottleneck stage
+ * (then the smallest total, which is the latency of a batch).
+ */
+static void search_schedule(run_t *run, cost_model_t *model, int *targets, int num_targets, int used,
+	int pos, schedule_t *current, schedule_t *best)
+{
+	const int L = run->num_device_layers;
+	if (pos == L) {
+		schedule_t candidate = *current;
+		stage_t stages[MAX_DEVICES + 2];
+		memcpy(stages, current->stages, sizeof(stage_t) * current->num_stages);
+		candidate.stages = stages;
+		finish_schedule(run, model, &candidate);
+		if (best->num_stages == 0 || candidate.bottleneck < best->bottleneck ||
+			(candidate.bottleneck == best->bottleneck && candidate.total < best->total)) {
+			memcpy(best->stages, stages, sizeof(stage_t) * candidate.num_stages);
+			best->num_stages = candidate.num_stages;
+			best->bottleneck = candidate.bottleneck;
+			best->total = candidate.total;
+		}
+		return;
+	}
+
+	for (int t = 0; t < num_targets; t++) {
+		if (used & (1 << t))
+			continue;
+		stage_t *stage = &current->stages[current->num_stages++];
+		memset(stage, 0, sizeof(stage_t));
+		stage->first = pos;
+		stage->target = targets[t];
+		for (int end = pos + 1; end <= L; end++) {
+			stage->last = end;
+			search_schedule(run, model, targets, num_targets, used | (1 << t), end, current, best);
+		}
+		current->num_stages--;
+	}
+}
+
+/*
+ * Stages from the targets given in network.cfg.
+ * A layer without a target follows the previous one, the first defaults to
+ * the accelerator.
+ */
+static void manual_schedule(run_t *run, schedule_t *schedule)
+{
+	network_t *net = run->net;
+	int target = TARGET_ACCEL;
+	schedule->num_stages = 0;
+	for (int l = 0; l < run->num_device_layers; l++) {
+		layer_t *layer = &net->layers[l];
+		if (layer->target != TARGET_AUTO)
+			target = layer->target;
+		if (target == TARGET_CPU && num_devices <= TARGET_CPU) {
+			printf("layer %d : no cpu device, running it on the accelerator\n", l);
+			target = TARGET_ACCEL;
+		}
+		if (target == TARGET_HOST && host_threads < 1)
+			host_threads = 1;
+
+		stage_t *stage = schedule->num_stages ? &schedule->stages[schedule->num_stages - 1] : NULL;
+		if (!stage || stage->target != target) {
+			stage = &schedule->stages[schedule->num_stages++];
+			memset(stage, 0, sizeof(stage_t));
+			stage->first = l;
+			stage->target = target;
+		}
+		stage->last = l + 1;
+	}
+	finish_schedule(run, NULL, schedule);
+}
+
+/*
+ * Body of the thread running one stage. The first stage reads the images,
+ * the last one classifies them.
+ */
+static void stage_main(run_t *run, schedule_t *schedule, int s, mailbox_t *inbox, mailbox_t *outbox)
+{
+	network_t *net = run->net;
+	stage_t *stage = &schedule->stages[s];
+	arena_t *in = &stage->arenas[run->plan->arena_of[stage->first]];
+	const size_t in_size = layer_in_storage(&net->layers[stage->first]);
+	const size_t out_size = layer_out_storage(&net->layers[stage->last - 1]);
+	int next_image = 0;
+
+	for (;;) {
+		batch_t batch;
+		if (s == 0) {
+			batch.first_image = next_image;
+			batch.imageCnt = run->num_images - next_image;
+			if (batch.imageCnt > run->batch_size)
+				batch.imageCnt = run->batch_size;
+			next_image += batch.imageCnt;
+		}
+		else {
+			batch = mailbox_pop(inbox);
+		}
+		if (batch.imageCnt == 0) {
+			if (outbox)
+				mailbox_push(outbox, batch);
+			break;
+		}
+
+		if (s == 0) {
+			load_batch(run, in->host, batch.first_image, batch.imageCnt);
+			batch.start_nsec = metrics_now();
+			metrics_in_flight(1);
+		}
+		else {
+			memcpy(in->host, batch.data, sizeof(float) * in_size * batch.imageCnt);
+			free(batch.data);
+		}
+
+		const long long stage_nsec = metrics_now();
+		arena_t *out = run_stage(run, stage, stage->first, stage->last, batch.imageCnt, NULL);
+		metrics_stage(stage->target >= 0 ? STAGE_DEVICE : STAGE_HOST, metrics_now() - stage_nsec);
+
+		if (outbox) {
+			batch.data = alloc_layer(out_size * batch.imageCnt);
+			memcpy(batch.data, out->host, sizeof(float) * out_size * batch.imageCnt);
+			mailbox_push(outbox, batch);
+		}
+		else {
+			classify_batch(run, out->host, batch.first_image, batch.imageCnt, NULL);
+			metrics_batch(batch.imageCnt, metrics_now() - batch.start_nsec);
+			metrics_in_flight(-1);
+		}
+	}
+}
+
+void cnn_pipeline(run_t *run)
+{
+	network_t *net = run->net;
+	const int L = run->num_device_layers;
+	schedule_t schedule = { 0 };
+	schedule.stages = (stage_t*)calloc(L + 2, sizeof(stage_t));
+
+	int manual = 0;
+	for (int l = 0; l < L; l++)
+		if (net->layers[l].target != TARGET_AUTO)
+			manual = 1;
+
+	if (manual) {
+		manual_schedule(run, &schedule);
+		printf("schedule from network.cfg, %d stages\n", schedule.num_stages);
+	}
+	else {
+		int targets[MAX_DEVICES + 1];
+		int num_targets = 0;
+		for (int d = 0; d < num_devices; d++)
+			targets[num_targets++] = d;
+		if (host_threads > 0)
+			targets[num_targets++] = TARGET_HOST;
+
+		cost_model_t model;
+		probe_costs(run, &model);
+		schedule_t current = { 0 };
+		stage_t stages[MAX_DEVICES + 2];
+		current.stages = stages;
+		search_schedule(run, &model, targets, num_targets, 0, 0, &current, &schedule);
+		free(model.cost);
+		printf("schedule from measured timings, %d stages, %.2lf ms per batch at the slowest stage\n",
+			schedule.num_stages, schedule.bottleneck * 1000);
+	}
+
+	for (int s = 0; s < schedule.num_stages; s++) {
+		stage_t *stage = &schedule.stages[s];
+		for (int l = stage->first; l < stage->last && l < L; l++)
+			net->layers[l].target = stage->target;
+		if (schedule.bottleneck > 0)
+			printf("  stage %d : layers %2d - %2d on %-11s %8.2lf ms per batch\n",
+				s, stage->first, stage->last - 1, target_name(stage->target), stage->cost * 1000);
+		else
+			printf("  stage %d : layers %2d - %2d on %s\n",
+				s, stage->first, stage->last - 1, target_name(stage->target));
+		alloc_stage(run, stage);
+	}
+
+	// one thread per stage, connected by bounded mailboxes
+	metrics_start(net);
+	mailbox_t *boxes = new mailbox_t[schedule.num_stages];
+	std::thread *threads = new std::thread[schedule.num_stages];
+	for (int s = 0; s < schedule.num_stages; s++) {
+		boxes[s].head = boxes[s].count = 0;
+		threads[s] = std::thread(stage_main, run, &schedule, s,
+			s ? &boxes[s - 1] : NULL, s + 1 < schedule.num_stages ? &boxes[s] : NULL);
+	}
+	for (int s = 0; s < schedule.num_stages; s++)
+		threads[s].join();
+	delete[] threads;
+	delete[] boxes;
+
+	for (int s = 0; s < schedule.num_stages; s++)
+		free_stage(run, &schedule.stages[s]);
+	free(schedule.stages);
+}
+
+#endif
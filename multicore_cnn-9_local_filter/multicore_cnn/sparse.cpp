@@ -0,0 +1,118 @@
+#include "cnn.h"
+
+/*
+ * Structured pruning.
+ * Channels flow from a producer (conv or fc) through pools to the next conv
+ * or fc. A channel is removed when the producer always outputs 0 for it
+ * (all-zero filter and bias <= 0, so ReLU gives 0) or when nothing reads it
+ * (all-zero weights in the consumer and in any exit head on the way).
+ * The weights of the producer, the consumer and those heads are compacted
+ * in place and the layer sizes shrink, so everything downstream sees a
+ * smaller dense network.
+ */
+
+static int all_zero(const float *p, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		if (p[i] != 0.0f)
+			return 0;
+	return 1;
+}
+
+static int is_weight_layer(const layer_t *layer)
+{
+	return layer->type == LAYER_CONV || layer->type == LAYER_FC;
+}
+
+/*
+ * Keep the rows listed in keep[] of a matrix with row_size floats per row,
+ * or the columns of k floats of a (rows, cols * k) matrix, in place.
+ */
+static void compact_rows(float *w, size_t row_size, const int *keep, int kept)
+{
+	for (int r = 0; r < kept; r++)
+		memmove(w + row_size * r, w + row_size * keep[r], sizeof(float) * row_size);
+}
+
+static void compact_columns(float *w, int rows, int cols, size_t k, const int *keep, int kept)
+{
+	for (int r = 0; r < rows; r++)
+		for (int c = 0; c < kept; c++)
+			memmove(w + ((size_t)r * kept + c) * k, w + ((size_t)r * cols + keep[c]) * k, sizeof(float) * k);
+}
+
+void prune_network(network_t *net)
+{
+	for (int p = 0; p < net->num_layers; p++) {
+		layer_t *producer = &net->layers[p];
+		if (!is_weight_layer(producer))
+			continue;
+		int c = p + 1;
+		while (c < net->num_layers && net->layers[c].type == LAYER_POOL)
+			c++;
+		if (c == net->num_layers || !is_weight_layer(&net->layers[c]))
+			continue;
+		layer_t *consumer = &net->layers[c];
+
+		const int D = producer->D2;
+		const size_t in_row = (size_t)producer->D1 * (producer->type == LAYER_CONV ? 3 * 3 : 1);
+		// floats of the consumer's weights per (output, channel)
+		const size_t k = (consumer->type == LAYER_CONV) ? 3 * 3 : consumer->D1 / D;
+
+		int *keep = (int*)malloc(sizeof(int) * D);
+		char *kept_flag = (char*)calloc(D, 1);
+		int kept = 0;
+		for (int ch = 0; ch < D; ch++) {
+			int dead = all_zero(producer->weights + in_row * ch, in_row) && producer->biases[ch] <= 0;
+			int used = 0;
+			for (int o = 0; o < consumer->D2 && !used; o++)
+				used = !all_zero(consumer->weights + ((size_t)o * D + ch) * k, k);
+			for (int l = p; l < c; l++) {
+				if (net->layers[l].exit < 0)
+					continue;
+				exit_t *head = &net->exits[net->layers[l].exit];
+				// without EARLY_EXIT the heads are parsed but never read
+				for (int m = 0; head->weights && m < head->M && !used; m++)
+					used = head->weights[(size_t)m * D + ch] != 0.0f;
+			}
+			kept_flag[ch] = !dead && used;
+			kept += kept_flag[ch];
+		}
+		// keep whole channel blocks, and at least one channel
+		for (int ch = 0; ch < D && (kept == 0 || CHANNEL_PAD(kept) != kept); ch++) {
+			if (!kept_flag[ch]) {
+				kept_flag[ch] = 1;
+				kept++;
+			}
+		}
+		if (kept == D) {
+			free(keep);
+			free(kept_flag);
+			continue;
+		}
+		kept = 0;
+		for (int ch = 0; ch < D; ch++)
+			if (kept_flag[ch])
+				keep[kept++] = ch;
+
+		compact_rows(producer->weights, in_row, keep, kept);
+		compact_rows(producer->biases, 1, keep, kept);
+		producer->D2 = kept;
+		for (int l = p + 1; l < c; l++)
+			net->layers[l].D1 = net->layers[l].D2 = kept;
+		for (int l = p; l < c; l++) {
+			if (net->layers[l].exit < 0)
+				continue;
+			exit_t *head = &net->exits[net->layers[l].exit];
+			if (head->weights)
+				compact_columns(head->weights, head->M, D, 1, keep, kept);
+			head->D = kept;
+		}
+		compact_columns(consumer->weights, consumer->D2, D, k, keep, kept);
+		consumer->D1 = (int)(kept * k / (consumer->type == LAYER_CONV ? 3 * 3 : 1));
+
+		printf("pruned layer %2d : %d of %d channels kept\n", p, kept, D);
+		free(keep);
+		free(kept_flag);
+	}
+}
@@ -17,10 +17,19 @@ void print_usage_and_exit(char **argv)
 {
 	fprintf(stderr, "Usage: %s <number of image> <output>\n", argv[0]);
 	fprintf(stderr, " e.g., %s 3000 result.out\n", argv[0]);
+#ifdef MULTI_PROCESS
+	fprintf(stderr, "       %s --worker <first image>, run by the coordinator\n", argv[0]);
+#endif
 	exit(EXIT_FAILURE);
 }
 
 void* read_bytes(const char *fn, size_t n)
+{
+	return read_bytes_at(fn, 0, n);
+}
+
+// n bytes from offset on
+void* read_bytes_at(const char *fn, size_t offset, size_t n)
 {
 	FILE *f = fopen(fn, "rb");
 	if (f == NULL)
@@ -28,6 +37,10 @@ void* read_bytes(const char *fn, size_t n)
 		fprintf(stderr, "no such file \n");
 		exit(EXIT_FAILURE);
 	}
+	if (offset && fseek(f, (long)offset, SEEK_SET) != 0) {
+		fprintf(stderr, "%s: cannot seek to byte %zd\n", fn, offset);
+		exit(EXIT_FAILURE);
+	}
 	void *bytes = malloc(n);
 	size_t r = fread(bytes, 1, n, f);
 	fclose(f);
@@ -46,9 +59,9 @@ void* read_bytes(const char *fn, size_t n)
  * Thus, 10000 * 3 * 32 * 32 * sizeof(float) = 122880000 bytes are expected.
  */
 const int IMAGE_CHW = 3 * 32 * 32 * sizeof(float);
-float* read_images(size_t n)
+float* read_images(size_t first, size_t n)
 {
-	return (float*)read_bytes("cifar10_image.bin", n * IMAGE_CHW);
+	return (float*)read_bytes_at("cifar10_image.bin", first * IMAGE_CHW, n * IMAGE_CHW);
 }
 
 /*
@@ -60,8 +73,241 @@ int* read_labels(size_t n)
 	return (int*)read_bytes("cifar10_label.bin", n * sizeof(int));
 }
 
+/*
+ * Network description.
+ * One layer per line, '#' starts a comment.
+ *   conv    <D1> <D2> <N>   3x3 convolution + ReLU, zero-padded by 1
+ *   pool    <D> <N>         2x2 max pooling, N = output width and height
+ *   fc      <N> <M>         fully connected + ReLU, N inputs and M outputs
+ *   softmax <N>
+ *   exit    <M>             early-exit head on the previous conv or pool layer:
+ *                           global average pooling, fc to M classes and softmax
+ * A conv or pool line may end with the target it runs on with HETERO_SCHEDULE:
+ * @acc (or @gpu), @cpu for the CPU OpenCL device, @host for native host threads.
+ * Layers without one follow the previous layer; if no layer has one, the
+ * schedule is chosen from measured timings.
+ * Weights and biases of conv and fc layers are stored in network.bin
+ * in the order the layers appear, those of exit heads in network_exits.bin.
+ * If "network.cfg" does not exist, VGG-16 for CIFAR-10 below is used.
+ */
+static const char *DEFAULT_NETWORK =
+	"conv      3  64 32\n"
+	"conv     64  64 32\n"
+	"pool     64  16\n"
+	"conv     64 128 16\n"
+	"conv    128 128 16\n"
+	"pool    128   8\n"
+	"conv    128 256  8\n"
+	"conv    256 256  8\n"
+	"conv    256 256  8\n"
+	"pool    256   4\n"
+	"conv    256 512  4\n"
+	"conv    512 512  4\n"
+	"conv    512 512  4\n"
+	"pool    512   2\n"
+	"conv    512 512  2\n"
+	"conv    512 512  2\n"
+	"conv    512 512  2\n"
+	"pool    512   1\n"
+	"fc      512 512\n"
+	"fc      512 512\n"
+	"fc      512  10\n"
+	"softmax  10\n";
+
+size_t layer_in_size(const layer_t *layer)
+{
+	switch (layer->type) {
+	case LAYER_CONV: return (size_t)layer->D1 * layer->N * layer->N;
+	case LAYER_POOL: return (size_t)layer->D1 * layer->N * layer->N * 4;
+	default:         return (size_t)layer->D1;
+	}
+}
+
+size_t layer_out_size(const layer_t *layer)
+{
+	return (size_t)layer->D2 * layer->N * layer->N;
+}
+
+/*
+ * Number of floats the input / output of a layer takes per image in memory.
+ * It differs from the sizes above only when conv and pool activations are
+ * blocked and their channel count is padded (LAYOUT_NCHWC), or their planes
+ * have a zero halo (ZERO_HALO).
+ */
+size_t layer_in_storage(const layer_t *layer)
+{
+	switch (layer->type) {
+	case LAYER_CONV: return (size_t)CHANNEL_PAD(layer->D1) * PLANE_SIZE(layer->N);
+	case LAYER_POOL: return (size_t)CHANNEL_PAD(layer->D1) * PLANE_SIZE(layer->N * 2);
+	default:         return layer_in_size(layer);
+	}
+}
+
+size_t layer_out_storage(const layer_t *layer)
+{
+	switch (layer->type) {
+	case LAYER_CONV:
+	case LAYER_POOL: return (size_t)CHANNEL_PAD(layer->D2) * PLANE_SIZE(layer->N);
+	default:         return layer_out_size(layer);
+	}
+}
+
+static void parse_error(const char *fn, int line, const char *msg)
+{
+	fprintf(stderr, "%s:%d: %s\n", fn, line, msg);
+	exit(EXIT_FAILURE);
+}
+
+static network_t* parse_network(const char *text, const char *fn)
+{
+	network_t *net = (network_t*)calloc(1, sizeof(network_t));
+	int capacity = 32;
+	net->layers = (layer_t*)calloc(capacity, sizeof(layer_t));
+
+	int line = 0;
+	int block = 0;
+	while (*text) {
+		char buf[256] = { 0 };
+		size_t len = strcspn(text, "\n");
+		if (len >= sizeof(buf))
+			parse_error(fn, line + 1, "line too long");
+		memcpy(buf, text, len);
+		text += len;
+		if (*text == '\n')
+			text++;
+		line++;
+
+		char *comment = strchr(buf, '#');
+		if (comment)
+			*comment = '\0';
+
+		int target = TARGET_AUTO;
+		char *at = strchr(buf, '@');
+		if (at) {
+			char name[16] = { 0 };
+			sscanf(at + 1, "%15s", name);
+			if (strcmp(name, "acc") == 0 || strcmp(name, "gpu") == 0)
+				target = TARGET_ACCEL;
+			else if (strcmp(name, "cpu") == 0)
+				target = TARGET_CPU;
+			else if (strcmp(name, "host") == 0)
+				target = TARGET_HOST;
+			else
+				parse_error(fn, line, "unknown target, expected @acc, @gpu, @cpu or @host");
+			*at = '\0';
+		}
+
+		char type[16];
+		int a = 0, b = 0, c = 0;
+		int n = sscanf(buf, "%15s %d %d %d", type, &a, &b, &c);
+		if (n <= 0)
+			continue;
+
+		if (strcmp(type, "exit") == 0) {
+			layer_t *prev = net->num_layers ? &net->layers[net->num_layers - 1] : NULL;
+			if (n != 2 || a <= 0 || target != TARGET_AUTO)
+				parse_error(fn, line, "expected exit <M>");
+			if (!prev || (prev->type != LAYER_CONV && prev->type != LAYER_POOL) || prev->exit >= 0)
+				parse_error(fn, line, "an exit head must follow a conv or pool layer without one");
+			net->exits = (exit_t*)realloc(net->exits, (net->num_exits + 1) * sizeof(exit_t));
+			exit_t *head = &net->exits[net->num_exits];
+			memset(head, 0, sizeof(exit_t));
+			head->after = net->num_layers - 1;
+			head->D = prev->D2;
+			head->N = prev->N;
+			head->M = a;
+			net->num_exit_params += (size_t)head->M * head->D + head->M;
+			prev->exit = net->num_exits++;
+			continue;
+		}
+
+		if (net->num_layers == capacity) {
+			capacity *= 2;
+			net->layers = (layer_t*)realloc(net->layers, capacity * sizeof(layer_t));
+		}
+		layer_t *layer = &net->layers[net->num_layers];
+		memset(layer, 0, sizeof(layer_t));
+		layer->exit = -1;
+		layer->fused_last = -1;
+		layer->index = net->num_layers;
+
+		if (strcmp(type, "conv") == 0 && n == 4) {
+			layer->type = LAYER_CONV;
+			layer->D1 = a; layer->D2 = b; layer->N = c;
+			layer->block = block;
+			net->num_blocks = block + 1;
+			net->num_params += (size_t)b * a * 3 * 3 + b;
+		}
+		else if (strcmp(type, "pool") == 0 && n == 3) {
+			layer->type = LAYER_POOL;
+			layer->D1 = layer->D2 = a; layer->N = b;
+			block++;
+		}
+		else if (strcmp(type, "fc") == 0 && n == 3) {
+			layer->type = LAYER_FC;
+			layer->D1 = a; layer->D2 = b; layer->N = 1;
+			net->num_params += (size_t)b * a + b;
+		}
+		else if (strcmp(type, "softmax") == 0 && n == 2) {
+			layer->type = LAYER_SOFTMAX;
+			layer->D1 = layer->D2 = a; layer->N = 1;
+		}
+		else {
+			parse_error(fn, line, "unknown layer or wrong number of parameters");
+		}
+
+		if (target != TARGET_AUTO && layer->type != LAYER_CONV && layer->type != LAYER_POOL)
+			parse_error(fn, line, "only conv and pool layers take a target");
+		layer->target = target;
+
+		if (layer->D1 <= 0 || layer->D2 <= 0 || layer->N <= 0)
+			parse_error(fn, line, "layer sizes must be positive");
+		if (net->num_layers > 0 &&
+			layer_out_size(&net->layers[net->num_layers - 1]) != layer_in_size(layer))
+			parse_error(fn, line, "input size does not match output size of the previous layer");
+#ifdef LAYOUT_NCHWC
+		if (net->num_layers > 0 && layer->type != LAYER_CONV && layer->type != LAYER_POOL &&
+			(net->layers[net->num_layers - 1].type == LAYER_CONV || net->layers[net->num_layers - 1].type == LAYER_POOL) &&
+			CHANNEL_PAD(net->layers[net->num_layers - 1].D2) != net->layers[net->num_layers - 1].D2)
+			parse_error(fn, line, "channel size feeding this layer must be a multiple of LAYOUT_NCHWC");
+#endif
+		if (block >= MAX_BLOCKS)
+			parse_error(fn, line, "too many blocks");
+
+		net->num_layers++;
+	}
+
+	if (net->num_layers == 0)
+		parse_error(fn, line, "empty network");
+	if (net->layers[0].type != LAYER_CONV || layer_in_size(&net->layers[0]) * sizeof(float) != (size_t)IMAGE_CHW)
+		parse_error(fn, 1, "first layer must be a conv taking a (3, 32, 32) image");
+	for (int k = 0; k < net->num_exits; k++)
+		if ((size_t)net->exits[k].M != layer_out_size(&net->layers[net->num_layers - 1]))
+			parse_error(fn, line, "exit heads must have as many classes as the network output");
+
+	return net;
+}
+
+network_t* read_network_desc(const char *fn)
+{
+	FILE *f = fopen(fn, "rb");
+	if (f == NULL)
+		return parse_network(DEFAULT_NETWORK, "default network");
+
+	fseek(f, 0, SEEK_END);
+	size_t n = (size_t)ftell(f);
+	fclose(f);
+	char *text = (char*)read_bytes(fn, n);
+	text = (char*)realloc(text, n + 1);
+	text[n] = '\0';
+	network_t *net = parse_network(text, fn);
+	free(text);
+	return net;
+}
+
 /*
  * Read network from "network.bin".
+ * For the default network:
  * conv1_1 : weight ( 64,   3, 3, 3) bias ( 64)
  * conv1_2 : weight ( 64,  64, 3, 3) bias ( 64)
  * conv2_1 : weight (128,  64, 3, 3) bias (128)
@@ -80,36 +326,91 @@ int* read_labels(size_t n)
  * fc3     : weight ( 10, 512) bias ( 10)
  * Thus, 60980520 bytes are expected.
  */
-const int NETWORK_SIZES[] = {
-	64 * 3 * 3 * 3, 64,
-	64 * 64 * 3 * 3, 64,
-	128 * 64 * 3 * 3, 128,
-	128 * 128 * 3 * 3, 128,
-	256 * 128 * 3 * 3, 256,
-	256 * 256 * 3 * 3, 256,
-	256 * 256 * 3 * 3, 256,
-	512 * 256 * 3 * 3, 512,
-	512 * 512 * 3 * 3, 512,
-	512 * 512 * 3 * 3, 512,
-	512 * 512 * 3 * 3, 512,
-	512 * 512 * 3 * 3, 512,
-	512 * 512 * 3 * 3, 512,
-	512 * 512, 512,
-	512 * 512, 512,
-	10 * 512, 10
-};
+float* read_network(network_t *net)
+{
+	return (float*)read_bytes("network.bin", net->num_params * sizeof(float));
+}
 
-float* read_network()
+/*
+ * Read the exit heads from "network_exits.bin", for each head in order
+ * weight (M, D) and bias (M).
+ * Returns NULL if the network has no exit heads.
+ */
+float* read_exits(network_t *net)
 {
-	return (float*)read_bytes("network.bin", 60980520);
+	if (net->num_exits == 0)
+		return NULL;
+	float *params = (float*)read_bytes("network_exits.bin", net->num_exit_params * sizeof(float));
+	float *p = params;
+	for (int k = 0; k < net->num_exits; k++) {
+		exit_t *head = &net->exits[k];
+		head->weights = p;
+		p += (size_t)head->M * head->D;
+		head->biases = p;
+		p += head->M;
+	}
+	return params;
 }
 
-float** slice_network(float *p)
+/*
+ * How many images left at each exit head and how accurate they were,
+ * compared with the full run recorded in seq.out.
+ */
+void print_exit_report(network_t *net, int *labels, int *labels_ans, int num_images, const char *full_run)
 {
-	float **r = (float**)malloc(sizeof(float*) * 32);
-	for (int i = 0; i < 32; ++i) {
-		r[i] = p;
-		p += NETWORK_SIZES[i];
+	printf("early exit :\n");
+	for (int k = -1; k < net->num_exits; k++) {
+		int count = 0, correct = 0;
+		for (int i = 0; i < num_images; i++) {
+			if (net->exit_of[i] != k)
+				continue;
+			count++;
+			correct += labels[i] == labels_ans[i];
+		}
+		if (k >= 0)
+			printf("  exit %d after layer %2d : ", k, net->exits[k].after);
+		else
+			printf("  full network         : ");
+		printf("%6.2lf %% of images, accuracy %6.2lf %%\n",
+			100.0 * count / num_images, count ? 100.0 * correct / count : 0.0);
 	}
-	return r;
-}
\ No newline at end of file
+
+	FILE *f = fopen(full_run, "r");
+	if (f == NULL)
+		return;
+	int compared = 0, same = 0, correct = 0, correct_full = 0;
+	for (int i = 0; i < num_images; i++) {
+		int n;
+		char name[16];
+		float confidence;
+		if (fscanf(f, "Image %d: %15s %f\n", &n, name, &confidence) != 3 || n != i)
+			break;
+		int label = -1;
+		for (int c = 0; c < 10; c++)
+			if (strcmp(name, CLASS_NAME[c]) == 0)
+				label = c;
+		compared++;
+		same += label == labels[i];
+		correct += labels[i] == labels_ans[i];
+		correct_full += label == labels_ans[i];
+	}
+	fclose(f);
+	if (compared)
+		printf("  accuracy %.2lf %% vs %.2lf %% for the full run in %s (%+.2lf %%), %.2lf %% same class, %d images\n",
+			100.0 * correct / compared, 100.0 * correct_full / compared, full_run,
+			100.0 * (correct - correct_full) / compared, 100.0 * same / compared, compared);
+}
+
+void slice_network(network_t *net, float *p)
+{
+	for (int i = 0; i < net->num_layers; ++i) {
+		layer_t *layer = &net->layers[i];
+		if (layer->type != LAYER_CONV && layer->type != LAYER_FC)
+			continue;
+		int k = (layer->type == LAYER_CONV) ? 3 * 3 : 1;
+		layer->weights = p;
+		p += (size_t)layer->D2 * layer->D1 * k;
+		layer->biases = p;
+		p += layer->D2;
+	}
+}
@@ -1,146 +1,418 @@
-int main() {}
-
-//#include <stdio.h>
-//#include <stdlib.h>
-//#include <math.h>
-//#include <string.h>
-//#include <time.h>
-//#include "cnn.h"
-//
-//static void convolution3x3(float *input, float *output, float *filter, int N) {
-//	int i, j, k, l;
-//	for (i = 0; i < N; i++) {
-//		for (j = 0; j < N; j++) {
-//			float sum = 0;
-//			for (k = 0; k < 3; k++) {
-//				for (l = 0; l < 3; l++) {
-//					int x = i + k - 1;
-//					int y = j + l - 1;
-//					if (x >= 0 && x < N && y >= 0 && y < N)
-//						sum += input[x * N + y] * filter[k * 3 + l];
-//				}
-//			}
-//			output[i * N + j] += sum;
-//		}
-//	}
-//}
-//
-///*
-// * D2 = output channel size
-// * D1 = input channel size
-// * N = width and height of an input image
-// * input image is zero-padded by 1.
-// * Thus, input is (D1, N, N) and output is (D2, N, N)
-// */
-//#define ReLU(x) (((x)>0)?(x):0)
-//static void convolution_layer_seq(float *inputs, float *outputs, float *filters, float *biases, int D2, int D1, int N) {
-//	int i, j;
-//
-//	memset(outputs, 0, sizeof(float) * N * N * D2);
-//
-//	for (j = 0; j < D2; j++) {
-//		for (i = 0; i < D1; i++) {
-//			float * input = inputs + N * N * i;
-//			float * output = outputs + N * N * j;
-//			float * filter = filters + 3 * 3 * (j * D1 + i);
-//			convolution3x3(input, output, filter, N);
-//		}
-//	}
-//
-//	for (i = 0; i < D2; i++) {
-//		float * output = outputs + N * N * i;
-//		float bias = biases[i];
-//		for (j = 0; j < N * N; j++) {
-//			output[j] = ReLU(output[j] + bias);
-//		}
-//	}
-//}
-//
-//int main()
-//{
-//	int batch_size = 256;
-//	clock_t start, end;
-//
-//	int num_images = batch_size;
-//	float *images = read_images(num_images);
-//	float *network = read_network();
-//	float **network_sliced = slice_network(network);
-//	int *labels = (int*)calloc(num_images, sizeof(int));
-//	float *confidences = (float*)calloc(num_images, sizeof(float));
-//
-//	cnn_init();
-//
-//	float* c1_1 = alloc_layer(64 * 32 * 32 * batch_size);
-//	float* c1_2 = alloc_layer(64 * 32 * 32 * batch_size);
-//	float* w1_1 = network_sliced[0];
-//	float* b1_1 = network_sliced[1];
-//	float* w1_2 = network_sliced[2];
-//	float* b1_2 = network_sliced[3];
-//	float* p1 = alloc_layer(64 * 16 * 16 * batch_size);
-//
-//	float* clOut = alloc_layer(64 * 32 * 32 * batch_size);
-//	float* seqOut = alloc_layer(64 * 32 * 32 * batch_size);
-//
-//	// conv test
-//
-//	convolution_layer(images, c1_1, w1_1, b1_1, 64, 3, 32, batch_size);
-//	memcpy(clOut, c1_1, sizeof(float) * 64 * 32 * 32 * batch_size);
-//
-//	for (int batch = 0; batch < batch_size; batch++)
-//	{
-//		float* image = images + batch * 3 * 32 * 32;
-//		convolution_layer_seq(image, c1_1, w1_1, b1_1, 64, 3, 32);
-//		memcpy(seqOut + batch * 64 * 32 * 32, c1_1, sizeof(float) * 64 * 32 * 32);
-//	}
-//
-//	if (memcmp(clOut, seqOut, sizeof(float) * 64 * 32 * 32 * batch_size) == 0)
-//	{
-//		printf("result same \n");
-//	}
-//	else
-//	{
-//		printf("result difference \n");
-//		return -1;
-//	}
-//
-//	// conv+pooling test
-//
-//	start = clock();
-//	convolution_layer(images, c1_1, w1_1, b1_1, 64, 3, 32, batch_size);
-//	convolution_layer(c1_1, c1_2, w1_2, b1_2, 64, 64, 32, batch_size);
-//	for (int batch = 0; batch < batch_size; batch++)
-//	{
-//		pooling_layer(c1_2 + 64 * 32 * 32 * batch, p1 + 64 * 16 * 16 * batch, 64, 16);
-//	}
-//	memcpy(clOut, p1, sizeof(float) * 64 * 16 * 16 * batch_size);
-//	end = clock();
-//	printf("OpenCL Elapsed time: %f sec\n", (double)(end - start) / CLK_TCK);
-//
-//	start = clock();
-//	for (int batch = 0; batch < batch_size; batch++)
-//	{
-//		float* image = images + batch * 3 * 32 * 32;
-//		convolution_layer_seq(image, c1_1, w1_1, b1_1, 64, 3, 32);
-//		convolution_layer_seq(c1_1, c1_2, w1_2, b1_2, 64, 64, 32);
-//		pooling_layer(c1_2, p1, 64, 16);
-//		memcpy(seqOut + batch * 64 * 16 * 16, p1, sizeof(float) * 64 * 16 * 16);
-//	}
-//	end = clock();
-//	printf("seq    Elapsed time: %f sec\n", (double)(end - start) / CLK_TCK);
-//
-//	if (memcmp(clOut, seqOut, sizeof(float) * 64 * 16 * 16 * batch_size) == 0)
-//	{
-//		printf("result same \n");
-//	}
-//	else
-//	{
-//		printf("result difference \n");
-//	}
-//
-//	for (int i = 0; i < 10; i++)
-//	{
-//		printf("%f ", seqOut[i]);
-//	}
-//
-//	return 0;
-//}
\ No newline at end of file
+#pragma warning(disable:4996)
+#include "cnn.h"
+#include <algorithm>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#include <sys/utime.h>
+#else
+#include <unistd.h>
+#include <utime.h>
+#endif
+
+/*
+ * Host-only tests, no OpenCL device is needed. They write their files in
+ * TEST_DIR, so the network.cfg and network.bin next to the program are left
+ * alone. Each prints "result same" or "result difference", main returns -1
+ * if any test failed.
+ */
+#define TEST_DIR "unit_test.tmp"
+#define TEST_IMAGES 3
+
+static void enter_test_dir()
+{
+#ifdef _WIN32
+	_mkdir(TEST_DIR);
+	_chdir(TEST_DIR);
+#else
+	mkdir(TEST_DIR, 0755);
+	chdir(TEST_DIR);
+#endif
+}
+
+static int report(const char *name, int same)
+{
+	printf("%-14s : %s\n", name, same ? "result same" : "result difference");
+	return same ? 0 : -1;
+}
+
+static float random_weight()
+{
+	return (float)(rand() % 200) / 100 - 1;
+}
+
+/*
+ * Small network with dead and unused channels:
+ * conv1 outputs 0 and 2 are dead, 5 and 7 are never read by conv2 or by the
+ * exit head after conv1, conv2 outputs 1 and 6 are dead, 3 and 4 are never
+ * read by fc1, fc1 outputs 1 and 4 are dead.
+ * The head only has weights with EARLY_EXIT, as in load_network.
+ */
+static const char *PRUNE_NETWORK = "conv 3 8 32\nexit 4\nconv 8 8 32\npool 8 16\nfc 2048 6\nfc 6 4\nsoftmax 4\n";
+
+static void kill_output(layer_t *layer, int o)
+{
+	const size_t row = (size_t)layer->D1 * (layer->type == LAYER_CONV ? 3 * 3 : 1);
+	memset(layer->weights + row * o, 0, sizeof(float) * row);
+	layer->biases[o] = -0.5f;
+}
+
+// k floats per (output, input channel) of the consumer
+static void kill_input(layer_t *layer, int c, int D, int k)
+{
+	for (int o = 0; o < layer->D2; o++)
+		memset(layer->weights + ((size_t)o * D + c) * k, 0, sizeof(float) * k);
+}
+
+static network_t* write_test_network()
+{
+	FILE *f = fopen("network.cfg", "w");
+	fputs(PRUNE_NETWORK, f);
+	fclose(f);
+	return read_network_desc("network.cfg");
+}
+
+static network_t* prune_test_network(float **params)
+{
+	network_t *net = write_test_network();
+	srand(1);
+	*params = (float*)malloc(sizeof(float) * net->num_params);
+	for (size_t i = 0; i < net->num_params; i++)
+		(*params)[i] = random_weight();
+	slice_network(net, *params);
+	// keep the activations small, a saturated softmax would hide differences
+	for (int l = 0; l < net->num_layers; l++) {
+		layer_t *layer = &net->layers[l];
+		if (layer->type != LAYER_CONV && layer->type != LAYER_FC)
+			continue;
+		const size_t row = (size_t)layer->D1 * (layer->type == LAYER_CONV ? 3 * 3 : 1);
+		for (size_t i = 0; i < row * layer->D2; i++)
+			layer->weights[i] /= sqrtf((float)row);
+	}
+
+	layer_t *conv1 = &net->layers[0], *conv2 = &net->layers[1], *fc1 = &net->layers[3];
+	kill_output(conv1, 0);
+	kill_output(conv1, 2);
+	kill_input(conv2, 5, 8, 3 * 3);
+	kill_input(conv2, 7, 8, 3 * 3);
+	kill_output(conv2, 1);
+	kill_output(conv2, 6);
+	kill_input(fc1, 3, 8, 16 * 16);
+	kill_input(fc1, 4, 8, 16 * 16);
+	kill_output(fc1, 1);
+	kill_output(fc1, 4);
+#ifdef EARLY_EXIT
+	exit_t *head = &net->exits[0];
+	head->weights = (float*)malloc(sizeof(float) * net->num_exit_params);
+	head->biases = head->weights + (size_t)head->M * head->D;
+	for (size_t i = 0; i < net->num_exit_params; i++)
+		head->weights[i] = random_weight();
+	for (int m = 0; m < head->M; m++)
+		head->weights[m * head->D + 5] = head->weights[m * head->D + 7] = 0;
+#endif
+	for (int l = 0; l < net->num_layers; l++)
+		net->layers[l].target = TARGET_HOST;
+	return net;
+}
+
+/*
+ * Run the layers of net on the host, returns the softmax outputs.
+ * input is in the storage layout of the first layer.
+ */
+static float* run_host(network_t *net, const float *input, int imageCnt)
+{
+	size_t largest = 0;
+	for (int l = 0; l < net->num_layers; l++)
+		largest = std::max(largest, std::max(layer_in_storage(&net->layers[l]), layer_out_storage(&net->layers[l])));
+	arena_t a, b;
+	memset(&a, 0, sizeof(a));
+	memset(&b, 0, sizeof(b));
+	a.host = (float*)calloc(largest * imageCnt, sizeof(float));
+	b.host = (float*)calloc(largest * imageCnt, sizeof(float));
+	memcpy(a.host, input, sizeof(float) * layer_in_storage(&net->layers[0]) * imageCnt);
+
+	arena_t *in = &a, *out = &b;
+	for (int l = 0; l < net->num_layers; l++) {
+		run_layer(&net->layers[l], l ? &net->layers[l - 1] : NULL, in, out, imageCnt);
+		std::swap(in, out);
+	}
+	const int M = net->layers[net->num_layers - 1].D2;
+	float *result = (float*)malloc(sizeof(float) * M * imageCnt);
+	memcpy(result, in->host, sizeof(float) * M * imageCnt);
+	free(a.host);
+	free(b.host);
+	return result;
+}
+
+/*
+ * prune_network only drops channels that cannot change the result, so the
+ * pruned network classifies like the full one.
+ */
+static int test_prune()
+{
+	float *full_params, *pruned_params;
+	network_t *full = prune_test_network(&full_params);
+	network_t *pruned = prune_test_network(&pruned_params);
+	prune_network(pruned);
+
+	// the channel pad and the halo of the input are never read
+	const size_t in_size = layer_in_storage(&full->layers[0]) * TEST_IMAGES;
+	float *input = (float*)malloc(sizeof(float) * in_size);
+	for (size_t i = 0; i < in_size; i++)
+		input[i] = random_weight();
+
+	float *expected = run_host(full, input, TEST_IMAGES);
+	float *actual = run_host(pruned, input, TEST_IMAGES);
+	const int M = full->layers[full->num_layers - 1].D2;
+	// with LAYOUT_NCHWC 8 the convs keep whole blocks, nothing to prune there
+	int same = pruned->layers[0].D2 < full->layers[0].D2 || CHANNEL_PAD(4) != 4;
+	same &= pruned->exits[0].D == pruned->layers[0].D2;
+	for (int i = 0; i < M * TEST_IMAGES; i++)
+		same &= fabsf(expected[i] - actual[i]) <= 1e-5f * fabsf(expected[i]);
+#ifdef EARLY_EXIT
+	// the head lost the columns of the dropped channels 0, 2, 5 and 7
+	const exit_t *a = &full->exits[0], *b = &pruned->exits[0];
+	const int kept[4] = { 1, 3, 4, 6 };
+	for (int m = 0; m < a->M && b->D == 4; m++)
+		for (int c = 0; c < 4; c++)
+			same &= b->weights[m * 4 + c] == a->weights[m * a->D + kept[c]];
+#endif
+
+	free(input);
+	free(expected);
+	free(actual);
+	free(full_params);
+	free(pruned_params);
+	free(full->exits[0].weights);
+	free(full->exits);
+	free(full->layers);
+	free(full);
+	free(pruned->exits[0].weights);
+	free(pruned->exits);
+	free(pruned->layers);
+	free(pruned);
+	return report("prune", same);
+}
+
+static int same_floats(const float *a, const float *b, size_t n)
+{
+	if (!a || !b)
+		return a == b;
+	return memcmp(a, b, sizeof(float) * n) == 0;
+}
+
+/*
+ * Same sizes after pruning, packed conv weights and block indices, and fc
+ * weights and biases, but the biases of the last fc layer.
+ */
+static int same_network(const network_t *x, const network_t *y)
+{
+	int same = 1;
+	for (int l = 0; l < x->num_layers; l++) {
+		const layer_t *a = &x->layers[l], *b = &y->layers[l];
+		same &= a->D1 == b->D1 && a->D2 == b->D2 && a->sparse_blocks == b->sparse_blocks;
+		if (!same || (a->type != LAYER_CONV && a->type != LAYER_FC))
+			continue;
+		const size_t k = (a->type == LAYER_CONV) ? 3 * 3 : 1;
+		same &= same_floats(a->weights, b->weights, (size_t)a->D2 * a->D1 * k);
+		if (l < x->num_layers - 2)
+			same &= same_floats(a->biases, b->biases, a->D2);
+		if (a->type != LAYER_CONV)
+			continue;
+		const size_t packed = a->sparse_blocks ? (size_t)a->sparse_blocks * 3 * 3 * FILTER_BLOCK * FILTER_BLOCK :
+			(size_t)CHANNEL_PAD(a->D2) * CHANNEL_PAD(a->D1) * 3 * 3;
+		same &= same_floats(a->packed_weights, b->packed_weights, packed);
+		same &= same_floats(a->packed_biases, b->packed_biases, a->D2);
+		if (a->sparse_blocks)
+			same &= memcmp(a->packed_blocks, b->packed_blocks,
+				sizeof(int) * (CHANNEL_PAD(a->D2) / FILTER_BLOCK + 1 + a->sparse_blocks)) == 0;
+	}
+	return same;
+}
+
+static void write_floats(const char *fn, const float *p, size_t n)
+{
+	FILE *f = fopen(fn, "wb");
+	fwrite(p, sizeof(float), n, f);
+	fclose(f);
+}
+
+/*
+ * Write new biases for the last fc layer into network.bin, as a retrained
+ * model would, with the same size and modification time.
+ */
+static void retrain_last_biases(float *params, size_t num_params, int M)
+{
+	struct stat st;
+	stat("network.bin", &st);
+	for (int m = 0; m < M; m++)
+		params[num_params - M + m] += 1.0f;
+	write_floats("network.bin", params, num_params);
+	struct utimbuf times;
+	times.actime = st.st_atime;
+	times.modtime = st.st_mtime;
+	utime("network.bin", &times);
+}
+
+/*
+ * network.cfg, network.bin and network_exits.bin of the test network, with
+ * mostly zero weights so SPARSE_WEIGHTS finds empty blocks. Returns the
+ * parameters written to network.bin.
+ */
+static float* write_test_params(size_t *num_params)
+{
+	network_t *net = write_test_network();
+	*num_params = net->num_params;
+	float *params = (float*)malloc(sizeof(float) * net->num_params);
+	for (size_t i = 0; i < net->num_params; i++)
+		params[i] = (rand() % 3) ? 0.0f : random_weight();
+	slice_network(net, params);
+	kill_output(&net->layers[1], 3);
+	write_floats("network.bin", params, net->num_params);
+	float *exit_params = (float*)malloc(sizeof(float) * net->num_exit_params);
+	for (size_t i = 0; i < net->num_exit_params; i++)
+		exit_params[i] = random_weight();
+	write_floats("network_exits.bin", exit_params, net->num_exit_params);
+	free(exit_params);
+	free(net->exits);
+	free(net->layers);
+	free(net);
+	return params;
+}
+
+static void free_loaded(network_t *net, float *params, float *exits)
+{
+	free(params);
+	free(exits);
+	free(net->exits);
+	free(net->layers);
+	free(net);
+}
+
+/*
+ * A run that finds the model cache file (MODEL_CACHE) gets the same network
+ * as the run that wrote it. When network.bin changes, even with the same
+ * size and time, the next run repacks it: the changed biases of the last fc
+ * layer must show up and the model key must change, also without
+ * MODEL_CACHE (the result cache is keyed on it).
+ */
+static int test_model_cache()
+{
+	size_t num_params;
+	float *params = write_test_params(&num_params);
+
+	char pack[64];
+#ifdef LAYOUT_NCHWC
+	sprintf(pack, "network.nchwc%u.pack", LAYOUT_NCHWC);
+#else
+	sprintf(pack, "network.nchw.pack");
+#endif
+	remove(pack);
+
+	float *old_exits, *new_exits, *hit_exits;
+	network_t *old_net = read_network_desc("network.cfg");
+	float *old_params = load_network(old_net, &old_exits);
+	const layer_t *last = &old_net->layers[old_net->num_layers - 2];
+	retrain_last_biases(params, num_params, last->D2);
+	network_t *new_net = read_network_desc("network.cfg");
+	float *new_params = load_network(new_net, &new_exits);
+	network_t *hit = read_network_desc("network.cfg");
+	float *hit_params = load_network(hit, &hit_exits);
+
+	int same = old_net->model_key != new_net->model_key && new_net->model_key == hit->model_key;
+#ifdef MODEL_CACHE
+	FILE *f = fopen(pack, "rb");
+	same &= f != NULL;
+	if (f)
+		fclose(f);
+#endif
+	same &= same_network(old_net, new_net) && same_network(new_net, hit);
+	const layer_t *new_last = &new_net->layers[new_net->num_layers - 2], *hit_last = &hit->layers[hit->num_layers - 2];
+	same &= same_floats(new_last->biases, params + num_params - last->D2, last->D2);
+	same &= same_floats(hit_last->biases, params + num_params - last->D2, last->D2);
+
+	free_loaded(old_net, old_params, old_exits);
+	free_loaded(new_net, new_params, new_exits);
+	free_loaded(hit, hit_params, hit_exits);
+	free(params);
+	remove(pack);
+	return report("model cache", same);
+}
+
+#ifdef RESULT_CACHE
+extern const char *result_cache_file;
+
+#define CACHE_TEST_IMAGES 1500  // more than RESULT_MIN_CAPACITY / 2, so the table grows
+#define CACHE_TEST_SIZE 16
+
+static void cache_test_image(float *image, int i)
+{
+	for (int k = 0; k < CACHE_TEST_SIZE; k++)
+		image[k] = (float)(i * CACHE_TEST_SIZE + k);
+}
+
+/*
+ * Results inserted in one run are found in the same run and, through
+ * result_cache_file, in the next one with the same model; a run after
+ * network.bin changed, with the same size and time, starts empty.
+ */
+static int test_result_cache()
+{
+	result_cache_file = "result.cache";
+	remove(result_cache_file);
+	size_t num_params;
+	float *params = write_test_params(&num_params), *net_params, *exits;
+	network_t *net = read_network_desc("network.cfg");
+	net_params = load_network(net, &exits);
+
+	float image[CACHE_TEST_SIZE];
+	unsigned long long key;
+	int label, exit, same = 1;
+	float confidence;
+	result_cache_open(net);
+	for (int i = 0; i < CACHE_TEST_IMAGES; i++) {
+		cache_test_image(image, i);
+		same &= !result_cache_find(image, CACHE_TEST_SIZE, &key, &label, &confidence, &exit);
+		result_cache_insert(key, i % 10, (float)i / CACHE_TEST_IMAGES, i % 3 - 1);
+	}
+	cache_test_image(image, 0);
+	same &= result_cache_find(image, CACHE_TEST_SIZE, &key, &label, &confidence, &exit) && label == 0;
+	result_cache_close();
+
+	result_cache_open(net);
+	for (int i = 0; i < CACHE_TEST_IMAGES; i++) {
+		cache_test_image(image, i);
+		same &= result_cache_find(image, CACHE_TEST_SIZE, &key, &label, &confidence, &exit) &&
+			label == i % 10 && confidence == (float)i / CACHE_TEST_IMAGES && exit == i % 3 - 1;
+	}
+	cache_test_image(image, CACHE_TEST_IMAGES);
+	same &= !result_cache_find(image, CACHE_TEST_SIZE, &key, &label, &confidence, &exit);
+	result_cache_close();
+
+	retrain_last_biases(params, num_params, net->layers[net->num_layers - 2].D2);
+	free_loaded(net, net_params, exits);
+	net = read_network_desc("network.cfg");
+	net_params = load_network(net, &exits);
+	result_cache_open(net);
+	cache_test_image(image, 0);
+	same &= !result_cache_find(image, CACHE_TEST_SIZE, &key, &label, &confidence, &exit);
+	result_cache_close();
+
+	free_loaded(net, net_params, exits);
+	free(params);
+	remove(result_cache_file);
+	return report("result cache", same);
+}
+#endif
+
+int main()
+{
+	enter_test_dir();
+	int failed = 0;
+	failed |= test_prune();
+	failed |= test_model_cache();
+#ifdef RESULT_CACHE
+	failed |= test_result_cache();
+#endif
+	return failed;
+}